@@ -0,0 +1,478 @@
+/*
+ * bench.c
+ *
+ * Copyright 2013 Adin Scannell <adin@scannell.ca>, all rights reserved.
+ *
+ * This file is part of Huptime.
+ *
+ * Huptime is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Huptime is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Huptime.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Measures what the calls we interpose on cost.
+ *
+ * This is meant to be run twice, once as is and once
+ * with huptime.so preloaded (see `make bench`). Each
+ * result is printed as a single line of JSON.
+ *
+ * The descriptor table is filled by dup()'ing an epoll
+ * descriptor, which is cheap for the kernel but gives
+ * huptime an entry for every descriptor.
+ */
+
+#include <stdio.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/syscall.h>
+#include <sys/resource.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+
+/* Calls are timed in batches of this many. */
+#define BATCH (64)
+
+typedef void (*op_fn_t)(int thread, int *fds, int n);
+
+typedef struct
+{
+    const char *name;
+
+    /* Untimed set-up for each batch (may be NULL). */
+    op_fn_t setup;
+
+    /* The calls being measured. */
+    op_fn_t run;
+
+    /* Untimed clean-up for each batch (may be NULL). */
+    op_fn_t cleanup;
+} op_t;
+
+typedef struct
+{
+    pthread_t thread;
+    int index;
+    const op_t *op;
+    long long calls;
+    long long ns;
+} worker_t;
+
+static double duration = 1.0;
+static const char *label = "none";
+static volatile int running = 0;
+static pthread_barrier_t barrier;
+
+/* Per-thread state for the socket benchmarks. */
+#define THREADS_MAX (256)
+static int listeners[THREADS_MAX];
+static struct sockaddr_un listener_addrs[THREADS_MAX];
+static socklen_t listener_addrlens[THREADS_MAX];
+static int dup_src[THREADS_MAX];
+static int dup_dst[THREADS_MAX];
+static long long bind_count[THREADS_MAX];
+
+static long long
+now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static void
+close_all(int thread, int *fds, int n)
+{
+    (void)thread;
+    for( int i = 0; i < n; i += 1 )
+    {
+        if( fds[i] >= 0 )
+        {
+            close(fds[i]);
+        }
+    }
+}
+
+/* close: eventfd() isn't interposed, so only close() is timed. */
+static void
+close_setup(int thread, int *fds, int n)
+{
+    (void)thread;
+    for( int i = 0; i < n; i += 1 )
+    {
+        fds[i] = eventfd(0, 0);
+    }
+}
+
+/* dup: duplicate a descriptor, then close (untimed). */
+static void
+dup_run(int thread, int *fds, int n)
+{
+    for( int i = 0; i < n; i += 1 )
+    {
+        fds[i] = dup(dup_src[thread]);
+    }
+}
+
+/* dup2: replace the same descriptor over and over. */
+static void
+dup2_run(int thread, int *fds, int n)
+{
+    (void)fds;
+    for( int i = 0; i < n; i += 1 )
+    {
+        dup2(dup_src[thread], dup_dst[thread]);
+    }
+}
+
+/* accept4: connect a batch of clients (untimed), then accept them. */
+static void
+accept4_setup(int thread, int *fds, int n)
+{
+    for( int i = 0; i < n; i += 1 )
+    {
+        fds[i] = socket(AF_UNIX, SOCK_STREAM, 0);
+        if( connect(fds[i],
+                    (struct sockaddr*)&listener_addrs[thread],
+                    listener_addrlens[thread]) < 0 )
+        {
+            perror("connect");
+            exit(1);
+        }
+    }
+}
+
+static void
+accept4_run(int thread, int *fds, int n)
+{
+    for( int i = 0; i < n; i += 1 )
+    {
+        fds[n + i] = accept4(listeners[thread], NULL, NULL, SOCK_NONBLOCK);
+    }
+}
+
+static void
+accept4_cleanup(int thread, int *fds, int n)
+{
+    close_all(thread, fds, 2 * n);
+}
+
+/* bind: bind fresh sockets to new (abstract) addresses. */
+static void
+bind_setup(int thread, int *fds, int n)
+{
+    (void)thread;
+    for( int i = 0; i < n; i += 1 )
+    {
+        fds[i] = socket(AF_UNIX, SOCK_DGRAM, 0);
+    }
+}
+
+static void
+bind_run(int thread, int *fds, int n)
+{
+    for( int i = 0; i < n; i += 1 )
+    {
+        struct sockaddr_un addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        int len = snprintf(addr.sun_path + 1, sizeof(addr.sun_path) - 1,
+                           "huptime-bench-%d-%d-%lld",
+                           (int)getpid(), thread, bind_count[thread]++);
+        bind(fds[i], (struct sockaddr*)&addr,
+             offsetof(struct sockaddr_un, sun_path) + 1 + len);
+    }
+}
+
+/* syscall: the cheapest thing we can ask for. */
+static void
+syscall_run(int thread, int *fds, int n)
+{
+    (void)thread;
+    (void)fds;
+    for( int i = 0; i < n; i += 1 )
+    {
+        syscall(SYS_getppid);
+    }
+}
+
+static const op_t ops[] =
+{
+    { "close", close_setup, close_all, NULL },
+    { "dup", NULL, dup_run, close_all },
+    { "dup2", NULL, dup2_run, NULL },
+    { "accept4", accept4_setup, accept4_run, accept4_cleanup },
+    { "bind", bind_setup, bind_run, close_all },
+    { "syscall", NULL, syscall_run, NULL },
+};
+#define OPS_COUNT (sizeof(ops) / sizeof(ops[0]))
+
+static void
+thread_init(int thread)
+{
+    struct sockaddr_un *addr = &listener_addrs[thread];
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    int len = snprintf(addr->sun_path + 1, sizeof(addr->sun_path) - 1,
+                       "huptime-bench-%d-%d", (int)getpid(), thread);
+    listener_addrlens[thread] = offsetof(struct sockaddr_un, sun_path) + 1 + len;
+
+    listeners[thread] = socket(AF_UNIX, SOCK_STREAM, 0);
+    if( listeners[thread] < 0 ||
+        bind(listeners[thread], (struct sockaddr*)addr,
+             listener_addrlens[thread]) < 0 ||
+        listen(listeners[thread], BATCH * 2) < 0 )
+    {
+        perror("listener");
+        exit(1);
+    }
+
+    dup_src[thread] = eventfd(0, 0);
+    dup_dst[thread] = eventfd(0, 0);
+}
+
+static void
+thread_fini(int thread)
+{
+    close(listeners[thread]);
+    close(dup_src[thread]);
+    close(dup_dst[thread]);
+}
+
+static void*
+worker_main(void *arg)
+{
+    worker_t *worker = (worker_t*)arg;
+    int fds[2 * BATCH];
+
+    pthread_barrier_wait(&barrier);
+    while( running )
+    {
+        if( worker->op->setup != NULL )
+        {
+            worker->op->setup(worker->index, fds, BATCH);
+        }
+
+        long long start = now_ns();
+        worker->op->run(worker->index, fds, BATCH);
+        worker->ns += now_ns() - start;
+        worker->calls += BATCH;
+
+        if( worker->op->cleanup != NULL )
+        {
+            worker->op->cleanup(worker->index, fds, BATCH);
+        }
+    }
+
+    return NULL;
+}
+
+static void
+run_one(const op_t *op, int threads, int fill)
+{
+    worker_t workers[THREADS_MAX];
+
+    for( int i = 0; i < threads; i += 1 )
+    {
+        thread_init(i);
+    }
+
+    pthread_barrier_init(&barrier, NULL, threads + 1);
+    running = 1;
+    for( int i = 0; i < threads; i += 1 )
+    {
+        workers[i].index = i;
+        workers[i].op = op;
+        workers[i].calls = 0;
+        workers[i].ns = 0;
+        pthread_create(&workers[i].thread, NULL, worker_main, &workers[i]);
+    }
+
+    pthread_barrier_wait(&barrier);
+    long long start = now_ns();
+    struct timespec ts;
+    ts.tv_sec = (time_t)duration;
+    ts.tv_nsec = (long)((duration - ts.tv_sec) * 1e9);
+    nanosleep(&ts, NULL);
+    running = 0;
+
+    long long calls = 0;
+    long long ns = 0;
+    for( int i = 0; i < threads; i += 1 )
+    {
+        pthread_join(workers[i].thread, NULL);
+        calls += workers[i].calls;
+        ns += workers[i].ns;
+    }
+    long long elapsed = now_ns() - start;
+    pthread_barrier_destroy(&barrier);
+
+    for( int i = 0; i < threads; i += 1 )
+    {
+        thread_fini(i);
+    }
+
+    /* Latency is the time spent in the calls themselves.
+     * Throughput is over the whole run (so it includes the
+     * untimed set-up, but is comparable between runs). */
+    printf("{\"preload\": \"%s\", \"op\": \"%s\", \"threads\": %d, "
+           "\"fill\": %d, \"calls\": %lld, \"ns_per_call\": %.1f, "
+           "\"calls_per_sec\": %.0f}\n",
+           label, op->name, threads, fill, calls,
+           calls > 0 ? (double)ns / calls : 0.0,
+           elapsed > 0 ? (double)calls * 1e9 / elapsed : 0.0);
+    fflush(stdout);
+}
+
+static int
+fill_table(int *filled, int fill, int epfd)
+{
+    /* We leave some room for the benchmarks themselves. */
+    while( *filled < fill )
+    {
+        if( dup(epfd) < 0 )
+        {
+            return -1;
+        }
+        *filled += 1;
+    }
+    return 0;
+}
+
+static void
+usage(void)
+{
+    fprintf(stderr,
+        "usage: bench [options]\n"
+        "\n"
+        "   -l <label>      Label for the results (e.g. huptime).\n"
+        "   -o <op,...>     Operations to run (default all):\n"
+        "                   close, dup, dup2, accept4, bind, syscall.\n"
+        "   -t <N>          Run with 1, 2, 4, ... N threads (default 1).\n"
+        "   -f <N,...>      Descriptor table sizes (default 1000,100000,1000000).\n"
+        "   -d <seconds>    How long to run each case (default 1).\n");
+}
+
+int
+main(int argc, char **argv)
+{
+    const char *op_names = NULL;
+    const char *fill_spec = "1000,100000,1000000";
+    int max_threads = 1;
+
+    int opt;
+    while( (opt = getopt(argc, argv, "l:o:t:f:d:h")) != -1 )
+    {
+        switch( opt )
+        {
+            case 'l': label = optarg; break;
+            case 'o': op_names = optarg; break;
+            case 't': max_threads = atoi(optarg); break;
+            case 'f': fill_spec = optarg; break;
+            case 'd': duration = atof(optarg); break;
+            default: usage(); return opt == 'h' ? 0 : 1;
+        }
+    }
+    if( max_threads < 1 || max_threads > THREADS_MAX || duration <= 0.0 )
+    {
+        usage();
+        return 1;
+    }
+
+    /* Take all the descriptors we can get. */
+    struct rlimit rlim;
+    getrlimit(RLIMIT_NOFILE, &rlim);
+    rlim.rlim_cur = rlim.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &rlim);
+
+    /* Each thread needs a handful of descriptors,
+     * plus room for a couple of batches in flight. */
+    long reserve = 64 + (long)max_threads * (4 + 4 * BATCH);
+
+    int epfd = epoll_create1(0);
+    if( epfd < 0 )
+    {
+        perror("epoll_create1");
+        return 1;
+    }
+    int filled = 0;
+
+    /* Fill sizes must be increasing, since we only ever add. */
+    char *fills = strdup(fill_spec);
+    for( char *f = strtok(fills, ","); f != NULL; f = strtok(NULL, ",") )
+    {
+        int fill = atoi(f);
+        if( fill < filled )
+        {
+            fprintf(stderr, "bench: skipping fill %d (not increasing)\n", fill);
+            continue;
+        }
+        if( (long)fill + reserve > (long)rlim.rlim_cur ||
+            fill_table(&filled, fill, epfd) < 0 )
+        {
+            fprintf(stderr, "bench: skipping fill %d (RLIMIT_NOFILE is %ld)\n",
+                    fill, (long)rlim.rlim_cur);
+            break;
+        }
+
+        for( unsigned int i = 0; i < OPS_COUNT; i += 1 )
+        {
+            if( op_names != NULL )
+            {
+                /* Match whole names in the comma separated list. */
+                size_t len = strlen(ops[i].name);
+                const char *p = op_names;
+                int found = 0;
+                while( (p = strstr(p, ops[i].name)) != NULL )
+                {
+                    if( (p == op_names || p[-1] == ',') &&
+                        (p[len] == '\0' || p[len] == ',') )
+                    {
+                        found = 1;
+                        break;
+                    }
+                    p += len;
+                }
+                if( !found )
+                {
+                    continue;
+                }
+            }
+
+            /* Double up to (and always finish with) max_threads. */
+            for( int threads = 1; ; threads *= 2 )
+            {
+                if( threads > max_threads )
+                {
+                    threads = max_threads;
+                }
+                run_one(&ops[i], threads, fill);
+                if( threads == max_threads )
+                {
+                    break;
+                }
+            }
+        }
+    }
+    free(fills);
+
+    return 0;
+}
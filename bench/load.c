@@ -0,0 +1,511 @@
+/*
+ * load.c
+ *
+ * Copyright 2013 Adin Scannell <adin@scannell.ca>, all rights reserved.
+ *
+ * This file is part of Huptime.
+ *
+ * Huptime is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Huptime is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Huptime.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Drives a fixed request rate at a server while restarting it.
+ *
+ * The given command (e.g. huptime --exec bench/server) is run in
+ * its own process group. Requests are sent at a fixed rate no
+ * matter how the server is doing, and latency is measured from
+ * when each request was due (so stalls aren't hidden). Every
+ * reply names the process to signal and its generation (see
+ * server.c), so we can restart whoever is current and see how
+ * long it takes for the next generation to serve a request.
+ *
+ * The results are printed as a single line of JSON.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#define REPLY_MAX (64)
+#define PIDS_MAX (256)
+#define RESTARTS_MAX (1024)
+
+typedef struct
+{
+    int fd;
+    long long due;
+    int len;
+    char buf[REPLY_MAX];
+} conn_t;
+
+typedef struct
+{
+    long long sent;
+    long long first;
+    int generation;
+} restart_t;
+
+static int port = 18000;
+static int rate = 1000;
+static double duration = 10.0;
+static int restarts = 3;
+static int timeout_ms = 5000;
+static const char *label = "";
+
+/* Results. */
+static long long ok = 0;
+static long long refused = 0;
+static long long reset = 0;
+static long long timedout = 0;
+static long long failed = 0;
+static unsigned int *latencies = NULL;
+static long long latencies_count = 0;
+static long long latencies_size = 0;
+
+/* Who to restart. */
+static pid_t pids[PIDS_MAX];
+static int pids_count = 0;
+static int generation = 0;
+
+static restart_t restart_log[RESTARTS_MAX];
+static int restart_count = 0;
+
+static long long
+now_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+static void
+record(long long latency)
+{
+    if( latencies_count == latencies_size )
+    {
+        latencies_size = latencies_size ? latencies_size * 2 : 65536;
+        latencies = realloc(latencies, sizeof(unsigned int) * latencies_size);
+    }
+    latencies[latencies_count++] = (unsigned int)latency;
+}
+
+static void
+seen(pid_t pid, int gen)
+{
+    if( gen > generation )
+    {
+        /* A new generation is up. */
+        generation = gen;
+        pids_count = 0;
+        for( int i = 0; i < restart_count; i += 1 )
+        {
+            if( restart_log[i].first == 0 && restart_log[i].generation < gen )
+            {
+                restart_log[i].first = now_us();
+            }
+        }
+    }
+    if( gen < generation )
+    {
+        return;
+    }
+    for( int i = 0; i < pids_count; i += 1 )
+    {
+        if( pids[i] == pid )
+        {
+            return;
+        }
+    }
+    if( pids_count < PIDS_MAX )
+    {
+        pids[pids_count++] = pid;
+    }
+}
+
+static void
+finish(int ep, conn_t *conn, int err)
+{
+    if( err == 0 )
+    {
+        int pid = 0;
+        int gen = 0;
+        conn->buf[conn->len] = '\0';
+        if( sscanf(conn->buf, "%d %d", &pid, &gen) == 2 )
+        {
+            ok += 1;
+            record(now_us() - conn->due);
+            seen((pid_t)pid, gen);
+        }
+        else
+        {
+            /* Closed without a reply. */
+            reset += 1;
+        }
+    }
+    else if( err == ECONNREFUSED )
+    {
+        refused += 1;
+    }
+    else if( err == ECONNRESET || err == EPIPE )
+    {
+        reset += 1;
+    }
+    else if( err == ETIMEDOUT )
+    {
+        timedout += 1;
+    }
+    else
+    {
+        failed += 1;
+    }
+
+    epoll_ctl(ep, EPOLL_CTL_DEL, conn->fd, NULL);
+    close(conn->fd);
+    free(conn);
+}
+
+static int
+start(int ep, long long due)
+{
+    conn_t *conn = calloc(1, sizeof(conn_t));
+    conn->due = due;
+    conn->fd = socket(AF_INET, SOCK_STREAM|SOCK_NONBLOCK|SOCK_CLOEXEC, 0);
+    if( conn->fd < 0 )
+    {
+        failed += 1;
+        free(conn);
+        return -1;
+    }
+
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if( connect(conn->fd, (struct sockaddr*)&addr, sizeof(addr)) < 0 &&
+        errno != EINPROGRESS )
+    {
+        int err = errno;
+        struct epoll_event ev = { 0 };
+        ev.data.ptr = conn;
+        epoll_ctl(ep, EPOLL_CTL_ADD, conn->fd, &ev);
+        finish(ep, conn, err);
+        return -1;
+    }
+
+    struct epoll_event ev;
+    ev.events = EPOLLOUT;
+    ev.data.ptr = conn;
+    epoll_ctl(ep, EPOLL_CTL_ADD, conn->fd, &ev);
+    return 0;
+}
+
+static void
+progress(int ep, conn_t *conn, unsigned int events)
+{
+    if( events & EPOLLOUT )
+    {
+        int err = 0;
+        socklen_t errlen = sizeof(err);
+        getsockopt(conn->fd, SOL_SOCKET, SO_ERROR, &err, &errlen);
+        if( err != 0 )
+        {
+            finish(ep, conn, err);
+            return;
+        }
+        if( write(conn->fd, "GET\n", 4) < 0 )
+        {
+            finish(ep, conn, errno);
+            return;
+        }
+        struct epoll_event ev;
+        ev.events = EPOLLIN;
+        ev.data.ptr = conn;
+        epoll_ctl(ep, EPOLL_CTL_MOD, conn->fd, &ev);
+        return;
+    }
+
+    ssize_t n = read(conn->fd, conn->buf + conn->len,
+                     REPLY_MAX - 1 - conn->len);
+    if( n < 0 && errno == EAGAIN )
+    {
+        return;
+    }
+    if( n < 0 )
+    {
+        finish(ep, conn, errno);
+        return;
+    }
+    conn->len += n;
+    if( n == 0 || conn->len == REPLY_MAX - 1 )
+    {
+        finish(ep, conn, 0);
+    }
+}
+
+static int
+wait_for_server(pid_t child)
+{
+    long long until = now_us() + 10 * 1000000LL;
+    while( now_us() < until )
+    {
+        int status;
+        if( waitpid(child, &status, WNOHANG) == child )
+        {
+            return -1;
+        }
+
+        int fd = socket(AF_INET, SOCK_STREAM, 0);
+        struct sockaddr_in addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons(port);
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        if( connect(fd, (struct sockaddr*)&addr, sizeof(addr)) == 0 )
+        {
+            char buf[REPLY_MAX];
+            int len = 0;
+            (void)write(fd, "GET\n", 4);
+            while( len < REPLY_MAX - 1 )
+            {
+                ssize_t n = read(fd, buf + len, REPLY_MAX - 1 - len);
+                if( n <= 0 )
+                {
+                    break;
+                }
+                len += n;
+            }
+            buf[len] = '\0';
+            close(fd);
+
+            int pid = 0;
+            int gen = 0;
+            if( sscanf(buf, "%d %d", &pid, &gen) == 2 )
+            {
+                generation = gen;
+                seen((pid_t)pid, gen);
+                return 0;
+            }
+        }
+        close(fd);
+        usleep(10000);
+    }
+    return -1;
+}
+
+static void
+restart(void)
+{
+    if( restart_count == RESTARTS_MAX )
+    {
+        return;
+    }
+    restart_t *r = &restart_log[restart_count++];
+    r->sent = now_us();
+    r->first = 0;
+    r->generation = generation;
+    for( int i = 0; i < pids_count; i += 1 )
+    {
+        kill(pids[i], SIGHUP);
+    }
+}
+
+static int
+compare(const void *a, const void *b)
+{
+    unsigned int x = *(const unsigned int*)a;
+    unsigned int y = *(const unsigned int*)b;
+    return x < y ? -1 : x > y ? 1 : 0;
+}
+
+static unsigned int
+percentile(double p)
+{
+    if( latencies_count == 0 )
+    {
+        return 0;
+    }
+    long long index = (long long)(p * latencies_count);
+    if( index >= latencies_count )
+    {
+        index = latencies_count - 1;
+    }
+    return latencies[index];
+}
+
+static void
+usage(void)
+{
+    fprintf(stderr,
+        "usage: load [options] -- <command...>\n"
+        "\n"
+        "   -l <label>      Label for the results.\n"
+        "   -p <port>       Port the server listens on (default 18000).\n"
+        "   -r <N>          Requests per second (default 1000).\n"
+        "   -d <seconds>    How long to run for (default 10).\n"
+        "   -n <N>          Restarts, evenly spaced (default 3).\n"
+        "   -t <ms>         Request timeout (default 5000).\n");
+}
+
+int
+main(int argc, char **argv)
+{
+    int opt;
+    while( (opt = getopt(argc, argv, "l:p:r:d:n:t:h")) != -1 )
+    {
+        switch( opt )
+        {
+            case 'l': label = optarg; break;
+            case 'p': port = atoi(optarg); break;
+            case 'r': rate = atoi(optarg); break;
+            case 'd': duration = atof(optarg); break;
+            case 'n': restarts = atoi(optarg); break;
+            case 't': timeout_ms = atoi(optarg); break;
+            default: usage(); return opt == 'h' ? 0 : 1;
+        }
+    }
+    if( optind >= argc || rate <= 0 || duration <= 0.0 ||
+        restarts < 0 || restarts > RESTARTS_MAX )
+    {
+        usage();
+        return 1;
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+    struct rlimit rlim;
+    getrlimit(RLIMIT_NOFILE, &rlim);
+    rlim.rlim_cur = rlim.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &rlim);
+
+    /* Start the server in its own process group,
+     * so that we can clean up everything after. */
+    pid_t child = fork();
+    if( child == 0 )
+    {
+        setpgid(0, 0);
+        execvp(argv[optind], &argv[optind]);
+        perror("exec");
+        _exit(1);
+    }
+    setpgid(child, child);
+    if( wait_for_server(child) < 0 )
+    {
+        fprintf(stderr, "load: server didn't start\n");
+        kill(-child, SIGKILL);
+        return 1;
+    }
+
+    int ep = epoll_create1(EPOLL_CLOEXEC);
+    long long begin = now_us();
+    long long end = begin + (long long)(duration * 1e6);
+    long long interval = 1000000LL / rate;
+    long long next = begin;
+    long long sent = 0;
+    int next_restart = 0;
+
+    while( 1 )
+    {
+        long long now = now_us();
+
+        /* Send everything that's due. */
+        while( next <= now && next < end )
+        {
+            start(ep, next);
+            sent += 1;
+            next += interval;
+        }
+
+        /* Restart, if it's time. */
+        if( next_restart < restarts &&
+            now >= begin + (long long)(duration * 1e6) *
+                           (next_restart + 1) / (restarts + 1) )
+        {
+            restart();
+            next_restart += 1;
+        }
+
+        if( now >= end && ok + refused + reset + timedout + failed >= sent )
+        {
+            break;
+        }
+        if( now >= end + timeout_ms * 1000LL )
+        {
+            timedout += sent - (ok + refused + reset + timedout + failed);
+            break;
+        }
+
+        struct epoll_event events[256];
+        int wait_ms = next > now ? (int)((next - now + 999) / 1000) : 0;
+        if( now >= end )
+        {
+            wait_ms = 10;
+        }
+        int count = epoll_wait(ep, events, 256, wait_ms);
+        for( int i = 0; i < count; i += 1 )
+        {
+            conn_t *conn = (conn_t*)events[i].data.ptr;
+            if( (events[i].events & (EPOLLERR|EPOLLHUP)) &&
+                !(events[i].events & EPOLLIN) )
+            {
+                int err = 0;
+                socklen_t errlen = sizeof(err);
+                getsockopt(conn->fd, SOL_SOCKET, SO_ERROR, &err, &errlen);
+                finish(ep, conn, err ? err : ECONNRESET);
+                continue;
+            }
+            progress(ep, conn, events[i].events);
+        }
+    }
+
+    kill(-child, SIGKILL);
+    while( waitpid(-child, NULL, 0) > 0 || errno == EINTR );
+
+    qsort(latencies, latencies_count, sizeof(unsigned int), compare);
+    printf("{\"label\": \"%s\", \"rate\": %d, \"duration\": %.1f, "
+           "\"sent\": %lld, \"ok\": %lld, \"refused\": %lld, "
+           "\"reset\": %lld, \"timeout\": %lld, \"failed\": %lld, "
+           "\"p50_us\": %u, \"p99_us\": %u, \"p999_us\": %u, \"max_us\": %u, "
+           "\"first_accept_ms\": [",
+           label, rate, duration, sent, ok, refused, reset, timedout, failed,
+           percentile(0.5), percentile(0.99), percentile(0.999),
+           percentile(1.0));
+    for( int i = 0; i < restart_count; i += 1 )
+    {
+        /* Time from the restart until the next generation served
+         * its first request (or null if it never did). */
+        if( restart_log[i].first > 0 )
+        {
+            printf("%s%.1f", i > 0 ? ", " : "",
+                   (restart_log[i].first - restart_log[i].sent) / 1000.0);
+        }
+        else
+        {
+            printf("%snull", i > 0 ? ", " : "");
+        }
+    }
+    printf("]}\n");
+    return 0;
+}
@@ -0,0 +1,451 @@
+/*
+ * scale.c
+ *
+ * Copyright 2013 Adin Scannell <adin@scannell.ca>, all rights reserved.
+ *
+ * This file is part of Huptime.
+ *
+ * Huptime is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Huptime is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Huptime.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Measures how restarts scale.
+ *
+ * For every combination of listeners, open (tracked) connections
+ * and RLIMIT_NOFILE, we run a copy of ourselves under huptime.so
+ * with HUPTIME_STATS set. That copy binds the listeners, connects
+ * to itself, and restarts. Once draining, it closes everything, and
+ * the next generation binds the listeners again and exits. We then
+ * collect the time spent in each phase of the restart from the stats
+ * file and print it as a single line of JSON.
+ */
+
+#include "libhuptime.h"
+
+#include <stdio.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+
+#define BATCH (1024)
+#define LIST_MAX (32)
+
+static const char *phases[] =
+{
+    "exit_start",
+    "neuter",
+    "spawn",
+    "exec",
+    "init_decode",
+    "init_close",
+    "init_restore",
+    "init",
+    "rebind",
+};
+#define PHASES_COUNT (sizeof(phases) / sizeof(phases[0]))
+
+static long long
+now_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+static void
+stat_line(const char *phase, long long start)
+{
+    /* The same format as huptime itself (see impl_stat()). */
+    const char *path = getenv("HUPTIME_STATS");
+    if( path == NULL )
+    {
+        return;
+    }
+    char line[256];
+    int len = snprintf(line, sizeof(line),
+        "{\"pid\": %d, \"generation\": %d, \"phase\": \"%s\", "
+        "\"start_us\": %lld, \"us\": %lld}\n",
+        (int)getpid(), huptime_generation(), phase,
+        start, now_us() - start);
+    int fd = open(path, O_WRONLY|O_APPEND|O_CREAT, 0644);
+    if( fd >= 0 )
+    {
+        (void)write(fd, line, len);
+        close(fd);
+    }
+}
+
+static socklen_t
+listener_addr(struct sockaddr_un *addr, int index)
+{
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    int len = snprintf(addr->sun_path + 1, sizeof(addr->sun_path) - 1,
+                       "huptime-scale-%d-%d", (int)getpgrp(), index);
+    return offsetof(struct sockaddr_un, sun_path) + 1 + len;
+}
+
+static int
+bind_listeners(int *listeners, int count)
+{
+    for( int i = 0; i < count; i += 1 )
+    {
+        struct sockaddr_un addr;
+        socklen_t addrlen = listener_addr(&addr, i);
+        listeners[i] = socket(AF_UNIX, SOCK_STREAM, 0);
+        if( listeners[i] < 0 ||
+            bind(listeners[i], (struct sockaddr*)&addr, addrlen) < 0 ||
+            listen(listeners[i], SOMAXCONN) < 0 )
+        {
+            perror("listener");
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static int
+run_child(int listener_count, int connection_count)
+{
+    int *listeners = calloc(listener_count, sizeof(int));
+    if( huptime_generation == NULL )
+    {
+        fprintf(stderr, "scale: not running under huptime?\n");
+        return 1;
+    }
+
+    if( huptime_generation() > 0 )
+    {
+        /* The next generation: pick up the listeners, and we're done. */
+        long long start = now_us();
+        if( bind_listeners(listeners, listener_count) < 0 )
+        {
+            return 1;
+        }
+        stat_line("rebind", start);
+        stat_line("done", now_us());
+        return 0;
+    }
+
+    if( bind_listeners(listeners, listener_count) < 0 )
+    {
+        return 1;
+    }
+
+    /* Connect to ourselves (in batches, to stay within the backlog). */
+    int *conns = calloc(2 * (size_t)connection_count + 1, sizeof(int));
+    struct sockaddr_un addr;
+    socklen_t addrlen = listener_addr(&addr, 0);
+    int made = 0;
+    while( made < connection_count )
+    {
+        int batch = connection_count - made;
+        if( batch > BATCH )
+        {
+            batch = BATCH;
+        }
+        for( int i = 0; i < batch; i += 1 )
+        {
+            int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+            if( fd < 0 || connect(fd, (struct sockaddr*)&addr, addrlen) < 0 )
+            {
+                perror("connect");
+                return 1;
+            }
+            conns[2 * (made + i)] = fd;
+        }
+        for( int i = 0; i < batch; i += 1 )
+        {
+            int fd = -1;
+            while( fd < 0 )
+            {
+                fd = accept4(listeners[0], NULL, NULL, SOCK_NONBLOCK);
+                if( fd < 0 && errno != EAGAIN && errno != EINTR )
+                {
+                    perror("accept");
+                    return 1;
+                }
+            }
+            conns[2 * (made + i) + 1] = fd;
+        }
+        made += batch;
+    }
+
+    /* Restart, and wait until we're draining (if there's
+     * nothing open, this generation may just go away). */
+    stat_line("sighup", now_us());
+    raise(SIGHUP);
+    while( !huptime_is_draining() )
+    {
+        usleep(100);
+    }
+
+    /* Let this generation go. */
+    for( int i = 0; i < 2 * connection_count; i += 1 )
+    {
+        close(conns[i]);
+    }
+    while( 1 )
+    {
+        pause();
+    }
+    return 0;
+}
+
+static int
+parse_list(const char *spec, long *values)
+{
+    int count = 0;
+    char *copy = strdup(spec);
+    for( char *v = strtok(copy, ","); v != NULL && count < LIST_MAX;
+         v = strtok(NULL, ",") )
+    {
+        values[count++] = atol(v);
+    }
+    free(copy);
+    return count;
+}
+
+static long long
+parse_field(const char *line, const char *name)
+{
+    const char *p = strstr(line, name);
+    return p != NULL ? atoll(p + strlen(name)) : -1;
+}
+
+static void
+run_one(const char *self, const char *sofile, const char *mode,
+        long listener_count, long connection_count, long nofile)
+{
+    char stats[64];
+    snprintf(stats, sizeof(stats), "/tmp/huptime-scale-%d.stats", (int)getpid());
+    unlink(stats);
+
+    pid_t child = fork();
+    if( child == 0 )
+    {
+        setpgid(0, 0);
+        struct rlimit rlim = { nofile, nofile };
+        setrlimit(RLIMIT_NOFILE, &rlim);
+        setenv("LD_PRELOAD", sofile, 1);
+        setenv("HUPTIME_MODE", mode, 1);
+        setenv("HUPTIME_STATS", stats, 1);
+
+        char listeners_arg[32];
+        char connections_arg[32];
+        snprintf(listeners_arg, sizeof(listeners_arg), "%ld", listener_count);
+        snprintf(connections_arg, sizeof(connections_arg), "%ld", connection_count);
+        execl(self, self, "-x", listeners_arg, connections_arg, (char*)NULL);
+        _exit(1);
+    }
+    setpgid(child, child);
+
+    /* Wait for the next generation to finish up. */
+    long long until = now_us() + 120 * 1000000LL;
+    int done = 0;
+    while( !done && now_us() < until )
+    {
+        FILE *f = fopen(stats, "r");
+        if( f != NULL )
+        {
+            char line[512];
+            while( fgets(line, sizeof(line), f) != NULL )
+            {
+                if( strstr(line, "\"phase\": \"done\"") != NULL )
+                {
+                    done = 1;
+                }
+            }
+            fclose(f);
+        }
+        if( !done )
+        {
+            int status;
+            if( waitpid(child, &status, WNOHANG) == child &&
+                (!WIFEXITED(status) || WEXITSTATUS(status) != 0) )
+            {
+                break;
+            }
+            usleep(1000);
+        }
+    }
+    kill(-child, SIGKILL);
+    while( waitpid(child, NULL, 0) < 0 && errno == EINTR );
+
+    /* Add up each phase (for every generation). */
+    long long totals[PHASES_COUNT];
+    for( unsigned int i = 0; i < PHASES_COUNT; i += 1 )
+    {
+        totals[i] = -1;
+    }
+    long long first = -1;
+    long long last = -1;
+    FILE *f = fopen(stats, "r");
+    if( f != NULL )
+    {
+        char line[512];
+        while( fgets(line, sizeof(line), f) != NULL )
+        {
+            long long start = parse_field(line, "\"start_us\": ");
+            long long us = parse_field(line, "\"us\": ");
+            long long generation = parse_field(line, "\"generation\": ");
+            if( generation == 0 && strstr(line, "\"phase\": \"init") != NULL )
+            {
+                /* The first start-up isn't part of the restart. */
+                continue;
+            }
+            if( strstr(line, "\"phase\": \"sighup\"") != NULL )
+            {
+                first = start;
+            }
+            if( strstr(line, "\"phase\": \"rebind\"") != NULL )
+            {
+                last = start + us;
+            }
+            for( unsigned int i = 0; i < PHASES_COUNT; i += 1 )
+            {
+                char match[64];
+                snprintf(match, sizeof(match), "\"phase\": \"%s\"", phases[i]);
+                if( strstr(line, match) != NULL )
+                {
+                    totals[i] = (totals[i] < 0 ? 0 : totals[i]) + us;
+                }
+            }
+        }
+        fclose(f);
+    }
+    unlink(stats);
+
+    printf("{\"mode\": \"%s\", \"listeners\": %ld, \"connections\": %ld, "
+           "\"nofile\": %ld, \"ok\": %s",
+           mode, listener_count, connection_count, nofile,
+           done ? "true" : "false");
+    for( unsigned int i = 0; i < PHASES_COUNT; i += 1 )
+    {
+        if( totals[i] >= 0 )
+        {
+            printf(", \"%s_us\": %lld", phases[i], totals[i]);
+        }
+        else
+        {
+            printf(", \"%s_us\": null", phases[i]);
+        }
+    }
+    if( done && first >= 0 && last >= 0 )
+    {
+        printf(", \"total_us\": %lld}\n", last - first);
+    }
+    else
+    {
+        printf(", \"total_us\": null}\n");
+    }
+    fflush(stdout);
+}
+
+static void
+usage(void)
+{
+    fprintf(stderr,
+        "usage: scale [options] <huptime.so>\n"
+        "\n"
+        "   -m <mode>       fork or exec (default fork).\n"
+        "   -L <N,...>      Listener counts (default 1,10,100,1000).\n"
+        "   -C <N,...>      Connection counts (default 0,1000,10000,100000,500000).\n"
+        "   -N <N,...>      RLIMIT_NOFILE values (default 1024,65536,1048576).\n");
+}
+
+int
+main(int argc, char **argv)
+{
+    const char *mode = "fork";
+    const char *listeners_spec = "1,10,100,1000";
+    const char *connections_spec = "0,1000,10000,100000,500000";
+    const char *nofile_spec = "1024,65536,1048576";
+
+    if( argc == 4 && !strcmp(argv[1], "-x") )
+    {
+        /* We're the copy being restarted. */
+        return run_child(atoi(argv[2]), atoi(argv[3]));
+    }
+
+    int opt;
+    while( (opt = getopt(argc, argv, "m:L:C:N:h")) != -1 )
+    {
+        switch( opt )
+        {
+            case 'm': mode = optarg; break;
+            case 'L': listeners_spec = optarg; break;
+            case 'C': connections_spec = optarg; break;
+            case 'N': nofile_spec = optarg; break;
+            default: usage(); return opt == 'h' ? 0 : 1;
+        }
+    }
+    if( optind != argc - 1 )
+    {
+        usage();
+        return 1;
+    }
+    char *sofile = realpath(argv[optind], NULL);
+    char *self = realpath("/proc/self/exe", NULL);
+    if( sofile == NULL || self == NULL )
+    {
+        perror("scale");
+        return 1;
+    }
+
+    long listeners[LIST_MAX];
+    long connections[LIST_MAX];
+    long nofiles[LIST_MAX];
+    int listeners_count = parse_list(listeners_spec, listeners);
+    int connections_count = parse_list(connections_spec, connections);
+    int nofiles_count = parse_list(nofile_spec, nofiles);
+
+    struct rlimit rlim;
+    getrlimit(RLIMIT_NOFILE, &rlim);
+
+    for( int n = 0; n < nofiles_count; n += 1 )
+    {
+        if( rlim.rlim_max != RLIM_INFINITY && (rlim_t)nofiles[n] > rlim.rlim_max )
+        {
+            fprintf(stderr, "scale: skipping nofile %ld (hard limit is %ld)\n",
+                    nofiles[n], (long)rlim.rlim_max);
+            continue;
+        }
+        for( int l = 0; l < listeners_count; l += 1 )
+        {
+            for( int c = 0; c < connections_count; c += 1 )
+            {
+                /* Each connection is two descriptors (we're
+                 * both ends), and huptime needs a few too. */
+                if( listeners[l] + 2 * connections[c] + 64 > nofiles[n] )
+                {
+                    continue;
+                }
+                run_one(self, sofile, mode, listeners[l], connections[c], nofiles[n]);
+            }
+        }
+    }
+
+    return 0;
+}
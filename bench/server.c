@@ -0,0 +1,259 @@
+/*
+ * server.c
+ *
+ * Copyright 2013 Adin Scannell <adin@scannell.ca>, all rights reserved.
+ *
+ * This file is part of Huptime.
+ *
+ * Huptime is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Huptime is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Huptime.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * A reference server for the load benchmark (see load.c).
+ *
+ * Every connection gets a single line request, and a single
+ * line reply with the pid of the server (the master, for the
+ * prefork style) and which generation it is. The connection
+ * is then closed. There are three styles:
+ *
+ *  epoll   - A single thread with non-blocking sockets.
+ *  thread  - A thread for every connection.
+ *  prefork - A master that forks workers that block in accept().
+ */
+
+#include "libhuptime.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#define REQUEST_MAX (256)
+
+static pid_t master = 0;
+static int delay_us = 0;
+
+static int
+reply(char *buf, size_t len)
+{
+    int generation = huptime_generation != NULL ? huptime_generation() : 0;
+    return snprintf(buf, len, "%d %d\n", (int)master, generation);
+}
+
+static void
+handle_blocking(int fd)
+{
+    char buf[REQUEST_MAX];
+    ssize_t n = read(fd, buf, sizeof(buf));
+    if( n > 0 )
+    {
+        if( delay_us > 0 )
+        {
+            usleep(delay_us);
+        }
+        int len = reply(buf, sizeof(buf));
+        (void)write(fd, buf, len);
+    }
+    close(fd);
+}
+
+static void
+serve_epoll(int sock)
+{
+    int ep = epoll_create1(EPOLL_CLOEXEC);
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.fd = sock;
+    epoll_ctl(ep, EPOLL_CTL_ADD, sock, &ev);
+    fcntl(sock, F_SETFL, fcntl(sock, F_GETFL) | O_NONBLOCK);
+
+    while( 1 )
+    {
+        struct epoll_event events[256];
+        int count = epoll_wait(ep, events, 256, -1);
+        for( int i = 0; i < count; i += 1 )
+        {
+            int fd = events[i].data.fd;
+            if( fd == sock )
+            {
+                while( 1 )
+                {
+                    int client = accept4(sock, NULL, NULL, SOCK_NONBLOCK);
+                    if( client < 0 )
+                    {
+                        break;
+                    }
+                    ev.events = EPOLLIN;
+                    ev.data.fd = client;
+                    epoll_ctl(ep, EPOLL_CTL_ADD, client, &ev);
+                }
+            }
+            else
+            {
+                char buf[REQUEST_MAX];
+                ssize_t n = read(fd, buf, sizeof(buf));
+                if( n < 0 && errno == EAGAIN )
+                {
+                    continue;
+                }
+                if( n > 0 )
+                {
+                    if( delay_us > 0 )
+                    {
+                        usleep(delay_us);
+                    }
+                    int len = reply(buf, sizeof(buf));
+                    (void)write(fd, buf, len);
+                }
+                epoll_ctl(ep, EPOLL_CTL_DEL, fd, NULL);
+                close(fd);
+            }
+        }
+    }
+}
+
+static void*
+thread_main(void *arg)
+{
+    handle_blocking((int)(long)arg);
+    return NULL;
+}
+
+static void
+serve_thread(int sock)
+{
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+    while( 1 )
+    {
+        int client = accept(sock, NULL, NULL);
+        if( client < 0 )
+        {
+            continue;
+        }
+        pthread_t thread;
+        if( pthread_create(&thread, &attr, thread_main, (void*)(long)client) != 0 )
+        {
+            close(client);
+        }
+    }
+}
+
+static void
+serve_prefork(int sock, int workers)
+{
+    for( int i = 0; i < workers; i += 1 )
+    {
+        if( fork() == 0 )
+        {
+            while( 1 )
+            {
+                int client = accept(sock, NULL, NULL);
+                if( client >= 0 )
+                {
+                    handle_blocking(client);
+                }
+            }
+        }
+    }
+
+    /* The workers finish up and exit on restart. */
+    int status;
+    while( wait(&status) > 0 || errno == EINTR );
+    exit(0);
+}
+
+static void
+usage(void)
+{
+    fprintf(stderr,
+        "usage: server [options]\n"
+        "\n"
+        "   -m <style>      One of epoll, thread or prefork (default epoll).\n"
+        "   -p <port>       Port to listen on (default 18000).\n"
+        "   -w <N>          Number of workers for prefork (default 4).\n"
+        "   -s <us>         Time to spend on each request (default 0).\n");
+}
+
+int
+main(int argc, char **argv)
+{
+    const char *style = "epoll";
+    int port = 18000;
+    int workers = 4;
+
+    int opt;
+    while( (opt = getopt(argc, argv, "m:p:w:s:h")) != -1 )
+    {
+        switch( opt )
+        {
+            case 'm': style = optarg; break;
+            case 'p': port = atoi(optarg); break;
+            case 'w': workers = atoi(optarg); break;
+            case 's': delay_us = atoi(optarg); break;
+            default: usage(); return opt == 'h' ? 0 : 1;
+        }
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+    master = getpid();
+
+    int sock = socket(AF_INET, SOCK_STREAM, 0);
+    int one = 1;
+    setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if( bind(sock, (struct sockaddr*)&addr, sizeof(addr)) < 0 ||
+        listen(sock, SOMAXCONN) < 0 )
+    {
+        perror("server");
+        return 1;
+    }
+
+    if( !strcmp(style, "epoll") )
+    {
+        serve_epoll(sock);
+    }
+    else if( !strcmp(style, "thread") )
+    {
+        serve_thread(sock);
+    }
+    else if( !strcmp(style, "prefork") )
+    {
+        serve_prefork(sock, workers);
+    }
+    else
+    {
+        usage();
+        return 1;
+    }
+
+    return 0;
+}
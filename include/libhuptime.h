@@ -0,0 +1,237 @@
+/*
+ * libhuptime.h
+ *
+ * Copyright 2013 Adin Scannell <adin@scannell.ca>, all rights reserved.
+ *
+ * This file is part of Huptime.
+ *
+ * Huptime is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Huptime is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Huptime.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef LIBHUPTIME_H
+#define LIBHUPTIME_H
+
+/*
+ * An optional interface for programs that want to cooperate
+ * with huptime. Nothing here is needed for normal use.
+ *
+ * There is no library to link against. The functions are
+ * provided by huptime.so when the program is run via huptime,
+ * and are declared weak so that the program still links and
+ * runs without it. Always check that a function is available
+ * before calling it, for example:
+ *
+ *     if( huptime_handoff != NULL )
+ *     {
+ *         huptime_handoff(fd, &state, sizeof(state));
+ *     }
+ */
+
+#include <stddef.h>
+
+#ifndef HUPTIME_WEAK
+#define HUPTIME_WEAK __attribute__((weak))
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* The largest state blob that can go along with a connection. */
+#define HUPTIME_HANDOFF_MAX (32768)
+
+/* Called in the new copy of the program for every connection
+ * that was handed off by the old one. The fd is open and owned
+ * by the program, and state is only valid during the call. */
+typedef void (*huptime_adopt_t)(int fd, const void *state, size_t len, void *data);
+
+/*
+ * Hand a connection off to the next copy of the program.
+ *
+ * This is for connections that never finish on their own
+ * (websockets, streaming RPCs, etc.) and would otherwise hold up
+ * the restart forever. It may only be called once a restart has
+ * started, and only for connections that came from accept().
+ *
+ * On success the connection and state are queued for the next
+ * copy, fd is closed and 0 is returned. Otherwise -1 is returned,
+ * errno is set and the connection is left alone. Any data that
+ * has been read from the connection but not yet handled should
+ * be part of the state.
+ */
+extern int huptime_handoff(int fd, const void *state, size_t len)
+    HUPTIME_WEAK;
+
+/*
+ * Start adopting connections from the previous copy.
+ *
+ * The callback is called from a separate thread, once for each
+ * connection, until the previous copy has exited. Returns 0 on
+ * success (including when there is nothing to adopt), or -1 with
+ * errno set.
+ */
+extern int huptime_adopt(huptime_adopt_t cb, void *data)
+    HUPTIME_WEAK;
+
+/*
+ * Tell huptime that this copy is ready to serve.
+ *
+ * If huptime was started with --ready, the previous copy keeps
+ * accepting connections until this is called (or until it gives
+ * up waiting). This is only meaningful in fork mode. Returns 0.
+ */
+extern int huptime_ready(void)
+    HUPTIME_WEAK;
+
+/*
+ * Returns non-zero once this process has started draining, i.e.
+ * it will not accept any more connections and will exit (or exec)
+ * as soon as the current ones are finished.
+ */
+extern int huptime_is_draining(void)
+    HUPTIME_WEAK;
+
+/*
+ * Returns a descriptor that becomes readable when draining starts,
+ * for use with poll(), epoll, etc. Don't read from it or close it.
+ * The same descriptor is returned on every call.
+ */
+extern int huptime_drain_fd(void)
+    HUPTIME_WEAK;
+
+/* Events for huptime_hook(). */
+#define HUPTIME_POST_HANDOFF (1)
+#define HUPTIME_PRE_EXEC     (2)
+
+typedef void (*huptime_hook_t)(void *data);
+
+/*
+ * Register a function to be called on the given event.
+ *
+ * HUPTIME_POST_HANDOFF is called once this process has given up its
+ * listening sockets and started draining. HUPTIME_PRE_EXEC is called
+ * just before the next copy of the program is exec()'ed (in fork mode,
+ * this is in a forked copy of the process with only one thread, so
+ * registering one means the whole process is copied on every restart).
+ * Otherwise, both are called from huptime's own restart thread (except
+ * HUPTIME_PRE_EXEC in hybrid mode, which is called from whichever
+ * thread next calls accept()), and never with huptime's lock held.
+ * Hooks should be short. Returns 0 on success, or -1 with errno set.
+ */
+extern int huptime_hook(int event, huptime_hook_t fn, void *data)
+    HUPTIME_WEAK;
+
+/*
+ * Returns which copy of the program this is. The first copy is zero
+ * and every restart adds one.
+ */
+extern int huptime_generation(void)
+    HUPTIME_WEAK;
+
+/* What huptime_listener_stats() fills in. */
+struct huptime_listener_stats
+{
+    unsigned long tracked;      /* Connections that are still open. */
+    unsigned long accepted;     /* Connections accepted so far. */
+    unsigned long accept_rate;  /* Connections accepted in the last second. */
+    int draining;               /* Whether there is a deadline running. */
+};
+
+/*
+ * Get the numbers for a listening socket (i.e. one that was bound
+ * and listened on). This keeps working once a restart has started,
+ * which is handy to find out which listener is holding things up.
+ * Returns 0 on success, or -1 with errno set.
+ */
+extern int huptime_listener_stats(int fd, struct huptime_listener_stats *stats)
+    HUPTIME_WEAK;
+
+/*
+ * Give connections from a listening socket a deadline to finish by
+ * once a restart starts. After that, they are shut down: the program
+ * sees them end as if the client had gone away, and closes them as
+ * usual. A negative deadline means no deadline (the default, unless
+ * huptime was started with --drain). Returns 0 on success, or -1
+ * with errno set.
+ */
+extern int huptime_listener_deadline(int fd, int seconds)
+    HUPTIME_WEAK;
+
+/*
+ * Drain a single listening socket now, without restarting. The
+ * connections from it that are open at this point are shut down
+ * (as above) once the given number of seconds has passed. Newer
+ * connections and other listeners are left alone. Returns 0 on
+ * success, or -1 with errno set.
+ */
+extern int huptime_listener_drain(int fd, int seconds)
+    HUPTIME_WEAK;
+
+/* What huptime_generations() fills in. */
+struct huptime_generation_info
+{
+    int pid;                    /* The master process for the copy. */
+    int generation;             /* See huptime_generation(). */
+    int draining;               /* Whether it is on its way out. */
+    unsigned long tracked;      /* Connections that are still open. */
+    unsigned long rss_kb;       /* Resident memory. */
+    unsigned long fds;          /* Open descriptors. */
+};
+
+/*
+ * Get every copy of the program that is still around (including
+ * this one). In fork mode, older copies stay around while they
+ * drain, so this shows what overlapping restarts cost. A standby
+ * (see --standby) isn't included until it's let go. Fills in
+ * at most max entries and returns how many, or returns -1 with
+ * errno set.
+ */
+extern int huptime_generations(struct huptime_generation_info *gens, int max)
+    HUPTIME_WEAK;
+
+/* The longest region name (including the terminator). Names may
+ * only contain letters, digits, '_', '-' and '.'. */
+#define HUPTIME_REGION_NAME_MAX (32)
+
+/*
+ * Pass a region of memory on to the next copy of the program.
+ *
+ * The fd should be a memfd (or other regular file) holding whatever
+ * the next copy might find useful, e.g. a snapshot of a cache. We
+ * keep our own copy of the descriptor. Registering the same name
+ * again replaces the region. This can be done at any time before the
+ * restart, or from a HUPTIME_PRE_EXEC hook. Returns 0 on success, or
+ * -1 with errno set. (Without the API, set HUPTIME_REGISTER to name=fd
+ * pairs separated by colons before the restart instead.)
+ */
+extern int huptime_region_register(const char *name, int fd)
+    HUPTIME_WEAK;
+
+/*
+ * Map a region passed on by the previous copy (read-only).
+ *
+ * Returns the address and sets size, or returns NULL with errno set
+ * (ENOENT if there is no such region). Each region can be mapped
+ * once; use munmap() when finished with it. Regions are also listed
+ * in the HUPTIME_REGIONS environment variable as name=fd pairs
+ * separated by colons.
+ */
+extern void *huptime_region_map(const char *name, size_t *size)
+    HUPTIME_WEAK;
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
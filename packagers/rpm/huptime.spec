@@ -22,6 +22,8 @@ true
 %files
 /usr/bin/huptime
 /usr/lib/huptime/huptime.so
+/usr/lib/huptime/huptime-seccomp
+/usr/include/libhuptime.h
 
 %changelog
 * Sat Oct 26 2013 Adin Scannell <adin@scannell.ca>
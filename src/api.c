@@ -0,0 +1,181 @@
+/*
+ * api.c
+ *
+ * Copyright 2013 Adin Scannell <adin@scannell.ca>, all rights reserved.
+ *
+ * This file is part of Huptime.
+ *
+ * Huptime is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Huptime is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Huptime.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "impl.h"
+
+#include <errno.h>
+#include <string.h>
+#include <ctype.h>
+
+/* The functions below are exported as HUPTIME_1.0 (see stubs.map).
+ * They only check arguments; the real work is done in impl.c. */
+
+int
+huptime_handoff(int fd, const void *state, size_t len)
+{
+    if( fd < 0 || len > HUPTIME_HANDOFF_MAX || (state == NULL && len > 0) )
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    return impl_handoff(fd, state, len);
+}
+
+int
+huptime_adopt(huptime_adopt_t cb, void *data)
+{
+    if( cb == NULL )
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    return impl_adopt(cb, data);
+}
+
+int
+huptime_ready(void)
+{
+    return impl_ready();
+}
+
+int
+huptime_is_draining(void)
+{
+    return impl_is_draining();
+}
+
+int
+huptime_drain_fd(void)
+{
+    return impl_drain_fd();
+}
+
+int
+huptime_hook(int event, huptime_hook_t fn, void *data)
+{
+    if( fn == NULL ||
+        (event != HUPTIME_POST_HANDOFF && event != HUPTIME_PRE_EXEC) )
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    return impl_hook(event, fn, data);
+}
+
+int
+huptime_generation(void)
+{
+    return impl_generation();
+}
+
+static int
+region_name_valid(const char *name)
+{
+    /* Names end up in HUPTIME_REGIONS, so we keep them simple. */
+    if( name == NULL || name[0] == '\0' ||
+        strlen(name) >= HUPTIME_REGION_NAME_MAX )
+    {
+        return 0;
+    }
+    for( const char *c = name; *c != '\0'; c += 1 )
+    {
+        if( !isalnum((unsigned char)*c) && *c != '_' && *c != '-' && *c != '.' )
+        {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+int
+huptime_region_register(const char *name, int fd)
+{
+    if( fd < 0 || !region_name_valid(name) )
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    return impl_region_register(name, fd);
+}
+
+void*
+huptime_region_map(const char *name, size_t *size)
+{
+    if( size == NULL || !region_name_valid(name) )
+    {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    return impl_region_map(name, size);
+}
+
+int
+huptime_listener_stats(int fd, struct huptime_listener_stats *stats)
+{
+    if( fd < 0 || stats == NULL )
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    return impl_listener_stats(fd, stats);
+}
+
+int
+huptime_listener_deadline(int fd, int seconds)
+{
+    if( fd < 0 )
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    return impl_listener_deadline(fd, seconds);
+}
+
+int
+huptime_listener_drain(int fd, int seconds)
+{
+    if( fd < 0 || seconds < 0 )
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    return impl_listener_drain(fd, seconds);
+}
+
+int
+huptime_generations(struct huptime_generation_info *gens, int max)
+{
+    if( gens == NULL || max < 0 )
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    return impl_generations(gens, max);
+}
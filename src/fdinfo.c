@@ -25,6 +25,8 @@
 #include <string.h>
 #include <unistd.h>
 #include <errno.h>
+#include <stddef.h>
+#include <sys/un.h>
 
 /* Total active bound FDs. */
 int total_bound = 0;
@@ -44,6 +46,15 @@ int total_dummy = 0;
 /* Total epoll FDs. */
 int total_epoll = 0;
 
+/* Total control FDs. */
+int total_control = 0;
+
+/* Total region FDs. */
+int total_region = 0;
+
+/* Total parked FDs. */
+int total_parked = 0;
+
 #define exactly(fn, fd, buf, bytes)     \
 do {                                    \
     for( int _n = 0; _n != bytes; )     \
@@ -78,15 +89,23 @@ info_decode(int pipe, int *fd, fdinfo_t **info)
     *info = alloc_info(type);
 
     int listened = 0;
+    listenerinfo_t *listener = NULL;
+    char name[REGION_NAME_MAX] = { 0 };
 
     switch( type )
     {
         case BOUND:
-            /* Read whether it was listened or not. */
+            /* Read whether it was listened or not.
+             * The second bit marks datagram sockets. */
             exactly(read, pipe, &listened, sizeof(int));
-            (*info)->bound.real_listened = listened;
+            (*info)->bound.real_listened = listened & 0x1;
+            (*info)->bound.is_dgram = (listened >> 1) & 0x1;
             (*info)->bound.stub_listened = 0;
             (*info)->bound.is_ghost = 1;
+            listener = (*info)->bound.listener;
+
+            /* Read where it was passed in (if it was). */
+            exactly(read, pipe, &listener->listen_fd, sizeof(int));
 
             /* Read the bound address. */
             exactly(read, pipe, &(*info)->bound.addrlen, sizeof(socklen_t));
@@ -95,6 +114,25 @@ info_decode(int pipe, int *fd, fdinfo_t **info)
                 (*info)->bound.addr = malloc((*info)->bound.addrlen);
                 exactly(read, pipe, (*info)->bound.addr, (*info)->bound.addrlen);
             }
+
+            /* Read the options that were set. */
+            exactly(read, pipe, &listener->nopts, sizeof(int));
+            if( listener->nopts < 0 ||
+                listener->nopts > BOUND_SOCKOPT_MAX )
+            {
+                listener->nopts = 0;
+                return -1;
+            }
+            if( listener->nopts > 0 )
+            {
+                listener->opts = calloc(BOUND_SOCKOPT_MAX, sizeof(sockopt_t));
+                exactly(read, pipe, listener->opts,
+                        listener->nopts * sizeof(sockopt_t));
+                for( int i = 0; i < listener->nopts; i += 1 )
+                {
+                    listener->opts[i].inherited = 1;
+                }
+            }
             break;
 
         case SAVED:
@@ -109,9 +147,30 @@ info_decode(int pipe, int *fd, fdinfo_t **info)
                     sizeof((*info)->saved.offset));
             break;
 
+        case REGION:
+            /* Read the name. */
+            exactly(read, pipe, name, sizeof(name));
+            name[REGION_NAME_MAX - 1] = '\0';
+            (*info)->region.name = strdup(name);
+            (*info)->region.inherited = 1;
+            if( (*info)->region.name == NULL )
+            {
+                return -1;
+            }
+            break;
+
+        case PARKED:
+            /* Read where the listener is. The listener
+             * itself is found once everything is decoded. */
+            exactly(read, pipe,
+                    &(*info)->parked.bound_fd,
+                    sizeof((*info)->parked.bound_fd));
+            break;
+
         case TRACKED:
         case DUMMY:
         case EPOLL:
+        case CONTROL:
             /* Should never happen. */
             break;
     }
@@ -129,21 +188,36 @@ info_encode(int pipe, int fd, fdinfo_t* info)
     exactly(write, pipe, &info->type, sizeof(fdtype_t));
 
     int listened = 0;
+    listenerinfo_t *listener = NULL;
+    char name[REGION_NAME_MAX] = { 0 };
 
     switch( info->type )
     {
         case BOUND:
-            listened = info->bound.real_listened;
+            listener = info->bound.listener;
+            listened = (info->bound.real_listened ? 0x1 : 0) |
+                       (info->bound.is_dgram ? 0x2 : 0);
 
             /* Write whether it was listened or not. */
             exactly(write, pipe, &listened, sizeof(int));
 
+            /* Write where it was passed in (if it was). */
+            exactly(write, pipe, &listener->listen_fd, sizeof(int));
+
             /* Write the bound address. */
             exactly(write, pipe, &info->bound.addrlen, sizeof(socklen_t));
             if( info->bound.addrlen > 0 )
             {
                 exactly(write, pipe, info->bound.addr, info->bound.addrlen);
             }
+
+            /* Write the options that were set. */
+            exactly(write, pipe, &listener->nopts, sizeof(int));
+            if( listener->nopts > 0 )
+            {
+                exactly(write, pipe, listener->opts,
+                        listener->nopts * sizeof(sockopt_t));
+            }
             break;
 
         case SAVED:
@@ -158,12 +232,69 @@ info_encode(int pipe, int fd, fdinfo_t* info)
                     sizeof(info->saved.offset));
             break;
 
+        case REGION:
+            /* Write the name (always the same size). */
+            strncpy(name, info->region.name, sizeof(name) - 1);
+            exactly(write, pipe, name, sizeof(name));
+            break;
+
+        case PARKED:
+            /* Write where the listener is. */
+            exactly(write, pipe,
+                    &info->parked.bound_fd,
+                    sizeof(info->parked.bound_fd));
+            break;
+
         case TRACKED:
         case DUMMY:
         case EPOLL:
+        case CONTROL:
             /* Should never happen. */
             break;
     }
 
     return 0;
 }
+
+int
+info_match(fdinfo_t *info, const struct sockaddr *addr, socklen_t addrlen, int is_dgram)
+{
+    /* Note that TCP and UDP sockets may share the same address. */
+    if( !info->bound.is_dgram != !is_dgram )
+    {
+        return 0;
+    }
+
+    const size_t offset = offsetof(struct sockaddr_un, sun_path);
+
+    if( addr->sa_family == AF_UNIX &&
+        info->bound.addr->sa_family == AF_UNIX )
+    {
+        /* Unix addresses are often passed with different
+         * lengths for the same path (the whole structure,
+         * or just up to the terminating NUL). */
+        const char *path = ((const struct sockaddr_un*)addr)->sun_path;
+        const char *bound_path = ((const struct sockaddr_un*)info->bound.addr)->sun_path;
+        size_t len = addrlen > offset ? addrlen - offset : 0;
+        size_t bound_len = info->bound.addrlen > offset ?
+                           info->bound.addrlen - offset : 0;
+
+        if( len == 0 || bound_len == 0 )
+        {
+            /* Autobind addresses are always unique. */
+            return 0;
+        }
+        if( path[0] == '\0' || bound_path[0] == '\0' )
+        {
+            /* Abstract addresses. Every byte counts. */
+            return len == bound_len && !memcmp(path, bound_path, len);
+        }
+
+        len = strnlen(path, len);
+        bound_len = strnlen(bound_path, bound_len);
+        return len == bound_len && !memcmp(path, bound_path, len);
+    }
+
+    return info->bound.addrlen == addrlen &&
+           !memcmp(addr, (void*)info->bound.addr, addrlen);
+}
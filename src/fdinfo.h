@@ -24,6 +24,7 @@
 
 #include <stdlib.h>
 #include <string.h>
+#include <stdint.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 
@@ -60,11 +61,100 @@ typedef enum
      * then we need to swap out the dummy socket. */
     EPOLL = 5,
 
+    /* CONTROL FDs are our own channels to other
+     * generations of the application (i.e. the handoff
+     * socket). The program never knows about these, so
+     * we never close them on its behalf. */
+    CONTROL = 6,
+
+    /* REGION FDs are memory regions (i.e. memfds) that
+     * the program has asked us to pass on to the next copy.
+     * Like BOUND FDs, these are encoded across exec(). */
+    REGION = 7,
+
+    /* PARKED FDs are connections we accepted on the
+     * program's behalf while it was restarting. They are
+     * handed out by the next accept() on their listener,
+     * and are encoded across exec() like BOUND FDs. */
+    PARKED = 8,
+
 } fdtype_t;
 
 struct fdinfo;
 typedef struct fdinfo fdinfo_t;
 
+#define BOUND_EPOLL_MAX (4)
+#define BOUND_SOCKOPT_MAX (32)
+#define SOCKOPT_LEN_MAX (16)
+
+typedef
+struct sockopt
+{
+    int level;
+    int optname;
+    socklen_t optlen;
+
+    /* Whether this was set by the previous copy (and not
+     * by us, yet), and whether the value is something we
+     * can't copy (i.e. a BPF program). Opaque values are
+     * only good within this copy of the application. */
+    int inherited :1;
+    int opaque :1;
+    char optval[SOCKOPT_LEN_MAX];
+} __attribute__((packed)) sockopt_t;
+
+typedef
+struct listenerinfo
+{
+    /* Sockets passed in by a supervisor (LISTEN_FDS)
+     * have to stay where the program expects them.
+     * This is the fd it was passed as, or zero. */
+    int listen_fd;
+
+    /* Connections parked for this socket (oldest first, see
+     * parkedinfo_t), and our own connection to it (plus one,
+     * or zero), which keeps it readable until they're gone
+     * (see impl_park_wake()). */
+    int parked;
+    fdinfo_t *parked_head;
+    fdinfo_t *parked_tail;
+    int wake_fd;
+
+    /* Connections from this socket that are still open,
+     * how many there have been, and how many were accepted
+     * in the current (and the previous) second. */
+    int tracked;
+    unsigned long accepted;
+    time_t accept_second;
+    unsigned long accept_count;
+    unsigned long accept_last;
+
+    /* Where the program had this socket before we swapped
+     * in a dummy (plus one, or zero), and how it was registered
+     * with epoll. This is so that it can be put back if the
+     * restart doesn't work out (see impl_reinstate()). */
+    int ghost_fd;
+    int epolls;
+    struct
+    {
+        int efd;
+        uint32_t events;
+        uint64_t data;
+    } epoll[BOUND_EPOLL_MAX];
+
+    /* The deadline itself (in seconds), and when it runs out
+     * for connections up to drain_seq (zero if not draining). */
+    int deadline;
+    time_t drain_until;
+    unsigned long drain_seq;
+
+    /* Options the program has set on this socket. If the
+     * next copy binds it again, these are compared against
+     * what it asks for (see impl_sockopt_replay()). */
+    int nopts;
+    sockopt_t *opts;
+} listenerinfo_t;
+
 typedef
 struct boundinfo
 {
@@ -72,6 +162,18 @@ struct boundinfo
     int real_listened :1;
     int is_ghost :1;
 
+    /* Datagram sockets are never listened or
+     * accepted on, so there is nothing to track.
+     * On restart we steer new datagrams to the
+     * next copy of the application and leave the
+     * old one a socket that can only send. */
+    int is_dgram :1;
+
+    /* Whether the program (or HUPTIME_DRAIN) has given
+     * connections from this socket a deadline to finish
+     * up by once draining starts (see impl_drain_start()). */
+    int has_deadline :1;
+
     /* We see some higher-level tools passing
      * more complex address data down. The default
      * struct sockaddr is only 16 bytes, but java
@@ -82,14 +184,35 @@ struct boundinfo
     struct sockaddr* addr;
     socklen_t addrlen;
 
+    /* Everything else we keep for a listener. This is
+     * kept apart so that every other fdinfo_t is small. */
+    listenerinfo_t* listener;
+
 } __attribute__((packed)) boundinfo_t;
 
 typedef
 struct trackedinfo
 {
     fdinfo_t *bound;
+
+    /* Where this falls in bound->bound.listener->accepted. */
+    unsigned long seq;
 } trackedinfo_t;
 
+typedef
+struct parkedinfo
+{
+    fdinfo_t *bound;
+
+    /* The next connection parked for the same
+     * listener, and where this one is. */
+    fdinfo_t *next;
+    int fd;
+
+    /* Where the listener was when this was encoded. */
+    int bound_fd;
+} parkedinfo_t;
+
 typedef
 struct savedinfo
 {
@@ -105,7 +228,11 @@ struct initialinfo
 typedef
 struct dummyinfo
 {
-    int client;
+    /* Whether accept() still owes a (dead) client. */
+    int pending;
+
+    /* The socket this stands in for (if any). */
+    fdinfo_t *bound;
 } dummyinfo_t;
 
 typedef
@@ -113,6 +240,22 @@ struct epollinfo
 {
 } epollinfo_t;
 
+typedef
+struct controlinfo
+{
+} controlinfo_t;
+
+#define REGION_NAME_MAX (32)
+
+typedef
+struct regioninfo
+{
+    /* Whether this came from the previous copy (and
+     * is waiting to be mapped) or is for the next one. */
+    int inherited :1;
+    char *name;
+} __attribute__((packed)) regioninfo_t;
+
 struct fdinfo
 {
     fdtype_t type;
@@ -125,6 +268,9 @@ struct fdinfo
         initialinfo_t initial;
         dummyinfo_t dummy;
         epollinfo_t epoll;
+        controlinfo_t control;
+        regioninfo_t region;
+        parkedinfo_t parked;
     };
 };
 
@@ -135,6 +281,9 @@ extern int total_saved;
 extern int total_initial;
 extern int total_dummy;
 extern int total_epoll;
+extern int total_control;
+extern int total_region;
+extern int total_parked;
 
 static inline fdinfo_t*
 alloc_info(fdtype_t type)
@@ -146,6 +295,8 @@ alloc_info(fdtype_t type)
     switch( type )
     {
         case BOUND:
+            info->bound.listener =
+                (listenerinfo_t*)calloc(1, sizeof(listenerinfo_t));
             __sync_fetch_and_add(&total_bound, 1);
             break;
         case TRACKED:
@@ -160,6 +311,15 @@ alloc_info(fdtype_t type)
         case EPOLL:
             __sync_fetch_and_add(&total_epoll, 1);
             break;
+        case CONTROL:
+            __sync_fetch_and_add(&total_control, 1);
+            break;
+        case REGION:
+            __sync_fetch_and_add(&total_region, 1);
+            break;
+        case PARKED:
+            __sync_fetch_and_add(&total_parked, 1);
+            break;
     }
     return info;
 }
@@ -175,11 +335,17 @@ free_info(fdinfo_t* info)
             {
                 free(info->bound.addr);
             }
+            if( info->bound.listener->opts != NULL )
+            {
+                free(info->bound.listener->opts);
+            }
+            free(info->bound.listener);
             __sync_fetch_and_add(&total_bound, -1);
             break;
         case TRACKED:
             if( info->tracked.bound != NULL )
             {
+                info->tracked.bound->bound.listener->tracked -= 1;
                 dec_ref(info->tracked.bound);
             }
             __sync_fetch_and_add(&total_tracked, -1);
@@ -188,11 +354,30 @@ free_info(fdinfo_t* info)
             __sync_fetch_and_add(&total_saved, -1);
             break;
         case DUMMY:
+            if( info->dummy.bound != NULL )
+            {
+                dec_ref(info->dummy.bound);
+            }
             __sync_fetch_and_add(&total_dummy, -1);
             break;
         case EPOLL:
             __sync_fetch_and_add(&total_epoll, -1);
             break;
+        case CONTROL:
+            __sync_fetch_and_add(&total_control, -1);
+            break;
+        case REGION:
+            free(info->region.name);
+            __sync_fetch_and_add(&total_region, -1);
+            break;
+        case PARKED:
+            if( info->parked.bound != NULL )
+            {
+                info->parked.bound->bound.listener->parked -= 1;
+                dec_ref(info->parked.bound);
+            }
+            __sync_fetch_and_add(&total_parked, -1);
+            break;
     }
     free(info);
 }
@@ -215,4 +400,7 @@ dec_ref(fdinfo_t* info)
 int info_decode(int pipe, int *fd, fdinfo_t **info);
 int info_encode(int pipe, int fd, fdinfo_t *info);
 
+/* Whether a bind() to this address is for this BOUND socket. */
+int info_match(fdinfo_t *info, const struct sockaddr *addr, socklen_t addrlen, int is_dgram);
+
 #endif
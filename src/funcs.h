@@ -23,6 +23,7 @@
 #define HUPTIME_FUNCS_H
 
 #include <unistd.h>
+#include <sched.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <sys/wait.h>
@@ -33,13 +34,21 @@ typedef int (*bind_t)(int sockfd, const struct sockaddr *addr, socklen_t addrlen
 typedef int (*accept_t)(int sockfd, struct sockaddr *addr, socklen_t *addrlen);
 typedef int (*accept4_t)(int sockfd, struct sockaddr *addr, socklen_t *addrlen, int flags);
 typedef int (*listen_t)(int sockfd, int backlog);
+typedef int (*setsockopt_t)(int sockfd, int level, int optname, const void *optval, socklen_t optlen);
 typedef int (*close_t)(int fd);
+typedef int (*close_range_t)(unsigned int first, unsigned int last, int flags);
+typedef void (*closefrom_t)(int lowfd);
 typedef pid_t (*fork_t)(void);
+typedef int (*clone_t)(int (*fn)(void *), void *stack, int flags, void *arg, ...);
 typedef int (*dup_t)(int fd);
 typedef int (*dup2_t)(int fd, int fd2);
 typedef int (*dup3_t)(int fd, int fd2, int flags);
+typedef int (*fcntl_t)(int fd, int cmd, ...);
+typedef int (*fcntl64_t)(int fd, int cmd, ...);
+typedef int (*unlink_t)(const char *pathname);
+typedef int (*unlinkat_t)(int dirfd, const char *pathname, int flags);
 typedef void (*exit_t)(int status);
-typedef pid_t (*wait_t)(void *status);
+typedef pid_t (*wait_t)(int *status);
 typedef pid_t (*waitpid_t)(pid_t pid, int *status, int options); 
 typedef long (*syscall_t)(long number, ...);
 typedef int (*epoll_create_t)(int size);
@@ -50,13 +59,21 @@ typedef struct
 {
     bind_t bind;
     listen_t listen;
+    setsockopt_t setsockopt;
     accept_t accept;
     accept4_t accept4;
     close_t close;
+    close_range_t close_range;
+    closefrom_t closefrom;
     fork_t fork;
+    clone_t clone;
     dup_t dup;
     dup2_t dup2;
     dup3_t dup3;
+    fcntl_t fcntl;
+    fcntl64_t fcntl64;
+    unlink_t unlink;
+    unlinkat_t unlinkat;
     exit_t exit;
     wait_t wait;
     waitpid_t waitpid;
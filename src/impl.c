@@ -26,6 +26,7 @@
 #include "utils.h"
 
 #include <stdio.h>
+#include <stddef.h>
 #include <signal.h>
 #include <unistd.h>
 #include <fcntl.h>
@@ -37,24 +38,32 @@
 #include <sys/un.h>
 #include <sys/syscall.h>
 #include <sys/wait.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
 #include <poll.h>
+#include <dirent.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <limits.h>
+#include <time.h>
+#include <linux/filter.h>
 
 #define unlikely(x) __builtin_expect(!!(x), 0)
 
-#ifndef SYS_accept4
-#ifdef ARCH64BIT
-#define SYS_accept4 (288)
-#elif ARCH32BIT
-#define SYS_accept4 (0x40000000 + 288)
-#else
-#error "Unknown architecture?"
-#endif
+/* What we call our own threads (see impl_program_threads()). */
+#define THREAD_NAME "huptime"
+
+#ifndef CLOSE_RANGE_CLOEXEC
+#define CLOSE_RANGE_CLOEXEC (1U << 2)
 #endif
 
 typedef enum 
 {
     FORK = 1,
     EXEC = 2,
+    HYBRID = 3,
 } exit_strategy_t;
 
 typedef enum
@@ -72,6 +81,11 @@ static char *cwd_copy = NULL;
 /* Whether or not we are currently exiting. */
 static bool_t is_exiting = FALSE;
 
+/* Whether we're leaving for good, without a next copy.
+ * In multi mode, this is how the pool shrinks (see the
+ * retire flag in our generation slot). */
+static bool_t is_retiring = FALSE;
+
 /* Our exit strategy (set on startup). */
 static exit_strategy_t exit_strategy = FORK;
 
@@ -81,15 +95,100 @@ static char *to_unlink = NULL;
 /* Multi mode? */
 static bool_t multi_mode = FALSE;
 
+/* Is the pool sized by bin/huptime (--multi=<min>:<max>)?
+ * If so, we may be asked to retire (see impl_restart_thread()). */
+static bool_t autoscale_mode = FALSE;
+
+/* The CPU this worker is pinned to in multi mode (if any).
+ * Connections that arrive there are steered to us. */
+static int incoming_cpu = -1;
+
 /* Revive mode? */
 static bool_t revive_mode = FALSE;
 
 /* Wait mode? */
 static bool_t wait_mode = FALSE;
 
+/* How long (in seconds) to keep the send side of
+ * datagram sockets alive after a restart, and when
+ * (in microseconds, see impl_now_us()). */
+static int linger_time = 1;
+static long long linger_until = 0;
+
+/* How long (in seconds) to keep serving while the next
+ * copy starts up, if it's going to tell us it's ready. */
+static int ready_time = 0;
+
+/* Whether this copy has said it's ready. */
+static bool_t is_ready = FALSE;
+
+/* Which copy of the program this is (starting at zero). */
+static int generation = 0;
+
+/* Fires when we start draining (see impl_drain_fd()). */
+static int drain_fd = -1;
+
+/* Stands in for listeners we've passed on (see impl_dummy_server()). */
+static int dummy_server = -1;
+
+/* The files that unix listeners are bound to, so that unlink()
+ * needn't look any further for anything else. If there are too
+ * many, we always look (see unix_path_protected()). */
+#define UNIX_PATHS_MAX (16)
+typedef struct
+{
+    dev_t dev;
+    ino_t ino;
+} unixpath_t;
+static unixpath_t unix_paths[UNIX_PATHS_MAX];
+static int unix_paths_count = 0;
+static bool_t unix_paths_overflow = FALSE;
+
+/* In hybrid mode, whether we're waiting on the program to
+ * call accept() so that we can split (see impl_hybrid_split()). */
+static bool_t hybrid_pending = FALSE;
+static int hybrid_client = -1;
+
+/* Sockets passed in by a supervisor (systemd style). */
+static int listen_fds = 0;
+
+/* Where to record how long restarts take (if anywhere). */
+static char *stats_path = NULL;
+
+/* Where to send supervisor notifications (if anywhere). */
+static const char *notify_socket = NULL;
+static bool_t notified_ready = FALSE;
+
+/* Hooks registered by the program (by event - 1). */
+#define HOOK_MAX (8)
+typedef struct
+{
+    huptime_hook_t fn;
+    void *data;
+} hook_t;
+static hook_t hooks[HUPTIME_PRE_EXEC][HOOK_MAX];
+static bool_t in_hooks = FALSE;
+
+/* Set once we're ready to exec() but have hooks to run first.
+ * The restart thread does the exec() (see impl_restart_thread()),
+ * so that hooks never run on one of the program's threads with
+ * our lock held. */
+static bool_t exec_pending = FALSE;
+
 /* Whether or not our HUP handler will exit or restart. */
 static pid_t master_pid = (pid_t)-1;
 
+/* The process our state belongs to. A child that shares
+ * our memory (vfork(), or clone() with CLONE_VM) sees the
+ * same state but has a different pid, see impl_borrowed(). */
+static pid_t owner_pid = (pid_t)-1;
+
+static int
+impl_borrowed(void)
+{
+    return unlikely(getpid() != owner_pid);
+}
+
 /* Debug hook. */
 static bool_t debug_enabled = FALSE;
 
@@ -119,9 +218,378 @@ static pthread_mutex_t mutex;
         pthread_mutex_unlock(&mutex);    \
     } while(0)
 
+/* Drain deadlines from HUPTIME_DRAIN, by port (zero for
+ * the default). Deadlines are in seconds, or -1 for none. */
+#define DRAIN_MAX (16)
+typedef struct
+{
+    int port;
+    int deadline;
+} drain_t;
+static drain_t drains[DRAIN_MAX];
+static int drains_count = 0;
+
+/* How long (in seconds) the next copy has to be ready before
+ * we give up on it and carry on as we were (zero to not bother). */
+static int rollback_time = 0;
+
+/* How many connections we'll accept on the program's behalf
+ * while restarting in exec mode (see impl_park_thread()). */
+#define PARK_MAX (1024)
+static int park_max = 0;
+
+/* In standby mode, the next copy is started ahead of time and
+ * held at its first accept() (see impl_standby_spawn()). This is
+ * what we watch for changes ("true" for the program itself). */
+static char *standby_watch = NULL;
+static struct stat standby_stat;
+static pid_t standby_pid = -1;
+static bool_t standby_spawning = FALSE;
+
+/* Our end of the channel to the standby or, in the
+ * standby itself, its end (see impl_standby_hold()). */
+static int standby_fd = -1;
+static bool_t is_standby = FALSE;
+
+/* The end to pass on to the next copy (see impl_exec()). */
+static int standby_pass_fd = -1;
+
+/* The next copy, while we're waiting on it (see impl_wait_ready()). */
+static pid_t spawned_child = -1;
+
+/* Whether impl_drain_thread() is running. */
+static bool_t drain_running = FALSE;
+
+/* Every copy of the program has a slot in a table that's
+ * shared between them (see impl_init_generations()). This
+ * is how we know how many copies are draining at once. The
+ * layout is fixed, as bin/huptime reads it as well. */
+#define GENERATIONS_MAX (64)
+typedef struct
+{
+    int32_t pid;
+    int32_t generation;
+    int32_t draining;
+    int32_t force;
+    int32_t retire;
+    int32_t unused;
+    int64_t tracked;
+    int64_t started;
+    int64_t drain_started;
+    int64_t start_ticks;
+} gen_slot_t;
+static int gen_fd = -1;
+static gen_slot_t* gen_table = NULL;
+static gen_slot_t* gen_slot = NULL;
+
+/* How long to wait for more restarts to fold into one (ms),
+ * how many copies may be draining at once (zero for any), and
+ * whether to force the oldest to finish up rather than wait. */
+static int coalesce_time = 0;
+static int max_draining = 0;
+static bool_t overflow_force = FALSE;
+
+/* Even when waiting (rather than forcing), we only wait so
+ * long for another copy to finish (in seconds) if there's no
+ * drain deadline to go by (see impl_gen_wait()). */
+#define OVERFLOW_WAIT_MAX (60)
+
 /* Our restart signal pipe. */
 static int restart_pipe[2] = { -1, -1 };
 
+/* Our handoff channel. Connections handed off by this
+ * copy of the program are sent on [0] and received by the
+ * next copy on [1], which is passed through exec(). */
+static int handoff_pipe[2] = { -1, -1 };
+
+/* How long (in seconds) to wait for the next copy to
+ * take a connection before giving up on the handoff. */
+#define HANDOFF_TIMEOUT (5)
+
+/* The channel from the previous copy (if any). */
+static int adopt_fd = -1;
+static bool_t adopt_started = FALSE;
+static huptime_adopt_t adopt_cb = NULL;
+static void *adopt_data = NULL;
+
+static long long
+impl_now_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+static void
+impl_stat(const char *phase, long long start)
+{
+    /* Record how long a phase of the restart took, as a line
+     * of JSON. Times are from the monotonic clock, so lines
+     * from different generations can be lined up. */
+    if( stats_path == NULL )
+    {
+        return;
+    }
+
+    long long end = impl_now_us();
+    char line[256];
+    int len = snprintf(line, sizeof(line),
+        "{\"pid\": %d, \"generation\": %d, \"phase\": \"%s\", "
+        "\"start_us\": %lld, \"us\": %lld, \"fd_limit\": %d}\n",
+        (int)getpid(), generation, phase, start, end - start, fd_limit());
+
+    int fd = open(stats_path, O_WRONLY|O_APPEND|O_CREAT|O_CLOEXEC, 0644);
+    if( fd >= 0 )
+    {
+        write(fd, line, len);
+        libc.close(fd);
+    }
+}
+
+static int64_t
+impl_gen_start_ticks(pid_t pid)
+{
+    /* When the process started (in clock ticks since boot).
+     * This is the 22nd field in /proc/<pid>/stat, and doesn't
+     * change on exec(). We start counting after the command,
+     * which may have spaces (or parentheses) of its own. */
+    char path[64];
+    char buf[512];
+    snprintf(path, sizeof(path), "/proc/%d/stat", (int)pid);
+    int fd = open(path, O_RDONLY|O_CLOEXEC);
+    if( fd < 0 )
+    {
+        return -1;
+    }
+    ssize_t len = read(fd, buf, sizeof(buf) - 1);
+    libc.close(fd);
+    if( len <= 0 )
+    {
+        return -1;
+    }
+    buf[len] = '\0';
+
+    char *field = strrchr(buf, ')');
+    for( int i = 2; field != NULL && i < 22; i += 1 )
+    {
+        field = strchr(field + 1, ' ');
+    }
+    if( field == NULL )
+    {
+        return -1;
+    }
+    return strtoll(field + 1, NULL, 10);
+}
+
+static int
+impl_gen_alive(gen_slot_t* slot)
+{
+    pid_t pid = slot->pid;
+    if( pid == 0 )
+    {
+        return 0;
+    }
+    if( kill(pid, 0) < 0 && errno == ESRCH )
+    {
+        /* It went away without telling us. */
+        __sync_bool_compare_and_swap(&slot->pid, pid, 0);
+        return 0;
+    }
+    if( impl_gen_start_ticks(pid) != slot->start_ticks )
+    {
+        /* It went away and the pid has been given to some
+         * other process since (see impl_init_generations()). */
+        return 0;
+    }
+    return 1;
+}
+
+static void
+impl_init_generations(const char* gen_env)
+{
+    /* The table is created by the first copy, and passed
+     * on to every copy after that (see impl_exec()). */
+    if( gen_env != NULL && strlen(gen_env) > 0 )
+    {
+        gen_fd = strtol(gen_env, NULL, 10);
+        libc.fcntl(gen_fd, F_SETFD, FD_CLOEXEC);
+    }
+    else
+    {
+        gen_fd = memfd_create("huptime-generations", MFD_CLOEXEC);
+        if( gen_fd >= 0 &&
+            ftruncate(gen_fd, sizeof(gen_slot_t) * GENERATIONS_MAX) < 0 )
+        {
+            libc.close(gen_fd);
+            gen_fd = -1;
+        }
+    }
+    if( gen_fd < 0 )
+    {
+        DEBUG("Unable to create generation table: %s", strerror(errno));
+        return;
+    }
+
+    gen_table = (gen_slot_t*)mmap(NULL,
+        sizeof(gen_slot_t) * GENERATIONS_MAX,
+        PROT_READ|PROT_WRITE, MAP_SHARED, gen_fd, 0);
+    if( gen_table == MAP_FAILED )
+    {
+        DEBUG("Unable to map generation table: %s", strerror(errno));
+        libc.close(gen_fd);
+        gen_fd = -1;
+        gen_table = NULL;
+        return;
+    }
+    fd_save(gen_fd, alloc_info(CONTROL));
+
+    /* Take our slot. In exec mode, we already have one. */
+    pid_t pid = getpid();
+    for( int i = 0; i < GENERATIONS_MAX && gen_slot == NULL; i += 1 )
+    {
+        if( gen_table[i].pid == pid )
+        {
+            gen_slot = &gen_table[i];
+        }
+    }
+    for( int i = 0; i < GENERATIONS_MAX && gen_slot == NULL; i += 1 )
+    {
+        if( !impl_gen_alive(&gen_table[i]) &&
+            __sync_bool_compare_and_swap(&gen_table[i].pid, 0, pid) )
+        {
+            gen_slot = &gen_table[i];
+        }
+    }
+    for( int i = 0; i < GENERATIONS_MAX && gen_slot == NULL; i += 1 )
+    {
+        /* Only slots left behind by a process whose pid has
+         * been reused, so we have to take them from it. */
+        pid_t stale = gen_table[i].pid;
+        if( !impl_gen_alive(&gen_table[i]) &&
+            __sync_bool_compare_and_swap(&gen_table[i].pid, stale, pid) )
+        {
+            gen_slot = &gen_table[i];
+        }
+    }
+    if( gen_slot == NULL )
+    {
+        DEBUG("Generation table is full.");
+        return;
+    }
+    gen_slot->start_ticks = impl_gen_start_ticks(pid);
+    gen_slot->generation = generation;
+    gen_slot->draining = 0;
+    gen_slot->force = 0;
+    gen_slot->retire = 0;
+    gen_slot->tracked = 0;
+    gen_slot->drain_started = 0;
+
+    /* A standby isn't running until it's let go, so
+     * it has no start time until then (see impl_standby_hold()). */
+    gen_slot->started = (is_standby == TRUE) ? 0 : time(NULL);
+}
+
+static void
+impl_gen_release(void)
+{
+    /* We're going away for good. */
+    if( gen_slot != NULL && gen_slot->pid == getpid() )
+    {
+        gen_slot->pid = 0;
+    }
+}
+
+static int
+impl_gen_draining(gen_slot_t** oldest)
+{
+    /* Count the other copies that are still draining, and
+     * find the oldest one that hasn't been told to hurry up. */
+    int count = 0;
+    *oldest = NULL;
+    for( int i = 0; i < GENERATIONS_MAX; i += 1 )
+    {
+        gen_slot_t* slot = &gen_table[i];
+        if( slot == gen_slot || !slot->draining || !impl_gen_alive(slot) )
+        {
+            continue;
+        }
+        count += 1;
+        if( !slot->force &&
+            (*oldest == NULL || slot->generation < (*oldest)->generation) )
+        {
+            *oldest = slot;
+        }
+    }
+    return count;
+}
+
+static void
+impl_gen_wait(void)
+{
+    /* Let a burst of restarts settle. Any that arrive
+     * in the meantime are folded into this one, as the
+     * signal handler only fires once (see sighandler()). */
+    if( coalesce_time > 0 )
+    {
+        DEBUG("Coalescing restarts for %d ms.", coalesce_time);
+        struct timespec ts = {
+            coalesce_time / 1000,
+            (coalesce_time % 1000) * 1000000L };
+        while( nanosleep(&ts, &ts) < 0 && errno == EINTR );
+    }
+
+    /* Don't have too many copies draining at once. */
+    if( gen_table == NULL || max_draining <= 0 )
+    {
+        return;
+    }
+
+    /* If we're to wait, it's only until the oldest copy is
+     * past its deadline (the longest in HUPTIME_DRAIN), and
+     * then it's forced all the same. Otherwise one copy that
+     * never finishes would hold up every restart after it. */
+    int wait_max = -1;
+    for( int i = 0; i < drains_count; i += 1 )
+    {
+        if( drains[i].deadline > wait_max )
+        {
+            wait_max = drains[i].deadline;
+        }
+    }
+    if( wait_max < 0 )
+    {
+        wait_max = OVERFLOW_WAIT_MAX;
+    }
+
+    time_t logged = 0;
+    while( 1 )
+    {
+        gen_slot_t* oldest = NULL;
+        if( impl_gen_draining(&oldest) < max_draining )
+        {
+            break;
+        }
+        time_t now = time(NULL);
+        if( oldest != NULL &&
+            (overflow_force == TRUE ||
+             now - oldest->drain_started >= wait_max) )
+        {
+            DEBUG("Forcing generation %d (pid %d) to finish.",
+                  oldest->generation, oldest->pid);
+            oldest->force = 1;
+        }
+        else if( oldest != NULL && now - logged >= 5 )
+        {
+            fprintf(stderr, "huptime: waiting on generation %d "
+                    "(pid %d) to finish draining.\n",
+                    oldest->generation, oldest->pid);
+            logged = now;
+        }
+        struct timespec ts = { 0, 100000000L };
+        nanosleep(&ts, NULL);
+    }
+}
+
 /* Our core signal handlers. */
 static void* impl_restart_thread(void*);
 void
@@ -141,6 +609,18 @@ sighandler(int signo)
         /* We've already run. */
         return;
     }
+    if( impl_borrowed() )
+    {
+        /* A vfork() child that hasn't called exec() yet.
+         * The pipe is shared, so this would restart us. */
+        return;
+    }
+    if( is_standby == TRUE )
+    {
+        /* Whoever sent this meant the current copy
+         * (i.e. killall). We're not running yet. */
+        return;
+    }
 
     while( 1 )
     {
@@ -187,7 +667,7 @@ do_dup(int fd)
     DEBUG("do_dup(%d, ...) ...", fd);
     L();
     info = fd_lookup(fd);
-    if( info == NULL )
+    if( info == NULL || impl_borrowed() )
     {
         U();
         rval = libc.dup(fd);
@@ -207,48 +687,192 @@ do_dup(int fd)
     return rval;
 }
 
-void
-impl_exec(void)
+static void
+impl_run_hooks(int event)
 {
-    DEBUG("Preparing for exec...");
+    /* These are run without any locks held (except
+     * just before exec() in a forked copy, where we
+     * are single-threaded, or on revive). */
+    for( int i = 0; i < HOOK_MAX; i += 1 )
+    {
+        hook_t hook = hooks[event - 1][i];
+        if( hook.fn != NULL )
+        {
+            DEBUG("Running hook %d.", event);
+            hook.fn(hook.data);
+        }
+    }
+}
 
-    /* Reset our signal masks.
-     * We intentionally mask SIGHUP here so that
-     * it can't be called prior to us installing
-     * our signal handlers. */
-    sigset_t set;
-    sigemptyset(&set);
-    sigaddset(&set, SIGHUP);
-    sigprocmask(SIG_BLOCK, &set, NULL);
+static char**
+environ_set(char **environ, char *entry)
+{
+    size_t name_len = strchr(entry, '=') - entry + 1;
+    int environ_len = 0;
+
+    for( environ_len = 0;
+         environ[environ_len] != NULL;
+         environ_len += 1 )
+    {
+        if( !strncmp(entry, environ[environ_len], name_len) )
+        {
+            environ[environ_len] = entry;
+            return environ;
+        }
+    }
+
+    /* We need to extend the environment. */
+    char** new_environ = realloc(environ, sizeof(char*) * (environ_len + 2));
+    new_environ[environ_len] = entry;
+    new_environ[environ_len + 1] = NULL;
+    return new_environ;
+}
+
+/* Everything the next copy needs, ready for execve().
+ * This is built by whoever is about to exec (see impl_exec()),
+ * or by us for a child that shares our memory and so can't
+ * do anything much itself (see impl_exec_spawn()). */
+typedef struct
+{
+    int blob_fd;
+    int handoff_fd;
+    int gen_fd;
+    int standby_fd;
+
+    /* Descriptors that need FD_CLOEXEC cleared. */
+    int *inherit;
+    int inherit_count;
+
+    char **environ;
+    char pipe_env[32];
+    char generation_env[32];
+    char handoff_env[32];
+    char gen_env[32];
+    char standby_env[32];
+    char listen_pid_env[32];
+    char register_env[32];
+
+    /* For impl_exec_spawn() only. */
+    sigset_t mask;
+    int error;
+} execprep_t;
+
+static void
+impl_exec_release(execprep_t *prep)
+{
+    /* Whatever the next copy didn't take. */
+    if( prep->blob_fd >= 0 )
+    {
+        libc.close(prep->blob_fd);
+    }
+    if( prep->handoff_fd >= 0 )
+    {
+        libc.close(prep->handoff_fd);
+    }
+    if( prep->gen_fd >= 0 )
+    {
+        libc.close(prep->gen_fd);
+    }
+    if( prep->standby_fd >= 0 )
+    {
+        libc.close(prep->standby_fd);
+    }
+    free(prep->inherit);
+    free(prep->environ);
+    memset(prep, 0, sizeof(*prep));
+    prep->blob_fd = -1;
+    prep->handoff_fd = -1;
+    prep->gen_fd = -1;
+    prep->standby_fd = -1;
+}
+
+static void
+impl_region_env(void)
+{
+    /* Programs not using the API can register regions by
+     * setting HUPTIME_REGISTER before a restart, with the same
+     * name=fd pairs (separated by colons) as HUPTIME_REGIONS. */
+    const char *env = getenv("HUPTIME_REGISTER");
+    if( env == NULL || env[0] == '\0' )
+    {
+        return;
+    }
+    char *copy = strdup(env);
+    if( copy == NULL )
+    {
+        return;
+    }
+
+    char *save = NULL;
+    for( char *entry = strtok_r(copy, ":", &save);
+         entry != NULL;
+         entry = strtok_r(NULL, ":", &save) )
+    {
+        char *value = strchr(entry, '=');
+        char *end = NULL;
+        long fd = -1;
+        if( value != NULL && value != entry )
+        {
+            *value = '\0';
+            fd = strtol(value + 1, &end, 10);
+            if( end == value + 1 || *end != '\0' )
+            {
+                fd = -1;
+            }
+        }
+        if( fd < 0 || impl_region_register(entry, (int)fd) < 0 )
+        {
+            fprintf(stderr, "huptime: unable to register region '%s'.\n",
+                    entry);
+        }
+    }
+    free(copy);
+}
+
+static int
+impl_exec_prepare(execprep_t *prep)
+{
+    memset(prep, 0, sizeof(*prep));
+    prep->blob_fd = -1;
+    prep->handoff_fd = -1;
+    prep->gen_fd = -1;
+    prep->standby_fd = -1;
+
+    /* Pick up any regions from the environment. */
+    impl_region_env();
 
     /* Encode extra information.
      *
      * This includes information about sockets which
-     * are in the BOUND or SAVED state. Note that we
+     * are in the BOUND or SAVED state (and any regions
+     * that are being passed on). Note that we
      * can't really do anything with these *now* as
      * there are real threads running rampant -- so
      * we encode things for the exec() and take care 
      * of it post-exec(), where we know we're solo.
      *
-     * This information is encoded into a pipe which
-     * is passed as an extra environment variable into
-     * the next child. Although there is a limit on the
-     * amount of data that can be stuffed into a pipe,
-     * past Linux 2.6.11 (IIRC) this is 65K. */
-    int pipes[2];
-    if( pipe(pipes) < 0 )
-    {
-        DEBUG("Unable to create pipes?");
-        libc.exit(1);
+     * This information is encoded into an in-memory
+     * file which is passed as an extra environment
+     * variable into the next child. Unlike a pipe, there
+     * is no limit on how much we can stuff into it, and
+     * nothing blocks if the next copy never reads it. */
+    prep->blob_fd = memfd_create("huptime-handoff", 0);
+    prep->inherit = malloc(sizeof(int) * (fd_limit() + 1));
+    if( prep->blob_fd < 0 || prep->inherit == NULL )
+    {
+        DEBUG("Unable to create handoff: %s", strerror(errno));
+        return -1;
     }
 
-    /* Stuff information into the pipe. */
+    /* Stuff information into the file. */
     for( int fd = 0; fd < fd_limit(); fd += 1 )
     {
         fdinfo_t *info = fd_lookup(fd);
 
         int to_be_saved = (info != NULL &&
-            (info->type == BOUND || info->type == SAVED));
+            (info->type == BOUND || info->type == SAVED ||
+             info->type == PARKED ||
+             (info->type == REGION && !info->region.inherited)));
 
         if( fd == 2 || to_be_saved )
         {
@@ -257,11 +881,11 @@ impl_exec(void)
              * an arbitrary number of file descriptors and
              * mark them all CLO_EXEC. That is so messed up.
              * That's some seriously broken behaviour. */
-            fcntl(fd, F_SETFD, 0);
+            prep->inherit[prep->inherit_count++] = fd;
         }
         if( to_be_saved )
         {
-            if( info_encode(pipes[1], fd, info) < 0 )
+            if( info_encode(prep->blob_fd, fd, info) < 0 )
             {
                 DEBUG("Error encoding fd %d: %s",
                       fd, strerror(errno));
@@ -272,60 +896,298 @@ impl_exec(void)
             }
         }
     }
-    libc.close(pipes[1]);
+    lseek(prep->blob_fd, 0, SEEK_SET);
     DEBUG("Finished encoding.");
 
-    /* Prepare our environment variable. */
-    char pipe_env[32];
-    snprintf(pipe_env, 32, "HUPTIME_PIPE=%d", pipes[0]);
-
-    /* Mask the existing environment variable. */
-    char **environ = environ_copy;
-    int environ_len = 0;
-
-    for( environ_len = 0;
-         environ[environ_len] != NULL;
-         environ_len += 1 )
+    /* Pass on the receive side of our handoff channel.
+     * We move it above every descriptor that will be
+     * restored on the other side, so that it can't be
+     * clobbered before it is picked up. */
+    int lowest = 0;
+    for( int fd = 0; fd < fd_limit(); fd += 1 )
     {
-        if( !strncmp("HUPTIME_PIPE=",
-                     environ[environ_len], 
-                     strlen("HUPTIME_PIPE=")) )
+        fdinfo_t *info = fd_lookup(fd);
+        if( info != NULL )
         {
-            environ[environ_len] = pipe_env;
-            break;
+            lowest = fd + 1;
+            if( info->type == SAVED && info->saved.fd >= lowest )
+            {
+                lowest = info->saved.fd + 1;
+            }
         }
     }
-
-    /* Do we need to extend the environment? */
-    if( environ[environ_len] == NULL )
+    if( handoff_pipe[1] >= 0 )
     {
-        char** new_environ = malloc(sizeof(char*) * (environ_len + 2));
-        memcpy(new_environ, environ, sizeof(char*) * (environ_len));
-        new_environ[environ_len] = pipe_env;
-        new_environ[environ_len + 1] = NULL;
-        environ = new_environ;
+        prep->handoff_fd = libc.fcntl(handoff_pipe[1], F_DUPFD, lowest);
     }
 
-    /* Execute in the same environment, etc. */
-    chdir(cwd_copy);
-    DEBUG("Doing exec()... bye!");
-    execve(exe_copy, args_copy, environ);
-
-    /* Bail. Should never reach here. */
-    DEBUG("Things went horribly wrong!");
-    libc.exit(1);
-}
+    /* The same goes for the generation table. */
+    if( gen_fd >= 0 )
+    {
+        prep->gen_fd = libc.fcntl(gen_fd, F_DUPFD,
+            prep->handoff_fd >= lowest ? prep->handoff_fd + 1 : lowest);
+    }
 
-void
-impl_exit_check(void)
-{
-    if( is_exiting == TRUE && total_tracked == 0 )
+    /* And the same for a standby's channel (if we're starting one). */
+    if( standby_pass_fd >= 0 )
     {
-        if( wait_mode == TRUE )
+        int above = lowest;
+        if( prep->handoff_fd >= above )
         {
-            /* Check for any active child processes.
-             * NOTE: Because we are using waitid() here, and
-             * that allows us to specify WNOWAIT, the child
+            above = prep->handoff_fd + 1;
+        }
+        if( prep->gen_fd >= above )
+        {
+            above = prep->gen_fd + 1;
+        }
+        prep->standby_fd = libc.fcntl(standby_pass_fd, F_DUPFD, above);
+    }
+
+    /* Prepare our environment variables. */
+    snprintf(prep->pipe_env, 32, "HUPTIME_PIPE=%d", prep->blob_fd);
+    snprintf(prep->generation_env, 32, "HUPTIME_GENERATION=%d", generation + 1);
+    if( prep->handoff_fd >= 0 )
+    {
+        snprintf(prep->handoff_env, 32, "HUPTIME_HANDOFF=%d", prep->handoff_fd);
+    }
+    else
+    {
+        snprintf(prep->handoff_env, 32, "HUPTIME_HANDOFF=");
+    }
+
+    if( prep->gen_fd >= 0 )
+    {
+        snprintf(prep->gen_env, 32, "HUPTIME_GENERATIONS=%d", prep->gen_fd);
+    }
+    else
+    {
+        snprintf(prep->gen_env, 32, "HUPTIME_GENERATIONS=");
+    }
+
+    if( prep->standby_fd >= 0 )
+    {
+        snprintf(prep->standby_env, 32, "HUPTIME_STANDBY_FD=%d", prep->standby_fd);
+    }
+    else
+    {
+        snprintf(prep->standby_env, 32, "HUPTIME_STANDBY_FD=");
+    }
+
+    /* Passed sockets are kept where they were, but
+     * they now belong to whichever process execs. In
+     * fork mode, that's the child, not us (see
+     * impl_exec_child(), which fills in the rest). */
+    snprintf(prep->listen_pid_env, 32, "LISTEN_PID=%d", (int)getpid());
+
+    /* Whatever we started with was for us, not the next copy. */
+    snprintf(prep->register_env, 32, "HUPTIME_REGISTER=");
+
+    /* Mask the existing environment variables.
+     * We work on a copy, in case the exec() fails. */
+    int environ_len = 0;
+    while( environ_copy[environ_len] != NULL )
+    {
+        environ_len += 1;
+    }
+    prep->environ = malloc(sizeof(char*) * (environ_len + 1));
+    if( prep->environ == NULL )
+    {
+        return -1;
+    }
+    memcpy(prep->environ, environ_copy, sizeof(char*) * (environ_len + 1));
+    prep->environ = environ_set(prep->environ, prep->pipe_env);
+    prep->environ = environ_set(prep->environ, prep->handoff_env);
+    prep->environ = environ_set(prep->environ, prep->gen_env);
+    prep->environ = environ_set(prep->environ, prep->standby_env);
+    prep->environ = environ_set(prep->environ, prep->generation_env);
+    prep->environ = environ_set(prep->environ, prep->register_env);
+    if( listen_fds > 0 )
+    {
+        prep->environ = environ_set(prep->environ, prep->listen_pid_env);
+    }
+
+    return 0;
+}
+
+int
+impl_exec(void)
+{
+    DEBUG("Preparing for exec...");
+
+    /* Give the program a last word (unless it already has,
+     * see impl_restart_thread() and impl_hybrid_split()). */
+    if( exec_pending == FALSE )
+    {
+        impl_run_hooks(HUPTIME_PRE_EXEC);
+    }
+    long long start = impl_now_us();
+
+    /* Reset our signal masks.
+     * We intentionally mask SIGHUP here so that
+     * it can't be called prior to us installing
+     * our signal handlers. */
+    sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, SIGHUP);
+    sigprocmask(SIG_BLOCK, &set, NULL);
+
+    execprep_t prep;
+    if( impl_exec_prepare(&prep) < 0 )
+    {
+        int saved_errno = errno;
+        impl_exec_release(&prep);
+        sigprocmask(SIG_UNBLOCK, &set, NULL);
+        errno = saved_errno;
+        return -1;
+    }
+    for( int i = 0; i < prep.inherit_count; i += 1 )
+    {
+        libc.fcntl(prep.inherit[i], F_SETFD, 0);
+    }
+
+    /* Execute in the same environment, etc. */
+    int cwd = open(".", O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+    chdir(cwd_copy);
+    impl_stat("exec", start);
+    DEBUG("Doing exec()... bye!");
+    execve(exe_copy, args_copy, prep.environ);
+
+    /* Things went horribly wrong. Put back what we
+     * can, and let the caller decide what happens. */
+    int saved_errno = errno;
+    DEBUG("Unable to exec: %s", strerror(errno));
+    if( cwd >= 0 )
+    {
+        fchdir(cwd);
+        libc.close(cwd);
+    }
+    impl_exec_release(&prep);
+    sigprocmask(SIG_UNBLOCK, &set, NULL);
+    errno = saved_errno;
+    return -1;
+}
+
+static int
+impl_exec_child(void *arg)
+{
+    /* We're running on borrowed memory (see impl_exec_spawn()),
+     * with every signal blocked. Nothing here may take a lock
+     * or allocate (so no DEBUG() either). */
+    execprep_t *prep = (execprep_t*)arg;
+    for( int i = 0; i < prep->inherit_count; i += 1 )
+    {
+        libc.fcntl(prep->inherit[i], F_SETFD, 0);
+    }
+    if( listen_fds > 0 )
+    {
+        /* See impl_exec_prepare(). Our pid is the one that counts. */
+        snprintf(prep->listen_pid_env, 32, "LISTEN_PID=%d", (int)getpid());
+    }
+    chdir(cwd_copy);
+    sigprocmask(SIG_SETMASK, &prep->mask, NULL);
+    execve(exe_copy, args_copy, prep->environ);
+    prep->error = errno;
+    _exit(1);
+    return 1;
+}
+
+#define SPAWN_STACK_SIZE (64 * 1024)
+
+static pid_t
+impl_exec_spawn(void)
+{
+    /* Start the next copy without copying this one.
+     * A fork() has to copy our page tables (and then pay for
+     * copy-on-write while the two overlap), all of which grows
+     * with the program's heap. Instead, the child borrows our
+     * memory and runs on its own small stack until execve().
+     * We're suspended until then (CLONE_VFORK), which keeps
+     * everything we prepared for it in place. */
+    pid_t child = -1;
+    execprep_t prep;
+    if( impl_exec_prepare(&prep) < 0 )
+    {
+        impl_exec_release(&prep);
+        return -1;
+    }
+
+    void *stack = mmap(NULL, SPAWN_STACK_SIZE, PROT_READ|PROT_WRITE,
+                       MAP_PRIVATE|MAP_ANONYMOUS|MAP_STACK, -1, 0);
+    if( stack == MAP_FAILED )
+    {
+        DEBUG("Unable to map spawn stack: %s", strerror(errno));
+        impl_exec_release(&prep);
+        return -1;
+    }
+
+    /* Nothing of ours (or the program's) should run in the
+     * child, so every signal is blocked until execve(). As in
+     * impl_exec(), the next copy starts with SIGHUP blocked. */
+    sigset_t all;
+    sigset_t old;
+    sigfillset(&all);
+    sigprocmask(SIG_SETMASK, &all, &old);
+    prep.mask = old;
+    sigaddset(&prep.mask, SIGHUP);
+
+    DEBUG("Doing spawn()...");
+    long long start = impl_now_us();
+    child = libc.clone(impl_exec_child, (char*)stack + SPAWN_STACK_SIZE,
+                       CLONE_VM|CLONE_VFORK|SIGCHLD, &prep);
+    sigprocmask(SIG_SETMASK, &old, NULL);
+    munmap(stack, SPAWN_STACK_SIZE);
+
+    if( child > 0 && prep.error != 0 )
+    {
+        /* The child has already gone, and will
+         * be noticed just like a failed fork(). */
+        DEBUG("Unable to exec: %s", strerror(prep.error));
+    }
+    else if( child > 0 )
+    {
+        /* We're only back once the child has done its
+         * execve(), so this covers the same ground as
+         * the "exec" phase in impl_exec(). */
+        impl_stat("exec", start);
+    }
+    impl_exec_release(&prep);
+    return child;
+}
+
+static void impl_rollback(const char* why);
+static void impl_hybrid_disarm(void);
+static void impl_park_wake(void);
+static void impl_park_add(fdinfo_t* info, int fd, fdinfo_t* parked_info);
+static void impl_standby_kick(void);
+
+void
+impl_exit_check(void)
+{
+    if( gen_slot != NULL )
+    {
+        gen_slot->tracked = total_tracked;
+    }
+
+    if( is_exiting == TRUE && total_tracked == 0 )
+    {
+        if( linger_until != 0 && impl_now_us() < linger_until )
+        {
+            /* Replies may still be going out over
+             * our datagram sockets. See impl_restart_thread(). */
+            return;
+        }
+
+        if( in_hooks == TRUE || exec_pending == TRUE )
+        {
+            /* Let the program finish up. See impl_restart(). */
+            return;
+        }
+
+        if( wait_mode == TRUE )
+        {
+            /* Check for any active child processes.
+             * NOTE: Because we are using waitid() here, and
+             * that allows us to specify WNOWAIT, the child
              * will stay in a waitable state for to be reaped
              * whenever the actual program wants to. */
             do {
@@ -354,16 +1216,31 @@ impl_exit_check(void)
                  * presumably already a child process handling 
                  * new incoming connections. */
                 DEBUG("Goodbye!");
+                impl_gen_release();
                 libc.exit(0);
                 break;
 
             case EXEC:
+            case HYBRID:
                 /* Let's do the exec.
                  * We're wrapped up existing connections, we can
                  * re-execute the application to start handling new
-                 * incoming connections. */
+                 * incoming connections. In hybrid mode there's
+                 * nothing left to split off (see impl_hybrid_split()),
+                 * so this is just like exec mode. */
+                impl_hybrid_disarm();
+                if( hooks[HUPTIME_PRE_EXEC - 1][0].fn != NULL )
+                {
+                    /* We could be anywhere, with our lock held. */
+                    DEBUG("Leaving exec to the restart thread.");
+                    exec_pending = TRUE;
+                    break;
+                }
                 DEBUG("See you soon...");
-                impl_exec();
+                if( impl_exec() < 0 )
+                {
+                    impl_rollback("unable to exec");
+                }
                 break;
         }
     }
@@ -392,8 +1269,24 @@ info_close(int fd, fdinfo_t* info)
             rval = libc.close(fd);
             break;
 
+        case REGION:
+            if( !info->region.inherited )
+            {
+                /* Registered by the program, so it's free to
+                 * close it (and it won't be passed on after all).
+                 * Inherited ones are kept until they're mapped
+                 * (see impl_region_map()). */
+                dec_ref(info);
+                fd_delete(fd);
+                rval = libc.close(fd);
+                break;
+            }
+            /* Fall through. */
+
         case SAVED:
         case DUMMY:
+        case CONTROL:
+        case PARKED:
             /* Woah, their program is most likely either messed up,
              * or it's going through and closing all descriptors
              * prior to an exec. We're just going to ignore this. */
@@ -427,6 +1320,14 @@ do_dup3(int fd, int fd2, int flags)
 
     info = fd_lookup(fd);
     info2 = fd_lookup(fd2);
+    if( (info != NULL || info2 != NULL) && impl_borrowed() )
+    {
+        /* See do_clone(). */
+        U();
+        rval = libc.dup3(fd, fd2, flags);
+        DEBUG("do_dup3(%d, %d, ...) => %d (borrowed)", fd, fd2, rval);
+        return rval;
+    }
     if( info2 != NULL )
     {
         rval = info_close(fd2, info2);
@@ -478,7 +1379,7 @@ do_close(int fd)
     DEBUG("do_close(%d, ...) ...", fd);
     L();
     info = fd_lookup(fd);
-    if( info == NULL )
+    if( info == NULL || impl_borrowed() )
     {
         U();
         rval = libc.close(fd);
@@ -495,6 +1396,244 @@ do_close(int fd)
     return rval;
 }
 
+static int
+is_listening(int fd)
+{
+    int listening = 0;
+    socklen_t len = sizeof(listening);
+    if( getsockopt(fd, SOL_SOCKET, SO_ACCEPTCONN, &listening, &len) < 0 )
+    {
+        return 0;
+    }
+    return listening;
+}
+
+static int
+fcntl_common(fcntl_t fn, int fd, int cmd, void *arg)
+{
+    int rval = -1;
+    fdinfo_t *info = NULL;
+
+    /* We only care about commands that create new
+     * descriptors, or could clear the O_NONBLOCK flag
+     * that do_bind() relies on. Everything else goes
+     * straight through. */
+    if( !unlikely(cmd == F_DUPFD ||
+                  cmd == F_DUPFD_CLOEXEC ||
+                  cmd == F_SETFL) )
+    {
+        return fn(fd, cmd, arg);
+    }
+    if( cmd == F_SETFL &&
+        (((long)arg & O_NONBLOCK) || total_bound == 0 || !is_listening(fd)) )
+    {
+        /* Only a listening socket could be BOUND and need the
+         * flag kept (see do_listen() for the others). This is
+         * common enough that it's worth not taking the lock. */
+        return fn(fd, cmd, arg);
+    }
+
+    DEBUG("do_fcntl(%d, %d, ...) ...", fd, cmd);
+    L();
+    info = fd_lookup(fd);
+    if( info == NULL || impl_borrowed() )
+    {
+        U();
+        rval = fn(fd, cmd, arg);
+        DEBUG("do_fcntl(%d, %d, ...) => %d (no info)", fd, cmd, rval);
+        return rval;
+    }
+
+    if( cmd == F_SETFL )
+    {
+        long flags = (long)arg;
+        if( info->type == BOUND &&
+            !info->bound.is_dgram &&
+            !(flags & O_NONBLOCK) )
+        {
+            /* See do_bind(). The accept() emulation
+             * requires that this remain non-blocking. */
+            DEBUG("Keeping O_NONBLOCK on bound %d.", fd);
+            arg = (void*)(flags | O_NONBLOCK);
+        }
+        rval = fn(fd, cmd, arg);
+    }
+    else
+    {
+        /* As per do_dup(). */
+        rval = fn(fd, cmd, arg);
+        if( rval >= 0 )
+        {
+            inc_ref(info);
+            fd_save(rval, info);
+        }
+    }
+
+    U();
+    DEBUG("do_fcntl(%d, %d, ...) => %d (with info)", fd, cmd, rval);
+    return rval;
+}
+
+static int
+do_fcntl(int fd, int cmd, ...)
+{
+    va_list ap;
+    va_start(ap, cmd);
+    void *arg = va_arg(ap, void*);
+    va_end(ap);
+    return fcntl_common(libc.fcntl, fd, cmd, arg);
+}
+
+static int
+do_fcntl64(int fd, int cmd, ...)
+{
+    va_list ap;
+    va_start(ap, cmd);
+    void *arg = va_arg(ap, void*);
+    va_end(ap);
+    return fcntl_common(libc.fcntl64, fd, cmd, arg);
+}
+
+static int
+info_protected(fdinfo_t* info)
+{
+    /* See info_close() above. These are the descriptors
+     * that we will not close on behalf of the program. */
+    switch( info->type )
+    {
+        case BOUND:
+            return revive_mode == TRUE;
+        case REGION:
+            return info->region.inherited;
+        case SAVED:
+        case DUMMY:
+        case CONTROL:
+        case PARKED:
+            return 1;
+        default:
+            return 0;
+    }
+}
+
+static int
+libc_close_range(unsigned int first, unsigned int last, int flags)
+{
+    /* The wrapper is only in glibc 2.34+ (see stubs.cc). */
+    if( libc.close_range != NULL )
+    {
+        return libc.close_range(first, last, flags);
+    }
+#ifdef SYS_close_range
+    return libc.syscall(SYS_close_range, first, last, flags);
+#else
+    errno = ENOSYS;
+    return -1;
+#endif
+}
+
+static int
+close_span(unsigned int first, unsigned int last, int flags)
+{
+    int rval = libc_close_range(first, last, flags);
+    if( rval < 0 && errno == ENOSYS )
+    {
+        /* Older kernel, so just walk the span. If it isn't
+         * bounded above (closefrom()), we go as far as any
+         * descriptor could be. */
+        if( last == ~0U )
+        {
+            long max = sysconf(_SC_OPEN_MAX);
+            last = (unsigned int)(max > fd_limit() ? max : fd_limit()) - 1;
+        }
+        for( unsigned int fd = first; fd <= last; fd += 1 )
+        {
+            libc.close(fd);
+        }
+        rval = 0;
+    }
+    return rval;
+}
+
+static int
+do_close_range(unsigned int first, unsigned int last, int flags)
+{
+    int rval = 0;
+    unsigned int start = first;
+
+    if( first > last )
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    DEBUG("do_close_range(%u, %u, %d) ...", first, last, flags);
+
+    if( (flags & CLOSE_RANGE_CLOEXEC) || impl_borrowed() )
+    {
+        /* Nothing is closed here. Anything we care about
+         * will have the flag cleared again in impl_exec().
+         * Or, we're in a child that is about to exec() and
+         * is tidying up its own descriptors (see do_clone()). */
+        rval = libc_close_range(first, last, flags);
+        DEBUG("do_close_range(%u, %u, %d) => %d", first, last, flags, rval);
+        return rval;
+    }
+
+    /* Walk only the part of the table that covers the range,
+     * dropping entries as we go. Protected descriptors split
+     * the range into spans which are each closed in one go.
+     * Our restart pipe isn't in the table, but closing it
+     * would look like a restart, so it is protected too. */
+    L();
+    unsigned int limit = (unsigned int)fd_limit();
+    for( int i = 0; i < 2; i += 1 )
+    {
+        if( restart_pipe[i] >= 0 && (unsigned int)restart_pipe[i] >= limit )
+        {
+            limit = (unsigned int)restart_pipe[i] + 1;
+        }
+    }
+    for( unsigned int fd = first; fd <= last && fd < limit; fd += 1 )
+    {
+        fdinfo_t *info = fd_lookup(fd);
+        if( (int)fd == restart_pipe[0] || (int)fd == restart_pipe[1] ||
+            (info != NULL && info_protected(info)) )
+        {
+            if( fd > start && close_span(start, fd - 1, flags) < 0 )
+            {
+                rval = -1;
+            }
+            start = fd + 1;
+            continue;
+        }
+        if( info != NULL )
+        {
+            dec_ref(info);
+            fd_delete(fd);
+        }
+    }
+    if( start <= last && close_span(start, last, flags) < 0 )
+    {
+        rval = -1;
+    }
+    impl_exit_check();
+    U();
+
+    DEBUG("do_close_range(%u, %u, %d) => %d (%d tracked)",
+        first, last, flags, rval, total_tracked);
+    return rval;
+}
+
+static void
+do_closefrom(int lowfd)
+{
+    if( lowfd < 0 )
+    {
+        lowfd = 0;
+    }
+    do_close_range((unsigned int)lowfd, ~0U, 0);
+}
+
 static void
 impl_init_lock(void)
 {
@@ -537,8 +1676,8 @@ impl_init_thread(void)
     }
 
     /* Ensure that we have cloexec. */
-    if( fcntl(restart_pipe[0], F_SETFD, FD_CLOEXEC) < 0 ||
-        fcntl(restart_pipe[1], F_SETFD, FD_CLOEXEC) < 0 )
+    if( libc.fcntl(restart_pipe[0], F_SETFD, FD_CLOEXEC) < 0 ||
+        libc.fcntl(restart_pipe[1], F_SETFD, FD_CLOEXEC) < 0 )
     {
         DEBUG("Can't set restart pipe to cloexec?");
         libc.exit(1);
@@ -553,20 +1692,265 @@ impl_init_thread(void)
         DEBUG("Error creating restart thread: %s", strerror(errno));
         libc.exit(1);
     }
+    pthread_setname_np(thread, THREAD_NAME);
 }
 
 static void
-impl_install_sighandlers(void)
+impl_init_handoff(void)
 {
-    struct sigaction action;
-    struct sigaction old_action;
-    action.sa_handler = sighandler;
-    action.sa_flags = SA_RESTART;
-    sigaction(SIGHUP, &action, &old_action);
-
-    if( old_action.sa_handler != sighandler )
+    /* This is created once per copy of the program, before
+     * any workers are forked, so that every process in this
+     * copy can hand connections off to the next one. */
+    if( socketpair(AF_UNIX, SOCK_SEQPACKET|SOCK_CLOEXEC, 0, handoff_pipe) < 0 )
     {
-        DEBUG("Signal handler installed.");
+        DEBUG("Unable to create handoff channel: %s", strerror(errno));
+        handoff_pipe[0] = -1;
+        handoff_pipe[1] = -1;
+        return;
+    }
+
+    /* Don't hang forever on a copy that never adopts. */
+    struct timeval timeout = { HANDOFF_TIMEOUT, 0 };
+    libc.setsockopt(handoff_pipe[0], SOL_SOCKET, SO_SNDTIMEO,
+                    &timeout, sizeof(timeout));
+
+    fd_save(handoff_pipe[0], alloc_info(CONTROL));
+    fd_save(handoff_pipe[1], alloc_info(CONTROL));
+}
+
+static int
+unix_path_get(fdinfo_t *info, char *path, size_t size)
+{
+    const size_t offset = offsetof(struct sockaddr_un, sun_path);
+
+    /* Only names on the filesystem (not abstract ones). */
+    if( info->type != BOUND ||
+        info->bound.addr->sa_family != AF_UNIX ||
+        info->bound.addrlen <= offset )
+    {
+        return -1;
+    }
+
+    size_t len = info->bound.addrlen - offset;
+    if( len >= size )
+    {
+        len = size - 1;
+    }
+    memcpy(path, ((struct sockaddr_un*)info->bound.addr)->sun_path, len);
+    path[len] = '\0';
+    return path[0] != '\0' ? 0 : -1;
+}
+
+static void
+unix_path_add(fdinfo_t *info)
+{
+    char path[sizeof(struct sockaddr_un)];
+    struct stat bound_stat;
+
+    if( unix_path_get(info, path, sizeof(path)) < 0 ||
+        stat(path, &bound_stat) < 0 )
+    {
+        return;
+    }
+    for( int i = 0; i < unix_paths_count; i += 1 )
+    {
+        if( unix_paths[i].dev == bound_stat.st_dev &&
+            unix_paths[i].ino == bound_stat.st_ino )
+        {
+            return;
+        }
+    }
+    if( unix_paths_count == UNIX_PATHS_MAX )
+    {
+        unix_paths_overflow = TRUE;
+        return;
+    }
+    unix_paths[unix_paths_count].dev = bound_stat.st_dev;
+    unix_paths[unix_paths_count].ino = bound_stat.st_ino;
+    unix_paths_count += 1;
+}
+
+static void
+impl_init_listen_fds(void)
+{
+    /* If we're a respawn, the passed sockets will have been
+     * moved around during the restart. Put them back where the
+     * program expects them, and make sure they aren't treated as
+     * ghosts waiting for a bind() that won't come. */
+    for( int fd = 0; fd < fd_limit(); fd += 1 )
+    {
+        fdinfo_t *info = fd_lookup(fd);
+        if( info == NULL || info->type != BOUND ||
+            info->bound.listener->listen_fd == 0 )
+        {
+            continue;
+        }
+
+        info->bound.is_ghost = 0;
+        info->bound.stub_listened = info->bound.real_listened;
+        if( fd != info->bound.listener->listen_fd &&
+            fd_lookup(info->bound.listener->listen_fd) == NULL &&
+            libc.dup2(fd, info->bound.listener->listen_fd) >= 0 )
+        {
+            fd_save(info->bound.listener->listen_fd, info);
+            fd_delete(fd);
+            libc.close(fd);
+            DEBUG("Moved passed fd %d back.", info->bound.listener->listen_fd);
+        }
+    }
+
+    /* Sockets passed in via LISTEN_FDS start at fd 3. The
+     * program never binds these, so we make them BOUND here. */
+    for( int fd = 3; fd < 3 + listen_fds; fd += 1 )
+    {
+        fdinfo_t *info = fd_lookup(fd);
+        if( info != NULL )
+        {
+            continue;
+        }
+
+        struct sockaddr_storage addr;
+        socklen_t addrlen = sizeof(addr);
+        if( getsockname(fd, (struct sockaddr*)&addr, &addrlen) < 0 )
+        {
+            DEBUG("Passed fd %d is not a socket?", fd);
+            continue;
+        }
+
+        int type = 0;
+        socklen_t typelen = sizeof(type);
+        if( getsockopt(fd, SOL_SOCKET, SO_TYPE, &type, &typelen) < 0 )
+        {
+            type = 0;
+        }
+        int listening = 0;
+        socklen_t listeninglen = sizeof(listening);
+        if( getsockopt(fd, SOL_SOCKET, SO_ACCEPTCONN,
+                       &listening, &listeninglen) < 0 )
+        {
+            listening = 0;
+        }
+        int is_dgram = (type == SOCK_DGRAM &&
+                        (addr.ss_family == AF_INET ||
+                         addr.ss_family == AF_INET6));
+
+        info = alloc_info(BOUND);
+        if( info == NULL )
+        {
+            continue;
+        }
+
+        /* As per do_bind(). */
+        if( !is_dgram )
+        {
+            libc.fcntl(fd, F_SETFL, libc.fcntl(fd, F_GETFL) | O_NONBLOCK);
+        }
+
+        info->bound.stub_listened = listening ? 1 : 0;
+        info->bound.real_listened = listening ? 1 : 0;
+        info->bound.is_ghost = 0;
+#ifdef SO_REUSEPORT
+        info->bound.is_dgram = is_dgram;
+#endif
+        info->bound.listener->listen_fd = fd;
+        info->bound.addr = (struct sockaddr*)malloc(addrlen);
+        info->bound.addrlen = addrlen;
+        memcpy((void*)info->bound.addr, (void*)&addr, addrlen);
+        fd_save(fd, info);
+        unix_path_add(info);
+        DEBUG("Adopted passed fd %d.", fd);
+    }
+}
+
+static void
+impl_notify(const char *state)
+{
+    /* Tell our supervisor about a change in state. This
+     * follows the sd_notify() protocol: a single datagram
+     * of newline separated assignments. */
+    if( notify_socket == NULL ||
+        (notify_socket[0] != '/' && notify_socket[0] != '@') )
+    {
+        return;
+    }
+
+    struct sockaddr_un addr;
+    size_t path_len = strlen(notify_socket);
+    if( path_len >= sizeof(addr.sun_path) )
+    {
+        return;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    memcpy(addr.sun_path, notify_socket, path_len);
+    if( addr.sun_path[0] == '@' )
+    {
+        /* Abstract namespace. */
+        addr.sun_path[0] = '\0';
+    }
+
+    int sock = socket(AF_UNIX, SOCK_DGRAM|SOCK_CLOEXEC, 0);
+    if( sock < 0 )
+    {
+        return;
+    }
+    if( sendto(sock, state, strlen(state), MSG_NOSIGNAL,
+               (struct sockaddr*)&addr,
+               offsetof(struct sockaddr_un, sun_path) + path_len) < 0 )
+    {
+        DEBUG("Unable to notify: %s", strerror(errno));
+    }
+    else
+    {
+        DEBUG("Notified '%s'.", state);
+    }
+    libc.close(sock);
+}
+
+static void
+impl_tell_ready(void)
+{
+    if( is_ready == FALSE && adopt_fd >= 0 )
+    {
+        /* Tell the previous copy (see impl_wait_ready()).
+         * If it isn't waiting for us, nobody cares. */
+        char ready = 'R';
+        send(adopt_fd, &ready, 1, MSG_NOSIGNAL|MSG_DONTWAIT);
+    }
+    is_ready = TRUE;
+}
+
+static void
+impl_notify_ready(void)
+{
+    if( notified_ready == TRUE )
+    {
+        return;
+    }
+    notified_ready = TRUE;
+
+    /* Workers may well get here before the master,
+     * so we always point the supervisor at the master. */
+    char state[64];
+    snprintf(state, sizeof(state), "READY=1\nMAINPID=%d", (int)master_pid);
+    impl_notify(state);
+
+    /* Now that we're up, get the next copy going. */
+    impl_standby_kick();
+}
+
+static void
+impl_install_sighandlers(void)
+{
+    struct sigaction action;
+    struct sigaction old_action;
+    action.sa_handler = sighandler;
+    action.sa_flags = SA_RESTART;
+    sigaction(SIGHUP, &action, &old_action);
+
+    if( old_action.sa_handler != sighandler )
+    {
+        DEBUG("Signal handler installed.");
     }
 }
 
@@ -575,10 +1959,30 @@ impl_init(void)
 {
     const char* mode_env = getenv("HUPTIME_MODE");
     const char* multi_env = getenv("HUPTIME_MULTI");
+    const char* autoscale_env = getenv("HUPTIME_AUTOSCALE");
+    const char* cpu_env = getenv("HUPTIME_CPU");
     const char* revive_env = getenv("HUPTIME_REVIVE");
     const char* debug_env = getenv("HUPTIME_DEBUG");
     const char* pipe_env = getenv("HUPTIME_PIPE");
     const char* wait_env = getenv("HUPTIME_WAIT");
+    const char* linger_env = getenv("HUPTIME_LINGER");
+    const char* handoff_env = getenv("HUPTIME_HANDOFF");
+    const char* ready_env = getenv("HUPTIME_READY");
+    const char* drain_env = getenv("HUPTIME_DRAIN");
+    const char* gen_env = getenv("HUPTIME_GENERATIONS");
+    const char* coalesce_env = getenv("HUPTIME_COALESCE");
+    const char* max_draining_env = getenv("HUPTIME_MAX_DRAINING");
+    const char* overflow_env = getenv("HUPTIME_OVERFLOW");
+    const char* rollback_env = getenv("HUPTIME_ROLLBACK");
+    const char* park_env = getenv("HUPTIME_PARK");
+    const char* standby_env = getenv("HUPTIME_STANDBY");
+    const char* standby_fd_env = getenv("HUPTIME_STANDBY_FD");
+    const char* generation_env = getenv("HUPTIME_GENERATION");
+    const char* listen_pid_env = getenv("LISTEN_PID");
+    const char* listen_fds_env = getenv("LISTEN_FDS");
+    const char* stats_env = getenv("HUPTIME_STATS");
+    long long start = impl_now_us();
+    long long phase_start = start;
 
     if( debug_env != NULL && strlen(debug_env) > 0 )
     {
@@ -587,6 +1991,13 @@ impl_init(void)
 
     DEBUG("Initializing...");
 
+    /* Check if we're recording restart timings. */
+    if( stats_env != NULL && strlen(stats_env) > 0 )
+    {
+        free(stats_path);
+        stats_path = strdup(stats_env);
+    }
+
     /* Initialize our lock. */
     impl_init_lock();
 
@@ -597,6 +2008,7 @@ impl_init(void)
      * the master. Otherwise, we will simply shutdown
      * gracefully, and all the master to restart. */
     master_pid = getpid();
+    owner_pid = master_pid;
 
     /* Grab our exit strategy. */
     if( mode_env != NULL && strlen(mode_env) > 0 )
@@ -611,6 +2023,11 @@ impl_init(void)
             exit_strategy = EXEC;
             DEBUG("Exit strategy is exec.");
         }
+        else if( !strcasecmp(mode_env, "hybrid") )
+        {
+            exit_strategy = HYBRID;
+            DEBUG("Exit strategy is hybrid.");
+        }
         else
         {
             fprintf(stderr, "Unknown exit strategy.");
@@ -641,6 +2058,14 @@ impl_init(void)
     {
         multi_mode = !strcasecmp(multi_env, "true") ? TRUE: FALSE;
     }
+    if( autoscale_env != NULL && strlen(autoscale_env) > 0 )
+    {
+        autoscale_mode = !strcasecmp(autoscale_env, "true") ? TRUE : FALSE;
+    }
+    if( cpu_env != NULL && strlen(cpu_env) > 0 )
+    {
+        incoming_cpu = strtol(cpu_env, NULL, 10);
+    }
 #ifndef SO_REUSEPORT
     if( multi_mode == TRUE )
     {
@@ -661,6 +2086,119 @@ impl_init(void)
         wait_mode = !strcasecmp(wait_env, "true") ? TRUE : FALSE;
     }
 
+    /* Check our linger time. */
+    if( linger_env != NULL && strlen(linger_env) > 0 )
+    {
+        linger_time = strtol(linger_env, NULL, 10);
+        if( linger_time < 0 )
+        {
+            linger_time = 0;
+        }
+    }
+
+    /* Check how long we'll wait for the next copy. */
+    if( ready_env != NULL && strlen(ready_env) > 0 )
+    {
+        ready_time = strtol(ready_env, NULL, 10);
+        if( ready_time < 0 )
+        {
+            ready_time = 0;
+        }
+    }
+
+    /* Check our restart limits. */
+    if( coalesce_env != NULL && strlen(coalesce_env) > 0 )
+    {
+        coalesce_time = strtol(coalesce_env, NULL, 10);
+    }
+    if( max_draining_env != NULL && strlen(max_draining_env) > 0 )
+    {
+        max_draining = strtol(max_draining_env, NULL, 10);
+    }
+    if( overflow_env != NULL && !strcasecmp(overflow_env, "force") )
+    {
+        overflow_force = TRUE;
+    }
+    if( rollback_env != NULL && strlen(rollback_env) > 0 )
+    {
+        rollback_time = strtol(rollback_env, NULL, 10);
+    }
+    if( standby_env != NULL && strlen(standby_env) > 0 &&
+        strcasecmp(standby_env, "false") )
+    {
+        if( exit_strategy == FORK )
+        {
+            standby_watch = strdup(standby_env);
+        }
+        else
+        {
+            DEBUG("Standby needs fork mode, ignoring.");
+        }
+    }
+    if( park_env != NULL && strlen(park_env) > 0 )
+    {
+        /* Parked connections are encoded like everything
+         * else (see impl_exec()), so there's a limit. */
+        park_max = strtol(park_env, NULL, 10);
+        if( park_max > PARK_MAX )
+        {
+            park_max = PARK_MAX;
+        }
+    }
+
+    /* Check for drain deadlines, i.e. "8080:5,9000:600,30". */
+    if( drain_env != NULL && strlen(drain_env) > 0 )
+    {
+        const char* spec = drain_env;
+        drains_count = 0;
+        while( *spec != '\0' && drains_count < DRAIN_MAX )
+        {
+            char* end = NULL;
+            long value = strtol(spec, &end, 10);
+            drains[drains_count].port = 0;
+            if( *end == ':' )
+            {
+                drains[drains_count].port = value;
+                value = strtol(end + 1, &end, 10);
+            }
+            drains[drains_count].deadline = value;
+            drains_count += 1;
+            if( *end != ',' )
+            {
+                break;
+            }
+            spec = end + 1;
+        }
+    }
+
+    /* Check which copy we are. */
+    if( generation_env != NULL && strlen(generation_env) > 0 )
+    {
+        generation = strtol(generation_env, NULL, 10);
+        DEBUG("Generation is %d.", generation);
+    }
+    unsetenv("HUPTIME_GENERATION");
+
+    /* Check for sockets passed in by a supervisor.
+     * These are only for us if LISTEN_PID matches. */
+    if( listen_pid_env != NULL && listen_fds_env != NULL &&
+        strtol(listen_pid_env, NULL, 10) == (long)getpid() )
+    {
+        listen_fds = strtol(listen_fds_env, NULL, 10);
+        if( listen_fds < 0 )
+        {
+            listen_fds = 0;
+        }
+        DEBUG("Passed %d sockets.", listen_fds);
+    }
+
+    /* Check if our supervisor wants to hear from us. */
+    const char* notify_env = getenv("NOTIFY_SOCKET");
+    if( notify_env != NULL && strlen(notify_env) > 0 )
+    {
+        notify_socket = strdup(notify_env);
+    }
+
     /* Check if we're a respawn. */
     if( pipe_env != NULL && strlen(pipe_env) > 0 )
     {
@@ -674,6 +2212,7 @@ impl_init(void)
         while( !info_decode(pipefd, &fd, &info) )
         {
             fd_save(fd, info);
+            unix_path_add(info);
             DEBUG("Decoded fd %d (type %d).", fd, info->type);
             info = NULL;
         }
@@ -687,16 +2226,61 @@ impl_init(void)
         unsetenv("HUPTIME_PIPE");
         DEBUG("Finished decoding.");
 
+        /* Find the listener for each parked connection. */
+        for( fd = 0; fd < fd_limit(); fd += 1 )
+        {
+            info = fd_lookup(fd);
+            if( info == NULL || info->type != PARKED )
+            {
+                continue;
+            }
+            fdinfo_t *bound = fd_lookup(info->parked.bound_fd);
+            if( bound == NULL || bound->type != BOUND )
+            {
+                fd_delete(fd);
+                dec_ref(info);
+                libc.close(fd);
+                continue;
+            }
+            impl_park_add(bound, fd, info);
+        }
+        impl_stat("init_decode", phase_start);
+        phase_start = impl_now_us();
+
+        /* Grab the channel from the previous copy. */
+        if( handoff_env != NULL && strlen(handoff_env) > 0 )
+        {
+            adopt_fd = strtol(handoff_env, NULL, 10);
+        }
+        unsetenv("HUPTIME_HANDOFF");
+
         /* Close all non-encoded descriptors. */
+        int gen_passed = -1;
+        if( gen_env != NULL && strlen(gen_env) > 0 )
+        {
+            gen_passed = strtol(gen_env, NULL, 10);
+        }
+        if( standby_fd_env != NULL && strlen(standby_fd_env) > 0 )
+        {
+            /* We're the standby (see impl_standby_hold()). */
+            standby_fd = strtol(standby_fd_env, NULL, 10);
+            libc.fcntl(standby_fd, F_SETFD, FD_CLOEXEC);
+            fd_save(standby_fd, alloc_info(CONTROL));
+            is_standby = TRUE;
+            DEBUG("Standing by.");
+        }
+        unsetenv("HUPTIME_STANDBY_FD");
         for( fd = 0; fd < fd_max(); fd += 1 )
         {
             info = fd_lookup(fd);
-            if( info == NULL )
+            if( info == NULL && fd != adopt_fd && fd != gen_passed )
             {
                 DEBUG("Closing fd %d.", fd);
                 libc.close(fd);
             }
         }
+        impl_stat("init_close", phase_start);
+        phase_start = impl_now_us();
 
         /* Restore all given file descriptors. */
         for( fd = 0; fd < fd_limit(); fd += 1 )
@@ -707,9 +2291,15 @@ impl_init(void)
                 fdinfo_t *orig_info = fd_lookup(info->saved.fd);
                 if( orig_info != NULL )
                 {
-                    /* Uh-oh, conflict. Move the original (best effort). */
-                    do_dup(info->saved.fd);
-                    do_close(info->saved.fd);
+                    /* Uh-oh, conflict. Move the original (best effort).
+                     * We do this by hand, since we won't close some
+                     * types (i.e. REGION) on behalf of the program. */
+                    int newfd = libc.dup(info->saved.fd);
+                    if( newfd >= 0 )
+                    {
+                        fd_save(newfd, orig_info);
+                        fd_delete(info->saved.fd);
+                    }
                 }
 
                 /* Return the offset (ignore failure). */
@@ -723,11 +2313,59 @@ impl_init(void)
                 DEBUG("Restored fd %d.", info->saved.fd);
             }
         }
+
+        /* Anything we said (see DEBUG()) while stderr was closed
+         * has left it in an error state. Don't pass that on. */
+        clearerr(stderr);
+
+        /* Let the program know about any regions. These
+         * are also listed in the environment (as name=fd,
+         * separated by colons) for those not using the API. */
+        char *regions_env = NULL;
+        size_t regions_len = 0;
+        for( fd = 0; fd < fd_limit(); fd += 1 )
+        {
+            info = fd_lookup(fd);
+            if( info != NULL && info->type == REGION )
+            {
+                libc.fcntl(fd, F_SETFD, FD_CLOEXEC);
+
+                char entry[REGION_NAME_MAX + 16];
+                int len = snprintf(entry, sizeof(entry), "%s%s=%d",
+                                   regions_len > 0 ? ":" : "",
+                                   info->region.name, fd);
+                regions_env = realloc(regions_env, regions_len + len + 1);
+                memcpy(regions_env + regions_len, entry, len + 1);
+                regions_len += len;
+                DEBUG("Region '%s' is fd %d.", info->region.name, fd);
+            }
+        }
+        if( regions_env != NULL )
+        {
+            setenv("HUPTIME_REGIONS", regions_env, 1);
+            free(regions_env);
+        }
+
+        /* Pick up passed sockets again. */
+        impl_init_listen_fds();
+        impl_stat("init_restore", phase_start);
+
+        /* Track the handoff channel (see impl_exec()). */
+        if( adopt_fd >= 0 )
+        {
+            libc.fcntl(adopt_fd, F_SETFD, FD_CLOEXEC);
+            fd_save(adopt_fd, alloc_info(CONTROL));
+            DEBUG("Handoff channel is fd %d.", adopt_fd);
+        }
     }
     else
     {
         DEBUG("Saving all initial file descriptors.");
 
+        /* Pick up passed sockets first, so they
+         * aren't mistaken for regular files. */
+        impl_init_listen_fds();
+
         /* Save all of our initial files. These are used
          * for re-execing the process. These are persisted
          * effectively forever, and on restarts we close
@@ -758,8 +2396,16 @@ impl_init(void)
                 }
             }
         }
+        impl_stat("init_save", phase_start);
     }
 
+    /* Create our own handoff channel. */
+    impl_init_handoff();
+
+    /* Take our place amongst the other copies. */
+    impl_init_generations(gen_env);
+    unsetenv("HUPTIME_GENERATIONS");
+
     /* Save the environment.
      *
      * NOTE: We reserve extra space in the environment
@@ -792,6 +2438,9 @@ impl_init(void)
     /* Install our signal handlers. */
     impl_install_sighandlers();
 
+    /* Make sure we hear about anything parked. */
+    impl_park_wake();
+
     /* Initialize our thread. */
     impl_init_thread();
 
@@ -806,673 +2455,3537 @@ impl_init(void)
     sigprocmask(SIG_UNBLOCK, &set, NULL);
 
     /* Done. */
+    impl_stat("init", start);
     DEBUG("Initialization complete.");
 }
 
 static int
-impl_dummy_server(void)
+impl_dgram_steers(void)
 {
-    int dummy_server = -1;
+    /* Whether we can bind a second socket to the same address
+     * and keep it from receiving anything (see impl_dgram_sender()).
+     * In multi mode, the reuseport group also holds the sockets of
+     * the other processes, and the kernel would balance datagrams
+     * to ours (which nobody reads). */
+    return multi_mode == FALSE;
+}
 
-    /* Create our dummy sock. */
-    struct sockaddr_un dummy_addr;
-    char *socket_path = tempnam("/tmp", ".huptime");
+static int
+impl_dgram_lingers(void)
+{
+    /* Only in fork mode does the old copy keep going. */
+    return exit_strategy == FORK && impl_dgram_steers() && linger_time > 0;
+}
 
-    memset(&dummy_addr, 0, sizeof(struct sockaddr_un));
-    dummy_addr.sun_family = AF_UNIX;
-    strncpy(dummy_addr.sun_path, socket_path, sizeof(dummy_addr.sun_path)-1);
+static int
+impl_dgram_sender(fdinfo_t* info)
+{
+#ifdef SO_REUSEPORT
+    int sender = -1;
+    int optval = 1;
 
-    /* Create a dummy server. */
-    dummy_server = socket(AF_UNIX, SOCK_STREAM, 0);
-    if( dummy_server < 0 )
+    sender = socket(info->bound.addr->sa_family, SOCK_DGRAM, 0);
+    if( sender < 0 )
     {
-        fprintf(stderr, "Unable to create unix socket?");
+        fprintf(stderr, "Unable to create datagram socket?");
         return -1;
     }
-    if( fcntl(dummy_server, F_SETFD, FD_CLOEXEC) < 0 )
+    if( libc.fcntl(sender, F_SETFD, FD_CLOEXEC) < 0 )
     {
-        close(dummy_server);
+        libc.close(sender);
         fprintf(stderr, "Unable to set cloexec?");
         return -1;
     }
-    if( libc.bind(
-            dummy_server,
-            (struct sockaddr*)&dummy_addr,
-            sizeof(struct sockaddr_un)) < 0 )
-    {
-        close(dummy_server);
-        fprintf(stderr, "Unable to bind unix socket?");
-        return -1;
-    }
-    if( libc.listen(dummy_server, 1) < 0 )
+    if( !impl_dgram_steers() )
     {
-        close(dummy_server);
-        fprintf(stderr, "Unable to listen on unix socket?");
-        return -1;
+        /* This only has to stand in (and never receive).
+         * Any late replies come from some other port. */
+        return sender;
     }
 
-    /* Connect a dummy client. */
-    int dummy_client = socket(AF_UNIX, SOCK_STREAM, 0);
-    if( dummy_client < 0 )
-    {
-        close(dummy_server);
-        fprintf(stderr, "Unable to create unix socket?");
-        return -1;
-    }
-    if( fcntl(dummy_client, F_SETFD, FD_CLOEXEC) < 0 )
-    {
-        close(dummy_server);
-        close(dummy_client);
-        fprintf(stderr, "Unable to set cloexec?");
-        return -1;
-    }
-    if( connect(
-            dummy_client,
-            (struct sockaddr*)&dummy_addr,
-            sizeof(struct sockaddr_un)) < 0 )
+    /* This socket is bound to the same address as
+     * the original (which is passed on to the next
+     * copy of the application), so replies still come
+     * from the right place. The original was bound with
+     * SO_REUSEPORT (see do_bind()), so this is allowed. */
+    if( libc.setsockopt(sender, SOL_SOCKET, SO_REUSEPORT,
+                        &optval, sizeof(optval)) < 0 ||
+        libc.bind(sender, info->bound.addr, info->bound.addrlen) < 0 )
     {
-        close(dummy_server);
-        close(dummy_client);
-        fprintf(stderr, "Unable to connect dummy client?");
+        libc.close(sender);
+        fprintf(stderr, "Unable to bind datagram socket?");
         return -1;
     }
 
-    /* Put the client into an error state. */
-    int dummy_fd = libc.accept(dummy_server, NULL, 0);
-    if( dummy_fd < 0 )
+#ifdef SO_ATTACH_REUSEPORT_CBPF
     {
-        fprintf(stderr, "Unable to accept internal client?");
-        close(dummy_server);
-        close(dummy_client);
-        return -1;
+        /* Steer everything to the original socket,
+         * which was bound first and so is index zero in
+         * the group. The receive queue is never touched,
+         * so no datagrams are lost across the restart.
+         * Anything that arrives here before the program
+         * is attached is still read by this process. */
+        struct sock_filter code[] = {
+            { BPF_RET | BPF_K, 0, 0, 0 },
+        };
+        struct sock_fprog prog = {
+            .len = sizeof(code) / sizeof(code[0]),
+            .filter = code,
+        };
+        if( libc.setsockopt(sender, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF,
+                            &prog, sizeof(prog)) < 0 )
+        {
+            DEBUG("Unable to steer datagrams: %s", strerror(errno));
+        }
     }
-    close(dummy_fd);
+#endif
 
-    /* Save the dummy info. */
+    return sender;
+#else
+    return -1;
+#endif
+}
+
+static int
+impl_dummy_server(void)
+{
+    /* All neutered listeners share a single dummy server.
+     * We bind with only the family, which has the kernel
+     * pick a unique name in the abstract namespace. This
+     * way there is nothing on the filesystem that could get
+     * in our way, and nobody will ever connect to it. */
+    if( dummy_server >= 0 )
+    {
+        return dummy_server;
+    }
+
+    struct sockaddr_un dummy_addr;
+    socklen_t dummy_addrlen = sizeof(sa_family_t);
+
+    memset(&dummy_addr, 0, sizeof(struct sockaddr_un));
+    dummy_addr.sun_family = AF_UNIX;
+
+    int server = socket(AF_UNIX, SOCK_STREAM|SOCK_CLOEXEC, 0);
+    if( server < 0 )
+    {
+        fprintf(stderr, "Unable to create unix socket?");
+        return -1;
+    }
+    if( libc.bind(
+            server,
+            (struct sockaddr*)&dummy_addr,
+            dummy_addrlen) < 0 )
+    {
+        libc.close(server);
+        fprintf(stderr, "Unable to bind unix socket?");
+        return -1;
+    }
+    if( libc.listen(server, 1) < 0 )
+    {
+        libc.close(server);
+        fprintf(stderr, "Unable to listen on unix socket?");
+        return -1;
+    }
+
+    /* Save the dummy info. */
     fdinfo_t* dummy_info = alloc_info(DUMMY);
     if( dummy_info == NULL )
     {
+        libc.close(server);
         fprintf(stderr, "Unable to allocate dummy info?");
         return -1;
     }
-    dummy_info->dummy.client = dummy_client;
-    fd_save(dummy_server, dummy_info);
-    inc_ref(dummy_info);
-    fd_save(dummy_client, dummy_info);
-
-    /* Ensure that it's unlinked. */
-    unlink(socket_path);
-    free(socket_path);
+    fd_save(server, dummy_info);
 
+    dummy_server = server;
     return dummy_server;
 }
 
-void
-impl_exit_start(void)
+static int
+impl_dummy_install(int fd, fdinfo_t* bound)
 {
-    if( is_exiting == TRUE )
+    /* Replace the given descriptor with the dummy server.
+     * Each one gets its own info, so that every listener
+     * still hands out a single client (see do_accept4())
+     * and can still be asked about (see impl_listener()). */
+    int server = impl_dummy_server();
+    if( server < 0 )
     {
-        return;
+        return -1;
+    }
+    fdinfo_t* dummy_info = alloc_info(DUMMY);
+    if( dummy_info == NULL )
+    {
+        fprintf(stderr, "Unable to allocate dummy info?");
+        return -1;
     }
+    if( do_dup2(server, fd) < 0 )
+    {
+        dec_ref(dummy_info);
+        return -1;
+    }
+    dummy_info->dummy.pending = 1;
+    inc_ref(bound);
+    dummy_info->dummy.bound = bound;
+    dec_ref(fd_lookup(fd));
+    fd_save(fd, dummy_info);
+    return 0;
+}
 
-    /* We are now exiting.
-     * After this point, all calls to various sockets,
-     * (i.e. accept(), listen(), etc. will result in stalls.
-     * We are just waiting until existing connections have 
-     * finished and then we will be either exec()'ing a new
-     * version or exiting this process. */
-    is_exiting = TRUE;
+static void
+impl_park_add(fdinfo_t* info, int fd, fdinfo_t* parked_info)
+{
+    /* Add a connection to the end of the listener's list. */
+    listenerinfo_t* listener = info->bound.listener;
+    inc_ref(info);
+    parked_info->parked.bound = info;
+    parked_info->parked.fd = fd;
+    parked_info->parked.next = NULL;
+    if( listener->parked_tail != NULL )
+    {
+        listener->parked_tail->parked.next = parked_info;
+    }
+    else
+    {
+        listener->parked_head = parked_info;
+    }
+    listener->parked_tail = parked_info;
+    listener->parked += 1;
+}
 
-    /* Get ready to restart.
-     * We only proceed with actual restart actions
-     * if we are the master process, otherwise we will
-     * simply prepare to shutdown cleanly once all the
-     * current active connections have finished. */
-    if( master_pid == getpid() )
+static void*
+impl_park_thread(void* arg)
+{
+    /* While we're draining in exec mode, nobody is accepting
+     * new connections. Once the backlog fills, the kernel
+     * starts dropping them, and clients back off for a second
+     * or more. So we accept them here (up to park_max) and
+     * hold them for the program (see impl_unpark()).
+     * This finishes when we exec() (or roll back). */
+    struct pollfd poll_info[64];
+    fdinfo_t* poll_bound[64];
+    int poll_count = 0;
+    bool_t parking = TRUE;
+
+    /* The listeners are all set by now (see impl_exit_start()). */
+    L();
+    for( int fd = 0; fd < fd_limit() && poll_count < 64; fd += 1 )
     {
-        pid_t child;
-        DEBUG("Exit started -- this is the master.");
+        fdinfo_t* info = fd_lookup(fd);
+        if( info != NULL && info->type == BOUND &&
+            info->bound.is_ghost && info->bound.real_listened &&
+            !info->bound.is_dgram )
+        {
+            poll_info[poll_count].fd = fd;
+            poll_info[poll_count].events = POLLIN;
+            poll_bound[poll_count] = info;
+            inc_ref(info);
+            poll_count += 1;
+        }
+    }
 
-        /* Unlink files (e.g. pidfile). */
-        if( to_unlink != NULL && strlen(to_unlink) > 0 )
+    while( is_exiting == TRUE && parking == TRUE )
+    {
+        U();
+
+        if( total_parked >= park_max || poll_count == 0 )
         {
-            DEBUG("Unlinking '%s'...", to_unlink);
-            unlink(to_unlink);
+            struct timespec ts = { 0, 100000000L };
+            nanosleep(&ts, NULL);
+            L();
+            continue;
+        }
+        for( int i = 0; i < poll_count; i += 1 )
+        {
+            poll_info[i].revents = 0;
         }
+        poll(poll_info, poll_count, 100);
 
-        /* Neuter this process. */
-        for( int fd = 0; fd < fd_limit(); fd += 1 )
+        L();
+        for( int i = 0; i < poll_count && parking == TRUE &&
+                        is_exiting == TRUE; i += 1 )
         {
-            fdinfo_t* info = fd_lookup(fd);
-            if( exit_strategy == FORK &&
-                info != NULL && info->type == SAVED )
+            fdinfo_t* info = poll_bound[i];
+            if( poll_info[i].revents == 0 ||
+                fd_lookup(poll_info[i].fd) != info )
             {
-                /* Close initial files. Since these
-                 * are now passed on to the child, we
-                 * ensure that the parent won't mess 
-                 * with them anymore. Note that we still
-                 * have a copy as all SAVED descriptors. */
-                if( info->saved.fd == 2 )
-                {
-                    /* We treat stderr special.
-                     * Assuming logging will go here, we
-                     * allow the parent process to continue
-                     * writing to this file (and hope that
-                     * it's open in APPEND mode, etc.). */
-                    continue;
-                }
-                int nullfd = open("/dev/null", O_RDWR);
-                do_dup2(nullfd, info->saved.fd);
-                libc.close(nullfd);
+                continue;
             }
-            if( info != NULL &&
-                info->type == BOUND && !info->bound.is_ghost )
+            while( total_parked < park_max )
             {
-                /* Change BOUND sockets to dummy sockets.
-                 * This will allow select() and poll() to
-                 * operate as you expect, and never give
-                 * back new clients. */
-                int newfd = do_dup(fd);
-                if( newfd >= 0 )
+                int fd = libc.accept4(poll_info[i].fd, NULL, NULL,
+                                      SOCK_NONBLOCK|SOCK_CLOEXEC);
+                if( fd < 0 )
                 {
-                    int dummy_server = impl_dummy_server();
-                    if( dummy_server >= 0 )
-                    {
-                        /* Remove the descriptor in any epoll FDs. */
-                        for( int efd = 0; efd < fd_limit(); efd += 1 )
-                        {
-                            fdinfo_t* einfo = fd_lookup(efd);
-                            if( einfo != NULL && einfo->type == EPOLL )
-                            {
-                                struct epoll_event no_event;
-                                epoll_ctl(efd, EPOLL_CTL_DEL, fd, &no_event);
-                            }
-                        }
-
-                        info->bound.is_ghost = 1;
-                        do_dup2(dummy_server, fd);
-                        DEBUG("Replaced FD %d with dummy.", fd);
-                    }
-                    else
-                    {
-                        do_close(newfd);
-                    }
+                    break;
+                }
+                fdinfo_t* parked_info = alloc_info(PARKED);
+                if( parked_info == NULL )
+                {
+                    /* Leave the rest in the kernel's queue. This one
+                     * is lost, as it would be if the queue was full. */
+                    fprintf(stderr, "huptime: unable to park "
+                            "connections: %s\n", strerror(errno));
+                    libc.close(fd);
+                    parking = FALSE;
+                    break;
                 }
+                parked_info->parked.bound_fd = poll_info[i].fd;
+                impl_park_add(info, fd, parked_info);
+                fd_save(fd, parked_info);
+                DEBUG("Parked fd %d (from %d).", fd, poll_info[i].fd);
             }
         }
+    }
+    for( int i = 0; i < poll_count; i += 1 )
+    {
+        dec_ref(poll_bound[i]);
+    }
+    U();
 
-        switch( exit_strategy )
+    return arg;
+}
+
+static void
+impl_park_start(void)
+{
+    pthread_t thread;
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    if( pthread_create(&thread, &attr, impl_park_thread, NULL) != 0 )
+    {
+        DEBUG("Unable to start parking.");
+    }
+    else
+    {
+        pthread_setname_np(thread, THREAD_NAME);
+    }
+    pthread_attr_destroy(&attr);
+}
+
+static void
+impl_park_wake(void)
+{
+    /* Parked connections aren't in the kernel's queue, so
+     * the program won't know to accept() them. We connect to
+     * each listener that has any, so that it looks readable
+     * until they're all handed out (see do_accept4()). */
+    for( int fd = 0; fd < fd_limit(); fd += 1 )
+    {
+        fdinfo_t* info = fd_lookup(fd);
+        if( info == NULL || info->type != BOUND ||
+            info->bound.listener->parked == 0 ||
+            info->bound.listener->wake_fd != 0 ||
+            info->bound.addr == NULL )
         {
-            case FORK:
-                /* Start the child process.
-                 * We will exit gracefully when the tracked
-                 * connection count reaches zero. */
-                DEBUG("Exit strategy is fork.");
-                child = libc.fork();
-                if( child == 0 )
-                {
-                    DEBUG("I'm the child.");
-                    impl_exec();
-                }
-                else
-                {
-                    DEBUG("I'm the parent.");
-                }
-                break;
+            continue;
+        }
 
-            case EXEC:
-                /* Nothing necessary beyond the above. */
-                DEBUG("Exit strategy is exec.");
-                break;
+        int wake = socket(info->bound.addr->sa_family,
+                          SOCK_STREAM|SOCK_NONBLOCK|SOCK_CLOEXEC, 0);
+        if( wake < 0 )
+        {
+            continue;
+        }
+        if( info->bound.addr->sa_family == AF_UNIX )
+        {
+            /* Give ourselves a name, so we can be told apart. */
+            sa_family_t family = AF_UNIX;
+            libc.bind(wake, (struct sockaddr*)&family, sizeof(family));
+        }
+        if( connect(wake, info->bound.addr, info->bound.addrlen) < 0 &&
+            errno != EINPROGRESS )
+        {
+            DEBUG("Unable to wake fd %d: %s", fd, strerror(errno));
+            libc.close(wake);
+            continue;
+        }
+        fd_save(wake, alloc_info(CONTROL));
+        info->bound.listener->wake_fd = wake + 1;
+        DEBUG("Waking fd %d for %d parked.", fd, info->bound.listener->parked);
+    }
+}
+
+static int
+impl_park_is_wake(fdinfo_t* info, int fd)
+{
+    /* Is this our own connection (see impl_park_wake())? */
+    listenerinfo_t* listener = info->bound.listener;
+    struct sockaddr_storage ours;
+    struct sockaddr_storage theirs;
+    socklen_t ours_len = sizeof(ours);
+    socklen_t theirs_len = sizeof(theirs);
+
+    if( listener->wake_fd == 0 )
+    {
+        return 0;
+    }
+    if( getsockname(listener->wake_fd - 1,
+                    (struct sockaddr*)&ours, &ours_len) < 0 ||
+        getpeername(fd, (struct sockaddr*)&theirs, &theirs_len) < 0 )
+    {
+        return 0;
+    }
+    if( ours_len != theirs_len || memcmp(&ours, &theirs, ours_len) )
+    {
+        return 0;
+    }
+
+    int wake = listener->wake_fd - 1;
+    fdinfo_t* wake_info = fd_lookup(wake);
+    if( wake_info != NULL )
+    {
+        fd_delete(wake);
+        dec_ref(wake_info);
+    }
+    libc.close(wake);
+    listener->wake_fd = 0;
+    return 1;
+}
+
+static void
+impl_count_accept(fdinfo_t* info, fdinfo_t* new_info)
+{
+    /* Count a new connection against the listener. */
+    listenerinfo_t* listener = info->bound.listener;
+    time_t now = time(NULL);
+    if( now != listener->accept_second )
+    {
+        listener->accept_last =
+            now == listener->accept_second + 1 ?
+            listener->accept_count : 0;
+        listener->accept_second = now;
+        listener->accept_count = 0;
+    }
+    listener->accept_count += 1;
+    listener->accepted += 1;
+    listener->tracked += 1;
+    new_info->tracked.seq = listener->accepted;
+    if( gen_slot != NULL )
+    {
+        gen_slot->tracked = total_tracked;
+    }
+}
+
+static int
+impl_unpark(fdinfo_t* info, struct sockaddr *addr, socklen_t *addrlen, int flags)
+{
+    /* Hand out the oldest connection parked for
+     * this listener as if it had just been accepted. */
+    listenerinfo_t* listener = info->bound.listener;
+    while( listener->parked_head != NULL )
+    {
+        fdinfo_t* parked_info = listener->parked_head;
+        int fd = parked_info->parked.fd;
+        listener->parked_head = parked_info->parked.next;
+        if( listener->parked_head == NULL )
+        {
+            listener->parked_tail = NULL;
+        }
+        parked_info->parked.next = NULL;
+        if( fd_lookup(fd) != parked_info )
+        {
+            /* Not where we left it. */
+            continue;
+        }
+
+        int fl = libc.fcntl(fd, F_GETFL);
+        if( fl >= 0 )
+        {
+            libc.fcntl(fd, F_SETFL, (flags & SOCK_NONBLOCK) ?
+                       (fl | O_NONBLOCK) : (fl & ~O_NONBLOCK));
+        }
+        libc.fcntl(fd, F_SETFD, (flags & SOCK_CLOEXEC) ? FD_CLOEXEC : 0);
+        if( addr != NULL && addrlen != NULL )
+        {
+            getpeername(fd, addr, addrlen);
+        }
+
+        fdinfo_t *new_info = alloc_info(TRACKED);
+        inc_ref(info);
+        new_info->tracked.bound = info;
+        fd_delete(fd);
+        dec_ref(parked_info);
+        fd_save(fd, new_info);
+        impl_count_accept(info, new_info);
+        return fd;
+    }
+
+    return -1;
+}
+
+static time_t
+impl_drain_sweep(time_t now)
+{
+    /* Shut down connections that are past their listener's
+     * deadline. The program sees them finish (as if the client
+     * went away) and closes them itself, as usual. Returns the
+     * next deadline, or zero if there are none left. */
+    time_t next = 0;
+
+    for( int fd = 0; fd < fd_limit(); fd += 1 )
+    {
+        fdinfo_t* info = fd_lookup(fd);
+        if( info != NULL && info->type == TRACKED &&
+            info->tracked.bound != NULL )
+        {
+            fdinfo_t* bound = info->tracked.bound;
+            if( bound->bound.listener->drain_until != 0 &&
+                bound->bound.listener->drain_until <= now &&
+                info->tracked.seq <= bound->bound.listener->drain_seq )
+            {
+                DEBUG("Deadline passed for FD %d.", fd);
+                shutdown(fd, SHUT_RDWR);
+            }
+        }
+    }
+    for( int fd = 0; fd < fd_limit(); fd += 1 )
+    {
+        fdinfo_t* info = fd_lookup(fd);
+        if( info != NULL && info->type == BOUND &&
+            info->bound.listener->drain_until != 0 )
+        {
+            if( info->bound.listener->drain_until <= now )
+            {
+                info->bound.listener->drain_until = 0;
+            }
+            else if( next == 0 || info->bound.listener->drain_until < next )
+            {
+                next = info->bound.listener->drain_until;
+            }
+        }
+    }
+
+    return next;
+}
+
+static void*
+impl_drain_thread(void* arg)
+{
+    /* Deadlines are in seconds, so we check once a second. */
+    while( 1 )
+    {
+        L();
+        if( impl_drain_sweep(time(NULL)) == 0 )
+        {
+            drain_running = FALSE;
+            U();
+            break;
+        }
+        U();
+        sleep(1);
+    }
+    return arg;
+}
+
+static void
+impl_drain_kick(void)
+{
+    /* Sweep now, and keep sweeping if anything is left. */
+    if( impl_drain_sweep(time(NULL)) != 0 && drain_running == FALSE )
+    {
+        pthread_t thread;
+        pthread_attr_t attr;
+        pthread_attr_init(&attr);
+        pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+        if( pthread_create(&thread, &attr, impl_drain_thread, NULL) == 0 )
+        {
+            pthread_setname_np(thread, THREAD_NAME);
+            drain_running = TRUE;
+        }
+        pthread_attr_destroy(&attr);
+    }
+}
+
+static int
+impl_drain_default(fdinfo_t* info)
+{
+    /* Find the HUPTIME_DRAIN deadline for the given socket. */
+    int port = 0;
+    int deadline = -1;
+
+    if( info->bound.addr->sa_family == AF_INET )
+    {
+        port = ntohs(((struct sockaddr_in*)info->bound.addr)->sin_port);
+    }
+    else if( info->bound.addr->sa_family == AF_INET6 )
+    {
+        port = ntohs(((struct sockaddr_in6*)info->bound.addr)->sin6_port);
+    }
+    for( int i = 0; i < drains_count; i += 1 )
+    {
+        if( drains[i].port == port )
+        {
+            return drains[i].deadline;
+        }
+        if( drains[i].port == 0 )
+        {
+            deadline = drains[i].deadline;
+        }
+    }
+    return deadline;
+}
+
+static void
+impl_drain_start(void)
+{
+    /* Start the clock on every listener with a deadline. */
+    time_t now = time(NULL);
+
+    for( int fd = 0; fd < fd_limit(); fd += 1 )
+    {
+        fdinfo_t* info = fd_lookup(fd);
+        if( info == NULL || info->type != BOUND || info->bound.is_dgram )
+        {
+            continue;
+        }
+        DEBUG("Draining FD %d: %d tracked (%lu accepted).",
+              fd, info->bound.listener->tracked,
+              info->bound.listener->accepted);
+        int deadline = info->bound.has_deadline ?
+            info->bound.listener->deadline :
+            impl_drain_default(info);
+        if( deadline >= 0 && info->bound.listener->tracked > 0 )
+        {
+            info->bound.listener->drain_until = now + deadline;
+            info->bound.listener->drain_seq = info->bound.listener->accepted;
+        }
+    }
+
+    impl_drain_kick();
+}
+
+static void
+impl_gen_force(void)
+{
+    /* Another copy needs us gone. Everything still open
+     * gets shut down now (see impl_drain_sweep()). */
+    DEBUG("Forced to finish draining.");
+    L();
+    time_t now = time(NULL);
+    for( int fd = 0; fd < fd_limit(); fd += 1 )
+    {
+        fdinfo_t* info = fd_lookup(fd);
+        if( info != NULL && info->type == BOUND && !info->bound.is_dgram )
+        {
+            info->bound.listener->drain_until = now;
+            info->bound.listener->drain_seq = ULONG_MAX;
+        }
+    }
+    impl_drain_kick();
+    U();
+}
+
+static void
+impl_exit_spawn(void)
+{
+    /* Start the child process.
+     * We will exit gracefully when the tracked
+     * connection count reaches zero. */
+    DEBUG("Exit strategy is fork.");
+    long long start = impl_now_us();
+    pid_t child = -1;
+    if( hooks[HUPTIME_PRE_EXEC - 1][0].fn == NULL )
+    {
+        child = impl_exec_spawn();
+    }
+    else if( (child = libc.fork()) == 0 )
+    {
+        /* Hooks are promised a copy of their own (see
+         * libhuptime.h), so we can't use impl_exec_spawn().
+         * We were holding the lock in the parent, but
+         * we're a different thread as far as it's concerned.
+         * Hooks may well call back into us before exec(). */
+        DEBUG("I'm the child.");
+        impl_init_lock();
+        impl_exec();
+        libc.exit(1);
+    }
+    if( child != 0 )
+    {
+        DEBUG("I'm the parent.");
+        impl_stat("spawn", start);
+        spawned_child = child;
+
+        /* Only the child reads from the handoff channel.
+         * Dropping our end means we'll see if it goes away. */
+        if( handoff_pipe[1] >= 0 )
+        {
+            fdinfo_t *info = fd_lookup(handoff_pipe[1]);
+            if( info != NULL )
+            {
+                fd_delete(handoff_pipe[1]);
+                dec_ref(info);
+            }
+            libc.close(handoff_pipe[1]);
+            handoff_pipe[1] = -1;
+        }
+    }
+}
+
+static void
+impl_reset_handoff(void)
+{
+    /* We need a new channel for the next copy. */
+    for( int i = 0; i < 2; i += 1 )
+    {
+        if( handoff_pipe[i] >= 0 )
+        {
+            fdinfo_t *info = fd_lookup(handoff_pipe[i]);
+            if( info != NULL )
+            {
+                fd_delete(handoff_pipe[i]);
+                dec_ref(info);
+            }
+            libc.close(handoff_pipe[i]);
+            handoff_pipe[i] = -1;
+        }
+    }
+    impl_init_handoff();
+}
+
+static const char*
+impl_standby_path(void)
+{
+    return strcasecmp(standby_watch, "true") ? standby_watch : exe_copy;
+}
+
+static void
+impl_standby_spawn(void)
+{
+    /* Start the next copy now, rather than on restart. It
+     * runs through its startup as usual, and is then held at
+     * its first accept() (see impl_standby_hold()). A restart
+     * just lets it go (see impl_exit_start()). */
+    int pair[2];
+    if( socketpair(AF_UNIX, SOCK_STREAM|SOCK_CLOEXEC, 0, pair) < 0 )
+    {
+        DEBUG("Unable to create standby channel: %s", strerror(errno));
+        return;
+    }
+    if( stat(impl_standby_path(), &standby_stat) < 0 )
+    {
+        memset(&standby_stat, 0, sizeof(standby_stat));
+    }
+
+    standby_pass_fd = pair[1];
+    impl_exit_spawn();
+    standby_pass_fd = -1;
+    libc.close(pair[1]);
+
+    standby_pid = spawned_child;
+    spawned_child = -1;
+    standby_fd = pair[0];
+    fd_save(standby_fd, alloc_info(CONTROL));
+    DEBUG("Standby is %d.", standby_pid);
+}
+
+static void*
+impl_standby_thread(void* arg)
+{
+    L();
+    if( standby_pid < 0 && is_exiting == FALSE )
+    {
+        impl_standby_spawn();
+    }
+    standby_spawning = FALSE;
+    U();
+    return arg;
+}
+
+static void
+impl_standby_kick(void)
+{
+    /* Start a standby in the background (if we need one). */
+    if( standby_watch == NULL || standby_pid >= 0 ||
+        standby_spawning == TRUE || is_standby == TRUE ||
+        master_pid != getpid() )
+    {
+        return;
+    }
+
+    pthread_t thread;
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    if( pthread_create(&thread, &attr, impl_standby_thread, NULL) == 0 )
+    {
+        pthread_setname_np(thread, THREAD_NAME);
+        standby_spawning = TRUE;
+    }
+    pthread_attr_destroy(&attr);
+}
+
+static void
+impl_standby_close(void)
+{
+    fdinfo_t *info = fd_lookup(standby_fd);
+    if( info != NULL )
+    {
+        fd_delete(standby_fd);
+        dec_ref(info);
+    }
+    libc.close(standby_fd);
+    standby_fd = -1;
+}
+
+static int
+impl_standby_usable(void)
+{
+    /* Is the standby still there, and still current? */
+    if( waitpid(standby_pid, NULL, WNOHANG) != 0 )
+    {
+        return 0;
+    }
+
+    struct stat now;
+    if( stat(impl_standby_path(), &now) < 0 )
+    {
+        memset(&now, 0, sizeof(now));
+    }
+    return now.st_dev == standby_stat.st_dev &&
+           now.st_ino == standby_stat.st_ino &&
+           now.st_size == standby_stat.st_size &&
+           now.st_mtime == standby_stat.st_mtime;
+}
+
+static void
+impl_standby_discard(void)
+{
+    /* The standby is out of date (or gone). We start
+     * the next copy from scratch instead. */
+    if( waitpid(standby_pid, NULL, WNOHANG) == 0 )
+    {
+        kill(standby_pid, SIGKILL);
+        while( waitpid(standby_pid, NULL, 0) < 0 && errno == EINTR );
+    }
+    impl_standby_close();
+    standby_pid = -1;
+    impl_reset_handoff();
+}
+
+static void
+impl_standby_release(void)
+{
+    /* Let the standby go. It becomes the new copy,
+     * just as if we had only now started it. */
+    char go = 'G';
+    send(standby_fd, &go, 1, MSG_NOSIGNAL);
+    impl_standby_close();
+    spawned_child = standby_pid;
+    standby_pid = -1;
+}
+
+static void
+impl_standby_hold(void)
+{
+    /* We're the standby. We wait here until the current copy
+     * lets us go, or goes away without doing so (in which case
+     * there's nothing for us to do). Every thread that gets here
+     * waits, so the byte is left for the others to see. */
+    while( is_standby == TRUE )
+    {
+        U();
+        struct pollfd poll_info;
+        poll_info.fd = standby_fd;
+        poll_info.events = POLLIN;
+        poll_info.revents = 0;
+        poll(&poll_info, 1, -1);
+        L();
+        if( is_standby == FALSE )
+        {
+            break;
+        }
+
+        char go = 0;
+        int rc = recv(standby_fd, &go, 1, MSG_PEEK|MSG_DONTWAIT);
+        if( rc < 0 && (errno == EAGAIN || errno == EINTR) )
+        {
+            continue;
+        }
+        if( rc == 1 )
+        {
+            DEBUG("Released from standby.");
+            is_standby = FALSE;
+            if( gen_slot != NULL )
+            {
+                gen_slot->started = time(NULL);
+            }
+            impl_standby_kick();
+        }
+        else
+        {
+            DEBUG("Nobody to take over from.");
+            impl_gen_release();
+            libc.exit(0);
+        }
+    }
+}
+
+static int
+impl_wait_ready(int timeout)
+{
+    /* The child sends a single byte back over the
+     * handoff channel once it's ready (see impl_tell_ready()).
+     * We also watch the child itself, where we can, in case
+     * it dies while still holding on to the channel.
+     * Returns 1 if ready, 0 if we gave up, -1 if it died. */
+    time_t until = time(NULL) + timeout;
+    int pidfd = -1;
+#ifdef SYS_pidfd_open
+    if( spawned_child > 0 )
+    {
+        pidfd = syscall(SYS_pidfd_open, spawned_child, 0);
+    }
+#endif
+    int rval = 0;
+
+    while( handoff_pipe[0] >= 0 )
+    {
+        time_t now = time(NULL);
+        if( now >= until )
+        {
+            DEBUG("Gave up waiting for child.");
+            break;
+        }
+
+        struct pollfd poll_info[2];
+        poll_info[0].fd = handoff_pipe[0];
+        poll_info[0].events = POLLIN;
+        poll_info[0].revents = 0;
+        poll_info[1].fd = pidfd;
+        poll_info[1].events = POLLIN;
+        poll_info[1].revents = 0;
+        int rc = poll(poll_info, 2, (until - now) * 1000);
+        if( rc < 0 && errno == EINTR )
+        {
+            continue;
+        }
+        if( rc <= 0 )
+        {
+            continue;
+        }
+
+        if( poll_info[0].revents != 0 )
+        {
+            char ready = 0;
+            rc = recv(handoff_pipe[0], &ready, 1, MSG_DONTWAIT);
+            if( rc < 0 && (errno == EAGAIN || errno == EINTR) )
+            {
+                continue;
+            }
+            if( rc == 1 )
+            {
+                DEBUG("Child is ready.");
+                rval = 1;
+            }
+            else
+            {
+                DEBUG("Child went away?");
+                rval = -1;
+            }
+            break;
+        }
+        if( poll_info[1].revents != 0 )
+        {
+            DEBUG("Child exited.");
+            rval = -1;
+            break;
+        }
+    }
+
+    if( pidfd >= 0 )
+    {
+        libc.close(pidfd);
+    }
+    return rval;
+}
+
+typedef struct
+{
+    int efd;
+    int tfd;
+    uint32_t events;
+    uint64_t data;
+} epoll_reg_t;
+
+static epoll_reg_t*
+impl_epoll_snapshot(int* count)
+{
+    /* Note how everything is registered with epoll. There's
+     * no call to ask, but the kernel lists every registration
+     * in /proc/self/fdinfo. We read each epoll FD just once. */
+    epoll_reg_t* regs = NULL;
+    int size = 0;
+    *count = 0;
+
+    for( int efd = 0; efd < fd_limit(); efd += 1 )
+    {
+        fdinfo_t* info = fd_lookup(efd);
+        if( info == NULL || info->type != EPOLL )
+        {
+            continue;
+        }
+        char path[64];
+        snprintf(path, sizeof(path), "/proc/self/fdinfo/%d", efd);
+        FILE* fdinfo = fopen(path, "r");
+        if( fdinfo == NULL )
+        {
+            continue;
+        }
+        char line[256];
+        while( fgets(line, sizeof(line), fdinfo) != NULL )
+        {
+            int tfd;
+            unsigned int events;
+            unsigned long long data;
+            if( sscanf(line, "tfd: %d events: %x data: %llx",
+                       &tfd, &events, &data) != 3 )
+            {
+                continue;
+            }
+            if( *count == size )
+            {
+                size = size ? size * 2 : 16;
+                regs = realloc(regs, sizeof(epoll_reg_t) * size);
+            }
+            regs[*count].efd = efd;
+            regs[*count].tfd = tfd;
+            regs[*count].events = events;
+            regs[*count].data = data;
+            *count += 1;
+        }
+        fclose(fdinfo);
+    }
+
+    return regs;
+}
+
+static void
+impl_epoll_restore(int fd, fdinfo_t* info)
+{
+    /* Register the given descriptor everywhere the
+     * listener was registered (see impl_exit_start()). */
+    listenerinfo_t* listener = info->bound.listener;
+    for( int i = 0; i < listener->epolls; i += 1 )
+    {
+        struct epoll_event event;
+        event.events = listener->epoll[i].events;
+        event.data.u64 = listener->epoll[i].data;
+        epoll_ctl(listener->epoll[i].efd, EPOLL_CTL_ADD, fd, &event);
+    }
+}
+
+static void
+impl_reinstate(void)
+{
+    /* Put back every socket we swapped for a dummy, just as
+     * the program had it (see impl_exit_start()). */
+    for( int fd = 0; fd < fd_limit(); fd += 1 )
+    {
+        fdinfo_t* info = fd_lookup(fd);
+        if( info == NULL || info->type != BOUND ||
+            info->bound.listener->ghost_fd == 0 )
+        {
+            continue;
+        }
+        int orig_fd = info->bound.listener->ghost_fd - 1;
+        fdinfo_t* orig_info = fd_lookup(orig_fd);
+        if( orig_info != NULL &&
+            (orig_info->type != DUMMY || orig_info->dummy.bound != info) )
+        {
+            /* The program has moved on. */
+            continue;
+        }
+        if( orig_info != NULL )
+        {
+            /* In hybrid mode, the dummy is registered. */
+            for( int i = 0; i < info->bound.listener->epolls; i += 1 )
+            {
+                struct epoll_event no_event;
+                epoll_ctl(info->bound.listener->epoll[i].efd,
+                          EPOLL_CTL_DEL, orig_fd, &no_event);
+            }
+        }
+        if( libc.dup2(fd, orig_fd) < 0 )
+        {
+            continue;
+        }
+        impl_epoll_restore(orig_fd, info);
+
+        inc_ref(info);
+        fd_save(orig_fd, info);
+        if( orig_info != NULL )
+        {
+            dec_ref(orig_info);
+        }
+        fd_delete(fd);
+        dec_ref(info);
+        libc.close(fd);
+
+        info->bound.is_ghost = 0;
+        info->bound.listener->ghost_fd = 0;
+        info->bound.listener->epolls = 0;
+        info->bound.listener->drain_until = 0;
+        DEBUG("Reinstated FD %d.", orig_fd);
+    }
+}
+
+static void
+impl_rollback(const char* why)
+{
+    /* The next copy didn't make it. We carry on as we were,
+     * and the next restart will try again from scratch. */
+    fprintf(stderr, "huptime: restart failed (%s), rolling back.\n", why);
+    if( spawned_child > 0 )
+    {
+        kill(spawned_child, SIGKILL);
+        while( waitpid(spawned_child, NULL, 0) < 0 && errno == EINTR );
+        spawned_child = -1;
+    }
+
+    impl_hybrid_disarm();
+    impl_reinstate();
+    impl_park_wake();
+    is_exiting = FALSE;
+    if( gen_slot != NULL )
+    {
+        gen_slot->draining = 0;
+        gen_slot->drain_started = 0;
+    }
+    if( drain_fd >= 0 )
+    {
+        uint64_t value;
+        read(drain_fd, &value, sizeof(value));
+    }
+
+    impl_reset_handoff();
+    impl_init_thread();
+
+    if( master_pid == getpid() )
+    {
+        impl_notify("READY=1\nSTATUS=Restart rolled back");
+        impl_standby_kick();
+    }
+}
+
+static void
+impl_hybrid_arm(void)
+{
+    /* Have the program come to us. A client waiting on the
+     * dummy server makes every neutered listener readable,
+     * so the next thing an event loop does is accept() on one
+     * of them. We need one of the program's own threads to fork
+     * from, as the child gets only the thread that forked. */
+    struct sockaddr_un addr;
+    socklen_t addrlen = sizeof(addr);
+
+    if( dummy_server < 0 ||
+        getsockname(dummy_server, (struct sockaddr*)&addr, &addrlen) < 0 )
+    {
+        return;
+    }
+    hybrid_client = socket(AF_UNIX, SOCK_STREAM|SOCK_CLOEXEC, 0);
+    if( hybrid_client < 0 )
+    {
+        return;
+    }
+    if( connect(hybrid_client, (struct sockaddr*)&addr, addrlen) < 0 )
+    {
+        libc.close(hybrid_client);
+        hybrid_client = -1;
+        return;
+    }
+    hybrid_pending = TRUE;
+}
+
+static void
+impl_hybrid_disarm(void)
+{
+    /* Make the dummy server quiet again. */
+    hybrid_pending = FALSE;
+    if( hybrid_client >= 0 )
+    {
+        int client = libc.accept4(dummy_server, NULL, NULL,
+                                  SOCK_NONBLOCK|SOCK_CLOEXEC);
+        if( client >= 0 )
+        {
+            libc.close(client);
+        }
+        libc.close(hybrid_client);
+        hybrid_client = -1;
+    }
+}
+
+static int
+impl_program_threads(void)
+{
+    /* How many threads the program has. Ours are all
+     * named (see THREAD_NAME), so we leave those out. */
+    int threads = 0;
+    char line[256];
+    FILE* status = fopen("/proc/self/status", "r");
+    if( status == NULL )
+    {
+        return -1;
+    }
+    while( fgets(line, sizeof(line), status) != NULL )
+    {
+        if( sscanf(line, "Threads: %d", &threads) == 1 )
+        {
+            break;
+        }
+    }
+    fclose(status);
+
+    DIR* dir = opendir("/proc/self/task");
+    if( dir == NULL )
+    {
+        return threads;
+    }
+    struct dirent* entry;
+    while( (entry = readdir(dir)) != NULL )
+    {
+        int tid = strtol(entry->d_name, NULL, 10);
+        if( tid <= 0 )
+        {
+            continue;
+        }
+        char path[64];
+        snprintf(path, sizeof(path), "/proc/self/task/%d/comm", tid);
+        FILE* comm = fopen(path, "r");
+        if( comm == NULL )
+        {
+            continue;
+        }
+        if( fgets(line, sizeof(line), comm) != NULL &&
+            strcmp(line, THREAD_NAME "\n") == 0 )
+        {
+            threads -= 1;
+        }
+        fclose(comm);
+    }
+    closedir(dir);
+
+    return threads;
+}
+
+static void
+impl_hybrid_split(void)
+{
+    /* Split this process in two. The child keeps every
+     * active connection and drains like the old copy in fork
+     * mode, while we exec() the new copy right away. This way
+     * the pid doesn't change, and new connections only wait
+     * on the new copy starting up (and not on old ones).
+     * This is called without our lock held, and we only
+     * hold it across the fork() itself (so that the child
+     * gets a consistent copy) and the exec(). */
+    L();
+    while( in_hooks == TRUE )
+    {
+        /* Let the program finish up (see impl_restart()). */
+        U();
+        struct timespec ts = { 0, 10000000L };
+        nanosleep(&ts, NULL);
+        L();
+    }
+    if( hybrid_pending == FALSE )
+    {
+        U();
+        return;
+    }
+    impl_hybrid_disarm();
+
+    /* The child gets only this thread. If the program has
+     * others, they may well be the ones serving the active
+     * connections, so we carry on as in exec mode instead. */
+    int threads = impl_program_threads();
+    if( threads != 1 )
+    {
+        fprintf(stderr, "huptime: program has %d threads, "
+                "draining as in exec mode.\n", threads);
+        U();
+        return;
+    }
+
+    pid_t child = -1;
+    gen_slot_t* slot = gen_slot;
+    if( total_tracked > 0 )
+    {
+        /* We fork twice, so that the new copy isn't left
+         * with a child that it doesn't know to reap. */
+        int pids[2];
+        if( pipe2(pids, O_CLOEXEC) < 0 )
+        {
+            DEBUG("Unable to create pipes: %s", strerror(errno));
+            U();
+            return;
+        }
+        pid_t middle = libc.fork();
+        if( middle == 0 )
+        {
+            child = libc.fork();
+            if( child != 0 )
+            {
+                write(pids[1], &child, sizeof(child));
+                _exit(0);
+            }
+            libc.close(pids[0]);
+            libc.close(pids[1]);
+
+            DEBUG("I'm the drain child.");
+            exit_strategy = FORK;
+            drain_running = FALSE;
+            impl_init_lock();
+            L();
+            impl_drain_kick();
+            impl_exit_check();
+            U();
+            return;
+        }
+        libc.close(pids[1]);
+        if( middle > 0 )
+        {
+            while( waitpid(middle, NULL, 0) < 0 && errno == EINTR );
+            if( read(pids[0], &child, sizeof(child)) != sizeof(child) )
+            {
+                child = -1;
+            }
+        }
+        libc.close(pids[0]);
+        if( child < 0 )
+        {
+            /* Carry on as in exec mode. */
+            DEBUG("Unable to fork drain child.");
+            U();
+            return;
+        }
+
+        /* The child drains in our place. */
+        DEBUG("Drain child is %d.", child);
+        if( slot != NULL )
+        {
+            slot->pid = child;
+            slot->start_ticks = impl_gen_start_ticks(child);
+            gen_slot = NULL;
+        }
+    }
+
+    /* Give the program a last word. Nothing is left
+     * for impl_exit_check() to do here in the meantime. */
+    in_hooks = TRUE;
+    U();
+    impl_run_hooks(HUPTIME_PRE_EXEC);
+    L();
+    in_hooks = FALSE;
+
+    DEBUG("See you soon...");
+    exec_pending = TRUE;
+    if( impl_exec() < 0 )
+    {
+        exec_pending = FALSE;
+        if( child > 0 )
+        {
+            /* We still have everything the child has. */
+            kill(child, SIGKILL);
+            while( waitpid(child, NULL, 0) < 0 && errno == EINTR );
+            if( slot != NULL )
+            {
+                slot->pid = getpid();
+                slot->start_ticks = impl_gen_start_ticks(getpid());
+                gen_slot = slot;
+            }
+        }
+        impl_rollback("unable to exec");
+    }
+    U();
+}
+
+static void
+impl_retire(void)
+{
+    /* There's nobody to pass our sockets on to, so they
+     * are really closed (after swapping in a dummy, like
+     * below). In multi mode, this takes us out of the
+     * SO_REUSEPORT group, and the kernel sends new connections
+     * to the others (with net.ipv4.tcp_migrate_req set,
+     * whatever is still in our backlog goes too). */
+    if( gen_slot != NULL )
+    {
+        gen_slot->drain_started = time(NULL);
+        gen_slot->draining = 1;
+    }
+    for( int fd = 0; fd < fd_limit(); fd += 1 )
+    {
+        fdinfo_t* info = fd_lookup(fd);
+        if( info != NULL &&
+            info->type == BOUND &&
+            !info->bound.is_ghost &&
+            !info->bound.is_dgram )
+        {
+            /* A thread that's waiting in accept() (see
+             * do_accept4()) keeps the socket listening after
+             * the dummy goes in, so we stop it here as well. */
+            shutdown(fd, SHUT_RD);
+            inc_ref(info);
+            if( impl_dummy_install(fd, info) == 0 )
+            {
+                DEBUG("Retired FD %d.", fd);
+            }
+            dec_ref(info);
+        }
+    }
+}
+
+void
+impl_exit_start(void)
+{
+    bool_t is_master = (master_pid == getpid() &&
+                        is_retiring == FALSE) ? TRUE : FALSE;
+    bool_t spawned = FALSE;
+    long long start = impl_now_us();
+
+    if( is_exiting == TRUE )
+    {
+        return;
+    }
+
+    if( is_master == TRUE )
+    {
+        /* Check whether we have a standby to use. */
+        bool_t use_standby = FALSE;
+        if( exit_strategy == FORK && standby_pid > 0 )
+        {
+            if( impl_standby_usable() )
+            {
+                use_standby = TRUE;
+            }
+            else
+            {
+                DEBUG("Standby is out of date.");
+                impl_standby_discard();
+            }
+        }
+
+        /* Unlink files (e.g. pidfile). A standby
+         * will already have written its own. */
+        if( use_standby == FALSE &&
+            to_unlink != NULL && strlen(to_unlink) > 0 )
+        {
+            DEBUG("Unlinking '%s'...", to_unlink);
+            libc.unlink(to_unlink);
+        }
+
+        if( use_standby == TRUE )
+        {
+            impl_standby_release();
+            spawned = TRUE;
+        }
+
+        if( exit_strategy == FORK && (ready_time > 0 || rollback_time > 0) )
+        {
+            /* Start the child before giving anything up.
+             * We keep serving as usual until it tells us that
+             * it's ready (or we give up on it), so that new
+             * connections never wait on the child starting.
+             * With a rollback time, giving up on it means
+             * we carry on as if nothing had happened. */
+            if( spawned == FALSE )
+            {
+                impl_exit_spawn();
+                spawned = TRUE;
+            }
+            U();
+            int ready = impl_wait_ready(
+                rollback_time > 0 ? rollback_time : ready_time);
+            L();
+            if( ready <= 0 && rollback_time > 0 )
+            {
+                impl_rollback(ready < 0 ? "new copy exited" :
+                                          "new copy not ready in time");
+                return;
+            }
+            spawned_child = -1;
+        }
+    }
+
+    /* We are now exiting.
+     * After this point, all calls to various sockets,
+     * (i.e. accept(), listen(), etc. will result in stalls.
+     * We are just waiting until existing connections have 
+     * finished and then we will be either exec()'ing a new
+     * version or exiting this process. */
+    is_exiting = TRUE;
+
+    /* Get ready to restart.
+     * We only proceed with actual restart actions
+     * if we are the master process, otherwise we will
+     * simply prepare to shutdown cleanly once all the
+     * current active connections have finished. */
+    if( is_master == TRUE )
+    {
+        DEBUG("Exit started -- this is the master.");
+
+        /* In exec mode, we may have to put the sockets
+         * back if the exec fails (see impl_reinstate()). */
+        int epoll_count = 0;
+        epoll_reg_t* epoll_regs = exit_strategy != FORK ?
+            impl_epoll_snapshot(&epoll_count) : NULL;
+
+        if( gen_slot != NULL )
+        {
+            gen_slot->drain_started = time(NULL);
+            gen_slot->draining = 1;
+        }
+        long long neuter_start = impl_now_us();
+
+        /* Neuter this process. */
+        for( int fd = 0; fd < fd_limit(); fd += 1 )
+        {
+            fdinfo_t* info = fd_lookup(fd);
+            if( exit_strategy == FORK &&
+                info != NULL && info->type == SAVED )
+            {
+                /* Close initial files. Since these
+                 * are now passed on to the child, we
+                 * ensure that the parent won't mess 
+                 * with them anymore. Note that we still
+                 * have a copy as all SAVED descriptors. */
+                if( info->saved.fd == 2 )
+                {
+                    /* We treat stderr special.
+                     * Assuming logging will go here, we
+                     * allow the parent process to continue
+                     * writing to this file (and hope that
+                     * it's open in APPEND mode, etc.). */
+                    continue;
+                }
+                int nullfd = open("/dev/null", O_RDWR);
+                do_dup2(nullfd, info->saved.fd);
+                libc.close(nullfd);
+            }
+            if( info != NULL &&
+                info->type == BOUND && !info->bound.is_ghost )
+            {
+                /* Change BOUND sockets to dummy sockets.
+                 * This will allow select() and poll() to
+                 * operate as you expect, and never give
+                 * back new clients. */
+                listenerinfo_t* listener = info->bound.listener;
+                int newfd = do_dup(fd);
+                if( newfd >= 0 )
+                {
+                    int sender = info->bound.is_dgram ?
+                        impl_dgram_sender(info) :
+                        impl_dummy_server();
+                    if( sender >= 0 )
+                    {
+                        /* Remove the descriptor in any epoll FDs. */
+                        for( int efd = 0; efd < fd_limit(); efd += 1 )
+                        {
+                            fdinfo_t* einfo = fd_lookup(efd);
+                            if( einfo != NULL && einfo->type == EPOLL )
+                            {
+                                struct epoll_event no_event;
+                                epoll_ctl(efd, EPOLL_CTL_DEL, fd, &no_event);
+                            }
+                        }
+                        listener->epolls = 0;
+                        for( int i = 0; i < epoll_count; i += 1 )
+                        {
+                            if( epoll_regs[i].tfd == fd &&
+                                listener->epolls < BOUND_EPOLL_MAX )
+                            {
+                                int n = listener->epolls++;
+                                listener->epoll[n].efd = epoll_regs[i].efd;
+                                listener->epoll[n].events =
+                                    epoll_regs[i].events;
+                                listener->epoll[n].data = epoll_regs[i].data;
+                            }
+                        }
+
+                        info->bound.is_ghost = 1;
+                        listener->ghost_fd = fd + 1;
+                        if( info->bound.is_dgram )
+                        {
+                            /* Only the copy is needed. In exec mode
+                             * there's nobody else reading the original,
+                             * so we don't hold things up by lingering. */
+                            do_dup2(sender, fd);
+                            libc.close(sender);
+                            if( impl_dgram_lingers() )
+                            {
+                                linger_until = impl_now_us() +
+                                    linger_time * 1000000LL;
+                            }
+                        }
+                        else if( impl_dummy_install(fd, info) < 0 )
+                        {
+                            /* Leave the program with the real thing,
+                             * just as it had it (see impl_reinstate()).
+                             * In fork mode we didn't note down where it
+                             * was registered with epoll, but then we're
+                             * on our way out anyways. */
+                            fprintf(stderr, "huptime: unable to replace "
+                                    "fd %d with a dummy: %s\n",
+                                    fd, strerror(errno));
+                            info->bound.is_ghost = 0;
+                            listener->ghost_fd = 0;
+                            impl_epoll_restore(fd, info);
+                            listener->epolls = 0;
+                            do_close(newfd);
+                            continue;
+                        }
+                        else if( exit_strategy == HYBRID )
+                        {
+                            /* We want to hear about the program
+                             * trying to accept (see impl_hybrid_arm()). */
+                            impl_epoll_restore(fd, info);
+                        }
+                        DEBUG("Replaced FD %d with dummy.", fd);
+                    }
+                    else
+                    {
+                        do_close(newfd);
+                    }
+                }
+            }
+        }
+
+        free(epoll_regs);
+        impl_stat("neuter", neuter_start);
+
+        switch( exit_strategy )
+        {
+            case FORK:
+                if( spawned == FALSE )
+                {
+                    impl_exit_spawn();
+                }
+                break;
+
+            case EXEC:
+                /* Nothing necessary beyond the above,
+                 * unless we're to hold on to new connections. */
+                DEBUG("Exit strategy is exec.");
+                if( park_max > 0 )
+                {
+                    impl_park_start();
+                }
+                break;
+
+            case HYBRID:
+                DEBUG("Exit strategy is hybrid.");
+                impl_hybrid_arm();
+                break;
+        }
+    }
+    else
+    {
+        /* Force our strategy to fork, though we haven't forked.
+         * This will basically just have this process exit cleanly
+         * once all the current active connections have finished. */
+        DEBUG("Exit started -- this is the child.");
+        exit_strategy = FORK;
+        if( is_retiring == TRUE )
+        {
+            impl_retire();
+        }
+    }
+
+    /* Hold connections to their deadlines. */
+    impl_drain_start();
+
+    /* Let the program know. */
+    if( drain_fd >= 0 )
+    {
+        uint64_t one = 1;
+        write(drain_fd, &one, sizeof(one));
+    }
+
+    impl_stat("exit_start", start);
+}
+
+void
+impl_restart(void)
+{
+    /* Let our supervisor know what's going on. */
+    if( master_pid == getpid() && is_retiring == FALSE )
+    {
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        char state[64];
+        snprintf(state, sizeof(state), "RELOADING=1\nMONOTONIC_USEC=%llu",
+                 (unsigned long long)now.tv_sec * 1000000ULL +
+                 now.tv_nsec / 1000);
+        impl_notify(state);
+    }
+
+    /* Indicate that we are now exiting. */
+    L();
+    impl_exit_start();
+    if( is_exiting == FALSE )
+    {
+        /* We rolled back (see impl_rollback()). */
+        U();
+        return;
+    }
+    in_hooks = TRUE;
+    U();
+
+    impl_run_hooks(HUPTIME_POST_HANDOFF);
+
+    L();
+    in_hooks = FALSE;
+    impl_exit_check();
+    U();
+}
+
+void*
+impl_restart_thread(void* arg)
+{
+    /* Wait for our signal. */
+    while( 1 )
+    {
+        /* When the pool is sized to suit, it is shrunk by setting
+         * the retire flag in our slot (see bin/huptime). We check
+         * for it like the force flag below, and it goes through
+         * the pipe just like the signal (see impl_retire()). */
+        if( autoscale_mode == TRUE )
+        {
+            if( gen_slot != NULL && gen_slot->retire &&
+                is_retiring == FALSE && restart_pipe[1] != -1 )
+            {
+                DEBUG("Retiring...");
+                is_retiring = TRUE;
+                sighandler(SIGHUP);
+            }
+            struct pollfd poll_info;
+            poll_info.fd = restart_pipe[0];
+            poll_info.events = POLLIN;
+            poll_info.revents = 0;
+            if( poll(&poll_info, 1, 100) == 0 )
+            {
+                continue;
+            }
+        }
+
+        char go = 0;
+        int rc = read(restart_pipe[0], &go, 1);
+        if( rc == 1 )
+        {
+            /* Go. */
+            break;
+        }
+        else if( rc == 0 )
+        {
+            /* Wat? Restart. */
+            DEBUG("Restart pipe closed?!");
+            break;
+        }
+        else if( rc < 0 && (errno == EAGAIN || errno == EINTR) )
+        {
+            /* Keep trying. */
+            continue;
+        }
+        else
+        {
+            /* Real error. Let's restart. */
+            DEBUG("Restart pipe fubared?!");
+            break;
+        }
+    }
+
+    libc.close(restart_pipe[0]);
+    restart_pipe[0] = -1;
+
+    /* See note above in sighandler(). */
+    if( is_retiring == FALSE )
+    {
+        impl_gen_wait();
+    }
+    impl_restart();
+    if( is_exiting == FALSE )
+    {
+        /* There's a new thread for the next one. */
+        return arg;
+    }
+
+    /* Nothing will call back into us for datagram
+     * sockets, so we check again once we're done. */
+    if( linger_until != 0 )
+    {
+        long long now = impl_now_us();
+        if( now < linger_until )
+        {
+            struct timespec ts;
+            ts.tv_sec = (linger_until - now) / 1000000LL;
+            ts.tv_nsec = ((linger_until - now) % 1000000LL) * 1000;
+            while( nanosleep(&ts, &ts) < 0 && errno == EINTR );
+        }
+        L();
+        linger_until = 0;
+        impl_exit_check();
+        U();
+    }
+
+    /* Wait for impl_exit_check() if there are hooks to run
+     * before we exec(). They run here without our lock held. */
+    while( is_exiting == TRUE && exit_strategy != FORK &&
+           hooks[HUPTIME_PRE_EXEC - 1][0].fn != NULL )
+    {
+        L();
+        bool_t ready = exec_pending;
+        U();
+        if( ready == TRUE )
+        {
+            impl_run_hooks(HUPTIME_PRE_EXEC);
+            L();
+            DEBUG("See you soon...");
+            if( impl_exec() < 0 )
+            {
+                exec_pending = FALSE;
+                impl_rollback("unable to exec");
+            }
+            U();
+            return arg;
+        }
+        struct timespec ts = { 0, 10000000L };
+        nanosleep(&ts, NULL);
+    }
+
+    /* Wait in case a newer copy needs us gone
+     * (see impl_gen_wait()). We'll exit on our own. */
+    while( gen_slot != NULL && is_exiting == TRUE && gen_slot->force == 0 )
+    {
+        struct timespec ts = { 0, 100000000L };
+        nanosleep(&ts, NULL);
+    }
+    if( gen_slot != NULL && is_exiting == TRUE )
+    {
+        impl_gen_force();
+    }
+    return arg;
+}
+
+static void
+impl_fork_enter(sigset_t *set)
+{
+    /* We block SIGHUP during fork().
+     * This is because we communicate our restart
+     * intention via a pipe, and it's conceivable
+     * that between the fork() and impl_init_thread()
+     * the signal handler will be triggered and we'll
+     * end up writing to the restart pipe that is
+     * still connected to the master process. */
+    sigemptyset(set);
+    sigaddset(set, SIGHUP);
+    sigprocmask(SIG_BLOCK, set, NULL);
+    L();
+}
+
+static void
+impl_fork_leave(pid_t res, sigset_t *set)
+{
+    if( res == 0 )
+    {
+        owner_pid = getpid();
+
+        if( total_bound == 0 )
+        {
+            /* We haven't yet bound any sockets. This is
+             * a common pattern where the process may be
+             * daemonizing. We reset the master_pid so that
+             * the initalization routine will actually reset
+             * and treat this new process as a master.
+             * The reason we don't do this if sockets are
+             * already bound, is that if master_pid != getpid(),
+             * i.e. for process pools, then we neither fork()
+             * nor exec(), but simply go into a normal exit. */
+            master_pid = getpid();
+        }
+
+        /* The adopting thread didn't come with us.
+         * Workers are free to start their own. */
+        adopt_started = FALSE;
+
+        /* Only the master lets the standby go. */
+        if( is_standby == FALSE && standby_fd >= 0 )
+        {
+            fdinfo_t *info = fd_lookup(standby_fd);
+            if( info != NULL )
+            {
+                fd_delete(standby_fd);
+                dec_ref(info);
+            }
+            libc.close(standby_fd);
+            standby_fd = -1;
+        }
+        standby_pid = -1;
+
+        /* Nor did the drain thread (see impl_drain_kick()). */
+        drain_running = FALSE;
+
+        /* Workers are part of our copy, not a new one. */
+        gen_slot = NULL;
+
+        /* Workers drain on their own, so they need their
+         * own event (at the same number the program knows). */
+        if( drain_fd >= 0 )
+        {
+            int newfd = eventfd(is_exiting ? 1 : 0, EFD_CLOEXEC|EFD_NONBLOCK);
+            if( newfd >= 0 )
+            {
+                libc.dup3(newfd, drain_fd, O_CLOEXEC);
+                libc.close(newfd);
+            }
+        }
+
+        impl_init_lock();
+        impl_init_thread();
+    }
+    else
+    {
+        U();
+    }
+
+    sigprocmask(SIG_UNBLOCK, set, NULL);
+}
+
+static pid_t
+do_fork(void)
+{
+    pid_t res = (pid_t)-1;
+    sigset_t set;
+
+    DEBUG("do_fork() ...");
+    impl_fork_enter(&set);
+    res = libc.fork();
+    impl_fork_leave(res, &set);
+    DEBUG("do_fork() => %d", res);
+    return res;
+}
+
+/* Other ways of making a process.
+ *
+ * A clone() without CLONE_VM gets a copy of our memory,
+ * just like fork(), so the child gets the same treatment
+ * (via a trampoline, since it starts in a new function).
+ *
+ * Anything with CLONE_VM shares our memory. Threads are
+ * none of our business, and the rest (vfork(), or glibc's
+ * posix_spawn(), which is clone(CLONE_VM|CLONE_VFORK) on
+ * the inside) have a child that borrows our state until
+ * it calls exec(). We can't run anything in that child
+ * before the program does, so instead every call that
+ * would change our state checks impl_borrowed() first and
+ * goes straight through. The child's descriptors are its
+ * own, the table describing them is not. */
+typedef struct
+{
+    int (*fn)(void *);
+    void *arg;
+    sigset_t set;
+} clonecall_t;
+
+static int
+impl_clone_child(void *arg)
+{
+    /* This is our copy of the parent's call. */
+    clonecall_t *call = (clonecall_t*)arg;
+    impl_fork_leave(0, &call->set);
+    return call->fn(call->arg);
+}
+
+static int
+do_clone(int (*fn)(void *), void *stack, int flags, void *arg, ...)
+{
+    int res = -1;
+    clonecall_t call;
+
+    va_list ap;
+    va_start(ap, arg);
+    pid_t *ptid = va_arg(ap, pid_t*);
+    void *tls = va_arg(ap, void*);
+    pid_t *ctid = va_arg(ap, pid_t*);
+    va_end(ap);
+
+    if( flags & CLONE_VM )
+    {
+        return libc.clone(fn, stack, flags, arg, ptid, tls, ctid);
+    }
+
+    DEBUG("do_clone(%x) ...", flags);
+    call.fn = fn;
+    call.arg = arg;
+    impl_fork_enter(&call.set);
+    res = libc.clone(impl_clone_child, stack, flags, &call, ptid, tls, ctid);
+    impl_fork_leave(res, &call.set);
+    DEBUG("do_clone(%x) => %d", flags, res);
+    return res;
+}
+
+/* Socket options set on sockets that aren't bound yet.
+ * If one is then bound to an address we already have
+ * (from the previous copy), do_bind() swaps the program's
+ * socket for ours, so these have to be carried over. */
+#define PENDING_SOCKOPT_MAX (64)
+typedef struct
+{
+    int fd;
+    ino_t ino;
+    sockopt_t opt;
+} pendingopt_t;
+static pendingopt_t pending_opts[PENDING_SOCKOPT_MAX];
+static int pending_count = 0;
+
+static int
+sockopt_is_bpf(int level, int optname, int *is_fd)
+{
+    if( level != SOL_SOCKET )
+    {
+        return 0;
+    }
+    switch( optname )
+    {
+        case SO_ATTACH_FILTER:
+#ifdef SO_ATTACH_REUSEPORT_CBPF
+        case SO_ATTACH_REUSEPORT_CBPF:
+#endif
+            *is_fd = 0;
+            return 1;
+#ifdef SO_ATTACH_BPF
+        case SO_ATTACH_BPF:
+#endif
+#ifdef SO_ATTACH_REUSEPORT_EBPF
+        case SO_ATTACH_REUSEPORT_EBPF:
+#endif
+            *is_fd = 1;
+            return 1;
+    }
+    return 0;
+}
+
+static void
+sockopt_release(sockopt_t *opt)
+{
+    int is_fd = 0;
+    if( opt->opaque &&
+        opt->optlen > 0 &&
+        sockopt_is_bpf(opt->level, opt->optname, &is_fd) &&
+        !is_fd )
+    {
+        struct sock_fprog prog;
+        memcpy(&prog, opt->optval, sizeof(prog));
+        free(prog.filter);
+    }
+    if( opt->opaque )
+    {
+        opt->optlen = 0;
+        memset(opt->optval, 0, sizeof(opt->optval));
+    }
+}
+
+static void
+sockopt_fill(sockopt_t *opt,
+             int level, int optname,
+             const void *optval, socklen_t optlen,
+             bool_t keep)
+{
+    int is_fd = 0;
+
+    memset(opt, 0, sizeof(*opt));
+    opt->level = level;
+    opt->optname = optname;
+
+    if( sockopt_is_bpf(level, optname, &is_fd) )
+    {
+        /* Programs are passed by reference (a pointer,
+         * or a descriptor), so we can't pass them on.
+         * We do need to replay them if the program binds
+         * this socket and gets one of ours instead, though.
+         * Descriptors are used as is, the program would
+         * normally keep it until the socket is bound. */
+        opt->opaque = 1;
+        if( keep == FALSE )
+        {
+            return;
+        }
+        if( is_fd && optlen >= sizeof(int) )
+        {
+            opt->optlen = sizeof(int);
+            memcpy(opt->optval, optval, sizeof(int));
+        }
+        else if( !is_fd && optlen >= sizeof(struct sock_fprog) )
+        {
+            struct sock_fprog prog;
+            memcpy(&prog, optval, sizeof(prog));
+            size_t size = prog.len * sizeof(struct sock_filter);
+            struct sock_filter *filter = malloc(size);
+            if( filter != NULL )
+            {
+                memcpy(filter, prog.filter, size);
+                prog.filter = filter;
+                opt->optlen = sizeof(prog);
+                memcpy(opt->optval, &prog, sizeof(prog));
+            }
+        }
+    }
+    else if( optval == NULL || optlen > SOCKOPT_LEN_MAX )
+    {
+        /* Nothing we can record. */
+        opt->opaque = 1;
+    }
+    else
+    {
+        opt->optlen = optlen;
+        memcpy(opt->optval, optval, optlen);
+    }
+}
+
+static void
+sockopt_save(fdinfo_t *info, const sockopt_t *opt)
+{
+    listenerinfo_t* listener = info->bound.listener;
+    sockopt_t *slot = NULL;
+
+    for( int i = 0; i < listener->nopts; i += 1 )
+    {
+        if( listener->opts[i].level == opt->level &&
+            listener->opts[i].optname == opt->optname )
+        {
+            slot = &listener->opts[i];
+            break;
+        }
+    }
+    if( slot == NULL )
+    {
+        if( listener->opts == NULL )
+        {
+            listener->opts = calloc(BOUND_SOCKOPT_MAX, sizeof(sockopt_t));
+        }
+        if( listener->opts == NULL ||
+            listener->nopts >= BOUND_SOCKOPT_MAX )
+        {
+            DEBUG("Too many socket options, not saving %d:%d.",
+                  opt->level, opt->optname);
+            return;
+        }
+        slot = &listener->opts[listener->nopts];
+        listener->nopts += 1;
+    }
+
+    /* Whatever the value was, it's ours now. Opaque
+     * values are never passed on, just the fact that
+     * there was one (see impl_sockopt_reset()). */
+    memcpy(slot, opt, sizeof(*slot));
+    slot->inherited = 0;
+    if( slot->opaque )
+    {
+        slot->optlen = 0;
+        memset(slot->optval, 0, sizeof(slot->optval));
+    }
+}
+
+static int
+sock_unbound(int fd)
+{
+    struct sockaddr_storage addr;
+    socklen_t addrlen = sizeof(addr);
+
+    if( getsockname(fd, (struct sockaddr*)&addr, &addrlen) < 0 )
+    {
+        return 0;
+    }
+    switch( addr.ss_family )
+    {
+        case AF_INET:
+            return ((struct sockaddr_in*)&addr)->sin_port == 0;
+        case AF_INET6:
+            return ((struct sockaddr_in6*)&addr)->sin6_port == 0;
+        case AF_UNIX:
+            return addrlen <= offsetof(struct sockaddr_un, sun_path);
+    }
+    return 0;
+}
+
+static void
+impl_sockopt_pend(int fd,
+                  int level, int optname,
+                  const void *optval, socklen_t optlen)
+{
+    struct stat fd_stat;
+    pendingopt_t *slot = NULL;
+
+    if( fstat(fd, &fd_stat) < 0 )
+    {
+        return;
+    }
+
+    if( pending_count == PENDING_SOCKOPT_MAX )
+    {
+        /* Forget sockets that have since been closed,
+         * or connected (which binds them implicitly). */
+        for( int i = 0; i < pending_count; )
+        {
+            struct stat other_stat;
+            if( fstat(pending_opts[i].fd, &other_stat) < 0 ||
+                other_stat.st_ino != pending_opts[i].ino ||
+                !sock_unbound(pending_opts[i].fd) )
+            {
+                sockopt_release(&pending_opts[i].opt);
+                pending_count -= 1;
+                pending_opts[i] = pending_opts[pending_count];
+                continue;
+            }
+            i += 1;
+        }
+    }
+
+    for( int i = 0; i < pending_count; i += 1 )
+    {
+        if( pending_opts[i].fd == fd &&
+            pending_opts[i].ino == fd_stat.st_ino &&
+            pending_opts[i].opt.level == level &&
+            pending_opts[i].opt.optname == optname )
+        {
+            sockopt_release(&pending_opts[i].opt);
+            slot = &pending_opts[i];
+            break;
+        }
+    }
+    if( slot == NULL )
+    {
+        if( pending_count == PENDING_SOCKOPT_MAX )
+        {
+            DEBUG("Too many socket options, not recording %d:%d on %d.",
+                  level, optname, fd);
+            return;
+        }
+        slot = &pending_opts[pending_count];
+        pending_count += 1;
+    }
+
+    slot->fd = fd;
+    slot->ino = fd_stat.st_ino;
+    sockopt_fill(&slot->opt, level, optname, optval, optlen, TRUE);
+}
+
+static void
+sockopt_warn(int fd, const sockopt_t *opt, const char *why)
+{
+    fprintf(stderr,
+            "huptime: socket option %d:%d on %d can't be changed "
+            "on a live socket (%s).\n",
+            opt->level, opt->optname, fd, why);
+}
+
+static void
+impl_sockopt_replay(int sockfd, int fd, fdinfo_t *info)
+{
+    struct stat fd_stat;
+
+    /* Take the options the program set on sockfd before binding
+     * it and save them with the socket. If we're handing back one
+     * of our own sockets (fd), then they're also set on that. */
+    if( fstat(sockfd, &fd_stat) < 0 )
+    {
+        return;
+    }
+    for( int i = 0; i < pending_count; )
+    {
+        sockopt_t *opt = &pending_opts[i].opt;
+        if( pending_opts[i].fd != sockfd ||
+            pending_opts[i].ino != fd_stat.st_ino )
+        {
+            i += 1;
+            continue;
+        }
+
+        if( fd != sockfd && opt->opaque && opt->optlen == 0 )
+        {
+            sockopt_warn(fd, opt, "value not recorded");
+        }
+        else if( fd != sockfd &&
+                 libc.setsockopt(fd, opt->level, opt->optname,
+                                 opt->optval, opt->optlen) < 0 )
+        {
+            /* Some options can't be changed once bound
+             * (i.e. IPV6_V6ONLY), but may already match. */
+            char current[SOCKOPT_LEN_MAX];
+            socklen_t len = sizeof(current);
+            int err = errno;
+            if( opt->opaque ||
+                getsockopt(fd, opt->level, opt->optname, current, &len) < 0 ||
+                len != opt->optlen ||
+                memcmp(current, opt->optval, len) )
+            {
+                sockopt_warn(fd, opt, strerror(err));
+            }
+        }
+        else if( fd != sockfd )
+        {
+            DEBUG("Socket option %d:%d replayed on %d.",
+                  opt->level, opt->optname, fd);
+        }
+
+        sockopt_save(info, opt);
+        sockopt_release(opt);
+        pending_count -= 1;
+        pending_opts[i] = pending_opts[pending_count];
+    }
+}
+
+static void
+impl_sockopt_reset(int fd, fdinfo_t *info)
+{
+    listenerinfo_t* listener = info->bound.listener;
+    int probe = -1;
+
+    /* Options that the previous copy set, but this one hasn't,
+     * are still in force on the sockets we passed on. We put
+     * them back to how they'd be on a fresh socket. */
+    for( int i = 0; i < listener->nopts; )
+    {
+        sockopt_t *opt = &listener->opts[i];
+        int is_fd = 0;
+        int rval = 0;
+
+        if( !opt->inherited )
+        {
+            i += 1;
+            continue;
+        }
+
+        if( sockopt_is_bpf(opt->level, opt->optname, &is_fd) )
+        {
+            int detach = SO_DETACH_FILTER;
+            int dummy = 0;
+#ifdef SO_DETACH_REUSEPORT_BPF
+            if( opt->optname != SO_ATTACH_FILTER
+#ifdef SO_ATTACH_BPF
+                && opt->optname != SO_ATTACH_BPF
+#endif
+              )
+            {
+                detach = SO_DETACH_REUSEPORT_BPF;
+            }
+#endif
+            rval = libc.setsockopt(fd, SOL_SOCKET, detach,
+                                   &dummy, sizeof(dummy));
+        }
+        else if( opt->level == SOL_SOCKET &&
+                 (opt->optname == SO_RCVBUF ||
+                  opt->optname == SO_SNDBUF ||
+                  opt->optname == SO_RCVBUFFORCE ||
+                  opt->optname == SO_SNDBUFFORCE) )
+        {
+            /* Setting these pins the size for good. */
+            errno = EPERM;
+            rval = -1;
+        }
+        else
+        {
+            char value[SOCKOPT_LEN_MAX];
+            socklen_t len = sizeof(value);
+            int type = 0;
+            socklen_t typelen = sizeof(type);
+
+            if( probe < 0 &&
+                getsockopt(fd, SOL_SOCKET, SO_TYPE, &type, &typelen) == 0 )
+            {
+                probe = socket(info->bound.addr->sa_family,
+                               type | SOCK_CLOEXEC, 0);
+            }
+            rval = probe < 0 ? -1 :
+                   getsockopt(probe, opt->level, opt->optname, value, &len);
+            if( rval == 0 )
+            {
+                rval = libc.setsockopt(fd, opt->level, opt->optname,
+                                       value, len);
+            }
+        }
+
+        if( rval < 0 )
+        {
+            sockopt_warn(fd, opt, strerror(errno));
+        }
+        else
+        {
+            DEBUG("Socket option %d:%d reset on %d.",
+                  opt->level, opt->optname, fd);
+        }
+
+        listener->nopts -= 1;
+        memmove(opt, opt + 1,
+                (listener->nopts - i) * sizeof(sockopt_t));
+    }
+
+    if( probe >= 0 )
+    {
+        libc.close(probe);
+    }
+}
+
+static int
+do_setsockopt(int sockfd, int level, int optname,
+              const void *optval, socklen_t optlen)
+{
+    fdinfo_t *info = NULL;
+    int rval = libc.setsockopt(sockfd, level, optname, optval, optlen);
+
+    if( rval < 0 )
+    {
+        return rval;
+    }
+
+    DEBUG("do_setsockopt(%d, %d, %d, ...) ...", sockfd, level, optname);
+    L();
+    info = fd_lookup(sockfd);
+    if( info == NULL )
+    {
+        /* Only sockets that might still be bound matter. */
+        if( sock_unbound(sockfd) )
+        {
+            impl_sockopt_pend(sockfd, level, optname, optval, optlen);
+        }
+    }
+    else if( info->type == BOUND )
+    {
+        sockopt_t opt;
+        sockopt_fill(&opt, level, optname, optval, optlen, FALSE);
+        sockopt_save(info, &opt);
+    }
+    U();
+
+    DEBUG("do_setsockopt(%d, %d, %d, ...) => %d",
+          sockfd, level, optname, rval);
+    return rval;
+}
+
+static int
+do_bind(int sockfd, const struct sockaddr *addr, socklen_t addrlen)
+{
+    fdinfo_t *info = NULL;
+    int rval = -1;
+
+    if( sockfd < 0 )
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    /* At this point, we can reasonably assume
+     * the program has started up and has installed
+     * whatever signal handlers it wants. We check
+     * that our own signal handler is installed.
+     * If the user doesn't want us to override the
+     * built-in signal handlers, they shouldn't use
+     * huptime. */
+    impl_install_sighandlers();
+
+    DEBUG("do_bind(%d, ...) ...", sockfd);
+    L();
+
+    /* Internet datagram sockets are handled differently. */
+    int type = 0;
+    socklen_t typelen = sizeof(type);
+    if( getsockopt(sockfd, SOL_SOCKET, SO_TYPE, &type, &typelen) < 0 )
+    {
+        type = 0;
+    }
+    int is_dgram = (type == SOCK_DGRAM &&
+                    (addr->sa_family == AF_INET ||
+                     addr->sa_family == AF_INET6));
+
+    /* See if this socket already exists. */
+    for( int fd = 0; fd < fd_limit(); fd += 1 )
+    {
+        fdinfo_t *info = fd_lookup(fd);
+        if( info != NULL && 
+            info->type == BOUND &&
+            info_match(info, addr, addrlen, is_dgram) )
+        {
+            DEBUG("Found ghost %d, cloning...", fd);
+
+            /* Anything the program set up on its own
+             * socket has to be set up on this one. */
+            impl_sockopt_replay(sockfd, fd, info);
+            if( info->bound.is_dgram )
+            {
+                /* Never listened (see do_listen()). */
+                impl_sockopt_reset(fd, info);
+            }
+
+            /* Give back a duplicate of this one. */
+            int rval = do_dup2(fd, sockfd);
+            if( rval < 0 )
+            {
+                /* Dup2 failed? */
+                DEBUG("Failed.");
+                continue;
+            }
+            if( info->bound.is_ghost )
+            {
+                /* Close the original (not needed). */
+                info->bound.is_ghost = 0;
+                do_close(fd);
+            }
+
+            /* Success. */
+            U();
+            DEBUG("do_bind(%d, ...) => 0 (ghosted)", sockfd);
+            return 0;
+        }
+    }
+
+#ifdef SO_REUSEPORT
+    /* Multi mode? Set socket options.
+     * We also do this for datagram sockets, since we
+     * bind a second socket on restart (see
+     * impl_dgram_sender()). The kernel only allows it
+     * if this one had the option before it was bound. */
+    if( multi_mode == TRUE || is_dgram )
+    {
+        int optval = 1;
+        if( libc.setsockopt(sockfd,
+                            SOL_SOCKET,
+                            SO_REUSEPORT,
+                            &optval,
+                            sizeof(optval)) < 0 )
+        {
+            U();
+            DEBUG("do_bind(%d, ...) => -1 (no multi?)", sockfd);
+            return -1;
+        }
+
+        DEBUG("Multi mode enabled.");
+    }
+#endif
+#ifdef SO_INCOMING_CPU
+    if( multi_mode == TRUE && incoming_cpu >= 0 )
+    {
+        /* Have the kernel pick this socket out of the group
+         * for connections handled on our CPU, rather than by
+         * hash. Older kernels (before 6.1) ignore this. */
+        if( libc.setsockopt(sockfd,
+                            SOL_SOCKET,
+                            SO_INCOMING_CPU,
+                            &incoming_cpu,
+                            sizeof(incoming_cpu)) < 0 )
+        {
+            DEBUG("Unable to steer CPU %d: %s",
+                  incoming_cpu, strerror(errno));
+        }
+    }
+#endif
+
+    /* Try a real bind. */
+    info = alloc_info(BOUND);
+    if( info == NULL )
+    {
+        U();
+        DEBUG("do_bind(%d, ...) => -1 (alloc error?)", sockfd);
+        return -1;
+    }
+    rval = libc.bind(sockfd, addr, addrlen);
+    if( rval < 0 )
+    {
+        dec_ref(info);
+        U();
+        DEBUG("do_bind(%d, ...) => %d (error)", sockfd, rval);
+        return rval;
+    }
+
+    /* Ensure that this socket is non-blocking,
+     * this is because we override the behavior
+     * for accept() and we require non-blocking
+     * behavior. We deal with the consequences.
+     * Nobody will accept() on a datagram socket. */
+    rval = is_dgram ? 0 :
+           libc.fcntl(sockfd, F_SETFL, O_NONBLOCK);
+    if( rval < 0 )
+    {
+        dec_ref(info);
+        U();
+        DEBUG("do_bind(%d, ...) => %d (fcntl error)", sockfd, rval);
+        return -1;
+    }
+
+    /* Save a refresh bound socket info. */
+    info->bound.stub_listened = 0;
+    info->bound.real_listened = 0;
+#ifdef SO_REUSEPORT
+    info->bound.is_dgram = is_dgram;
+#endif
+    info->bound.addr = (struct sockaddr*)malloc(addrlen);
+    info->bound.addrlen = addrlen;
+    memcpy((void*)info->bound.addr, (void*)addr, addrlen);
+    fd_save(sockfd, info);
+    unix_path_add(info);
+    impl_sockopt_replay(sockfd, sockfd, info);
+
+    /* Success. */
+    U();
+    DEBUG("do_bind(%d, ...) => %d", sockfd, rval);
+    return rval;
+}
+
+static int
+do_listen(int sockfd, int backlog)
+{
+    int rval = -1;
+    fdinfo_t *info = NULL;
+
+    if( sockfd < 0 )
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    DEBUG("do_listen(%d, ...) ...", sockfd);
+    L();
+    info = fd_lookup(sockfd);
+    if( info == NULL || info->type != BOUND )
+    {
+        U();
+        DEBUG("do_listen(%d, %d) => -1 (not BOUND)", sockfd, backlog);
+        errno = EINVAL;
+        return -1;
+    }
+
+    /* Listening is as good a sign as any that the
+     * program is up, unless it's going to tell us itself.
+     * (Waiting for the first accept() could take forever.) */
+    if( unlikely(is_ready == FALSE) && ready_time == 0 )
+    {
+        impl_tell_ready();
+    }
+
+    /* By now the program has set whatever options it
+     * wants on this socket, so anything else left over
+     * from the previous copy shouldn't be there. */
+    impl_sockopt_reset(sockfd, info);
+
+    /* The program may have cleared O_NONBLOCK since do_bind(),
+     * which fcntl_common() allows until a socket is listening. */
+    if( !info->bound.is_dgram )
+    {
+        int flags = libc.fcntl(sockfd, F_GETFL);
+        if( flags >= 0 && !(flags & O_NONBLOCK) )
+        {
+            libc.fcntl(sockfd, F_SETFL, flags | O_NONBLOCK);
+        }
+    }
+
+    /* Check if we can short-circuit this. */
+    if( info->bound.real_listened )
+    {
+        info->bound.stub_listened = 1;
+        U();
+        DEBUG("do_listen(%d, %d) => 0 (stub)", sockfd, backlog);
+        return 0;
+    }
+
+    /* Can we really call listen() ? */
+    if( is_exiting == TRUE )
+    {
+        info->bound.stub_listened = 1;
+        U();
+        DEBUG("do_listen(%d, %d) => 0 (is_exiting)", sockfd, backlog);
+        return 0;
+    }
+
+    /* We largely ignore the backlog parameter. People 
+     * don't really use sensible values here for the most
+     * part. Hopefully (as is default on some systems),
+     * tcp syn cookies are enabled, and there's no real
+     * limit for this queue and this parameter is silently
+     * ignored. If not, then we use the largest value we 
+     * can sensibly use. */
+    (void)backlog;
+    rval = libc.listen(sockfd, SOMAXCONN);
+    if( rval < 0 )
+    {
+        U();
+        DEBUG("do_listen(%d, %d) => %d", sockfd, backlog, rval);
+        return rval;
+    }
+
+    /* We're done. */
+    info->bound.real_listened = 1;
+    info->bound.stub_listened = 1;
+    U();
+    DEBUG("do_listen(%d, %d) => %d", sockfd, backlog, rval);
+    return rval;
+}
+
+static int
+unix_path_protected(int dirfd, const char *pathname)
+{
+    struct stat path_stat;
+    int found = -1;
+
+    /* We compare the files rather than the names,
+     * so that relative paths and other directories
+     * don't matter. Only sockets are of interest. */
+    if( fstatat(dirfd, pathname, &path_stat, AT_SYMLINK_NOFOLLOW) < 0 ||
+        !S_ISSOCK(path_stat.st_mode) )
+    {
+        return 0;
+    }
+    for( int i = 0; i < unix_paths_count; i += 1 )
+    {
+        if( unix_paths[i].dev == path_stat.st_dev &&
+            unix_paths[i].ino == path_stat.st_ino )
+        {
+            found = i;
+            break;
+        }
+    }
+    if( found < 0 && unix_paths_overflow == FALSE )
+    {
+        return 0;
+    }
+
+    bool_t bound = FALSE;
+    for( int fd = 0; fd < fd_limit(); fd += 1 )
+    {
+        fdinfo_t *info = fd_lookup(fd);
+        char path[sizeof(struct sockaddr_un)];
+        struct stat bound_stat;
+
+        if( info == NULL ||
+            unix_path_get(info, path, sizeof(path)) < 0 ||
+            stat(path, &bound_stat) < 0 ||
+            bound_stat.st_dev != path_stat.st_dev ||
+            bound_stat.st_ino != path_stat.st_ino )
+        {
+            continue;
+        }
+        bound = TRUE;
+
+        /* The name is only protected while it is being
+         * passed between copies of the program. Otherwise,
+         * the program is free to remove it (i.e. on exit). */
+        if( info->bound.is_ghost ||
+            is_exiting == TRUE ||
+            revive_mode == TRUE )
+        {
+            return 1;
+        }
+    }
+
+    if( bound == FALSE && found >= 0 )
+    {
+        /* The listener is gone, so forget about it. */
+        unix_paths_count -= 1;
+        unix_paths[found] = unix_paths[unix_paths_count];
+    }
+    return 0;
+}
+
+static int
+do_unlinkat(int dirfd, const char *pathname, int flags)
+{
+    int rval = -1;
+
+    if( pathname == NULL || (flags & AT_REMOVEDIR) ||
+        (unix_paths_count == 0 && unix_paths_overflow == FALSE) )
+    {
+        /* There are no unix listeners to look out for. */
+        return dirfd == AT_FDCWD && flags == 0 ?
+               libc.unlink(pathname) :
+               libc.unlinkat(dirfd, pathname, flags);
+    }
+
+    DEBUG("do_unlinkat(%d, '%s', ...) ...", dirfd, pathname);
+    L();
+    if( unix_path_protected(dirfd, pathname) )
+    {
+        /* Programs will often remove the path prior to
+         * binding. We pretend that it is gone, since the
+         * bind() will give back the existing socket and
+         * clients will never see it disappear. */
+        U();
+        DEBUG("do_unlinkat(%d, '%s', ...) => 0 (bound)", dirfd, pathname);
+        return 0;
+    }
+    U();
+
+    rval = dirfd == AT_FDCWD && flags == 0 ?
+           libc.unlink(pathname) :
+           libc.unlinkat(dirfd, pathname, flags);
+    DEBUG("do_unlinkat(%d, '%s', ...) => %d", dirfd, pathname, rval);
+    return rval;
+}
+
+static int
+do_unlink(const char *pathname)
+{
+    return do_unlinkat(AT_FDCWD, pathname, 0);
+}
+
+static int
+do_accept4(int sockfd, struct sockaddr *addr, socklen_t *addrlen, int flags)
+{
+    int rval = -1;
+    fdinfo_t *info = NULL;
+
+    if( sockfd < 0 )
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    DEBUG("do_accept4(%d, ...) ...", sockfd);
+    L();
+    info = fd_lookup(sockfd);
+    if( info == NULL || (info->type != BOUND && info->type != DUMMY) )
+    {
+        U();
+        /* Should return an error. */
+        rval = libc.accept4(sockfd, addr, addrlen, flags);
+        DEBUG("do_accept4(%d, ...) => %d (no info)", sockfd, rval);
+        return rval;
+    }
+
+    /* Check that they've called listen. */
+    if( info->type == BOUND && !info->bound.stub_listened )
+    {
+        U();
+        DEBUG("do_accept4(%d, ...) => -1 (not listened)", sockfd);
+        errno = EINVAL;
+        return -1;
+    }
+
+    /* In hybrid mode, this is our cue. */
+    if( info->type == DUMMY && hybrid_pending == TRUE )
+    {
+        U();
+        impl_hybrid_split();
+        return do_accept4(sockfd, addr, addrlen, flags);
+    }
+
+    /* Check if this is a dummy.
+     * There's no way that they should be calling accept().
+     * The dummy FD will never trigger a poll, select, epoll,
+     * etc. So we just act as a socket with no clients does --
+     * either return immediately or block forever. NOTE: We
+     * still return in case of EINTR or other suitable errors. */
+    if( info->type == DUMMY && info->dummy.pending )
+    {
+        /* The client has already gone away. */
+        int pair[2];
+        info->dummy.pending = 0;
+        U();
+        rval = socketpair(AF_UNIX,
+            SOCK_STREAM|(flags & (SOCK_NONBLOCK|SOCK_CLOEXEC)), 0, pair);
+        if( rval == 0 )
+        {
+            libc.close(pair[1]);
+            rval = pair[0];
+        }
+        DEBUG("do_accept4(%d, ...) => %d (dummy client)", sockfd, rval);
+        return rval;
+    }
+
+    /* Nothing gets accepted on standby. */
+    if( unlikely(is_standby == TRUE) && info->type == BOUND )
+    {
+        impl_standby_hold();
+    }
+
+    /* Accepting means we're up, unless the program
+     * is going to tell us itself (see impl_ready()). */
+    if( unlikely(notified_ready == FALSE || is_ready == FALSE) &&
+        ready_time == 0 && info->type == BOUND )
+    {
+        impl_tell_ready();
+        impl_notify_ready();
+    }
+
+    /* Anything parked for us goes first (see impl_park_thread()). */
+    if( unlikely(info->type == BOUND && info->bound.listener->parked > 0) &&
+        is_exiting == FALSE )
+    {
+        rval = impl_unpark(info, addr, addrlen, flags);
+        if( rval >= 0 )
+        {
+            U();
+            DEBUG("do_accept4(%d, ...) => %d (parked)", sockfd, rval);
+            return rval;
+        }
+    }
+
+    U();
+
+    if( !(flags & SOCK_NONBLOCK) )
+    {
+        /* Wait for activity on the socket. */
+        struct pollfd poll_info;
+        poll_info.fd = sockfd;
+        poll_info.events = POLLIN;
+        poll_info.revents = 0;
+        if( poll(&poll_info, 1, -1) < 0 )
+        {
+            return -1;
+        }
+    }
+
+    L();
+
+    /* Check our status. */
+    if( is_exiting == TRUE )
+    {
+        /* We've transitioned from not exiting
+         * to exiting in this period. This will
+         * circle around a return a dummy descriptor. */
+        U();
+        DEBUG("do_accept4(%d, ...) => -1 (interrupted)", sockfd);
+        errno = flags & SOCK_NONBLOCK ? EAGAIN : EINTR;
+        return -1;
+    }
+
+    /* Do the accept for real. */
+    fdinfo_t *new_info = alloc_info(TRACKED);
+    if( new_info == NULL )
+    {
+        U();
+        DEBUG("do_accept4(%d, ...) => -1 (alloc error?)", sockfd);
+        return -1;
+    }
+    inc_ref(info);
+    new_info->tracked.bound = info;
+    rval = libc.accept4(sockfd, addr, addrlen, flags);
+
+    if( unlikely(rval >= 0 && info->bound.listener->wake_fd != 0) &&
+        impl_park_is_wake(info, rval) )
+    {
+        /* That was just us (see impl_park_wake()). We'd only
+         * retry a blocking accept() (see do_accept4_retry()), and
+         * block, so that gets a client that's already gone. */
+        impl_park_wake();
+        if( flags & SOCK_NONBLOCK )
+        {
+            libc.close(rval);
+            errno = EAGAIN;
+            rval = -1;
+        }
+    }
+
+    if( rval >= 0 )
+    {
+        /* Save the reference to the socket. */
+        fd_save(rval, new_info);
+
+        /* Count it against the listener. */
+        impl_count_accept(info, new_info);
+    }
+    else
+    {
+        /* An error occured, nothing to track. */
+        dec_ref(new_info);
+    }
+
+    U();
+    DEBUG("do_accept4(%d, ...) => %d (tracked %d) %s",
+        sockfd, rval, total_tracked,
+        rval == -1 ? strerror(errno) : "");
+    return rval;
+}
+
+static int
+do_accept4_retry(int sockfd, struct sockaddr *addr, socklen_t *addrlen, int flags)
+{
+    while (1)
+    {
+        int rval = do_accept4(sockfd, addr, addrlen, flags);
+        if( rval < 0 && (errno == EAGAIN || errno == EINTR) )
+        {
+            /* Signal interrupted the system call.
+             * Many programs cannot handle this cleanly,
+             * (hence why they are using huptime). So we
+             * simply absorb this error and continue. */
+            if( (flags & SOCK_NONBLOCK) && errno == EAGAIN )
+            {
+                return rval;
+            }
+            continue;
         }
-    }
-    else
-    {
-        /* Force our strategy to fork, though we haven't forked.
-         * This will basically just have this process exit cleanly
-         * once all the current active connections have finished. */
-        DEBUG("Exit started -- this is the child.");
-        exit_strategy = FORK;
+
+        /* Otherwise, give the error back. */
+        return rval;
     }
 }
 
-void
-impl_restart(void)
+static int
+do_accept_retry(int sockfd, struct sockaddr *addr, socklen_t *addrlen)
 {
-    /* Indicate that we are now exiting. */
+    return do_accept4_retry(sockfd, addr, addrlen, 0);
+}
+
+int
+impl_handoff(int fd, const void *state, size_t len)
+{
+    DEBUG("impl_handoff(%d, ...) ...", fd);
     L();
-    impl_exit_start();
-    impl_exit_check();
+    fdinfo_t *info = fd_lookup(fd);
+    if( info == NULL || info->type != TRACKED )
+    {
+        U();
+        DEBUG("impl_handoff(%d, ...) => -1 (not tracked)", fd);
+        errno = EINVAL;
+        return -1;
+    }
+    if( is_exiting == FALSE || handoff_pipe[0] < 0 )
+    {
+        U();
+        DEBUG("impl_handoff(%d, ...) => -1 (no restart)", fd);
+        errno = ENOTCONN;
+        return -1;
+    }
+
+    /* In exec mode nobody will read from the channel
+     * until we're gone, so we can't wait for space. */
+    int channel = handoff_pipe[0];
+    int flags = MSG_NOSIGNAL;
+    if( exit_strategy != FORK )
+    {
+        flags |= MSG_DONTWAIT;
+    }
     U();
+
+    /* Send the state (with its length, so that an
+     * empty state can't be mistaken for the end) and
+     * the connection itself as one message. */
+    uint32_t header = (uint32_t)len;
+    struct iovec iov[2];
+    iov[0].iov_base = &header;
+    iov[0].iov_len = sizeof(header);
+    iov[1].iov_base = (void*)state;
+    iov[1].iov_len = len;
+
+    char control[CMSG_SPACE(sizeof(int))];
+    memset(control, 0, sizeof(control));
+
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = 2;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+
+    ssize_t rc = -1;
+    do {
+        rc = sendmsg(channel, &msg, flags);
+    } while( rc < 0 && errno == EINTR );
+
+    if( rc < 0 )
+    {
+        DEBUG("impl_handoff(%d, ...) => -1 (%s)", fd, strerror(errno));
+        return -1;
+    }
+
+    /* The next copy has it now. */
+    do_close(fd);
+    DEBUG("impl_handoff(%d, ...) => 0", fd);
+    return 0;
 }
 
-void*
-impl_restart_thread(void* arg)
+static void*
+impl_adopt_thread(void* arg)
 {
-    /* Wait for our signal. */
-    while( 1 )
+    size_t size = sizeof(uint32_t) + HUPTIME_HANDOFF_MAX;
+    char *buffer = malloc(size);
+
+    while( buffer != NULL )
     {
-        char go = 0;
-        int rc = read(restart_pipe[0], &go, 1);
-        if( rc == 1 )
+        struct iovec iov;
+        iov.iov_base = buffer;
+        iov.iov_len = size;
+
+        char control[CMSG_SPACE(sizeof(int))];
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+
+        ssize_t rc = recvmsg(adopt_fd, &msg, 0);
+        if( rc < 0 && errno == EINTR )
         {
-            /* Go. */
-            break;
+            continue;
         }
-        else if( rc == 0 )
+        if( rc <= 0 )
         {
-            /* Wat? Restart. */
-            DEBUG("Restart pipe closed?!");
+            /* The previous copy has exited. */
             break;
         }
-        else if( rc < 0 && (errno == EAGAIN || errno == EINTR) )
+
+        int fd = -1;
+        for( struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+             cmsg != NULL;
+             cmsg = CMSG_NXTHDR(&msg, cmsg) )
+        {
+            if( cmsg->cmsg_level == SOL_SOCKET &&
+                cmsg->cmsg_type == SCM_RIGHTS )
+            {
+                memcpy(&fd, CMSG_DATA(cmsg), sizeof(int));
+            }
+        }
+        if( fd < 0 )
         {
-            /* Keep trying. */
             continue;
         }
-        else
+
+        uint32_t len = 0;
+        if( rc >= (ssize_t)sizeof(len) )
         {
-            /* Real error. Let's restart. */
-            DEBUG("Restart pipe fubared?!");
-            break;
+            memcpy(&len, buffer, sizeof(len));
+        }
+        if( (size_t)rc != sizeof(len) + len ||
+            (msg.msg_flags & (MSG_TRUNC|MSG_CTRUNC)) )
+        {
+            DEBUG("Dropping handed off fd %d (bad state).", fd);
+            libc.close(fd);
+            continue;
         }
+
+        /* This is ours to wait for now. */
+        L();
+        fd_save(fd, alloc_info(TRACKED));
+        U();
+        DEBUG("Adopted fd %d (%u bytes of state, %d tracked).",
+              fd, len, total_tracked);
+
+        adopt_cb(fd, buffer + sizeof(len), len, adopt_data);
     }
 
-    libc.close(restart_pipe[0]);
-    restart_pipe[0] = -1;
+    free(buffer);
 
-    /* See note above in sighandler(). */
-    impl_restart();
+    L();
+    fdinfo_t *info = fd_lookup(adopt_fd);
+    if( info != NULL )
+    {
+        fd_delete(adopt_fd);
+        dec_ref(info);
+    }
+    libc.close(adopt_fd);
+    adopt_fd = -1;
+    U();
+
+    DEBUG("Finished adopting.");
     return arg;
 }
 
-static pid_t
-do_fork(void)
+int
+impl_adopt(huptime_adopt_t cb, void *data)
 {
-    pid_t res = (pid_t)-1;
-
-    /* We block SIGHUP during fork().
-     * This is because we communicate our restart
-     * intention via a pipe, and it's conceivable
-     * that between the fork() and impl_init_thread()
-     * the signal handler will be triggered and we'll
-     * end up writing to the restart pipe that is
-     * still connected to the master process. */
-    sigset_t set;
-    sigemptyset(&set);
-    sigaddset(&set, SIGHUP);
-    sigprocmask(SIG_BLOCK, &set, NULL);
-
-    DEBUG("do_fork() ...");
-
+    DEBUG("impl_adopt(...) ...");
     L();
-    res = libc.fork();
-    if( res == 0 )
+    if( adopt_fd < 0 )
     {
-        if( total_bound == 0 )
-        {
-            /* We haven't yet bound any sockets. This is
-             * a common pattern where the process may be
-             * daemonizing. We reset the master_pid so that
-             * the initalization routine will actually reset
-             * and treat this new process as a master.
-             * The reason we don't do this if sockets are
-             * already bound, is that if master_pid != getpid(),
-             * i.e. for process pools, then we neither fork()
-             * nor exec(), but simply go into a normal exit. */
-            master_pid = getpid();
-        }
-
-        impl_init_lock();
-        impl_init_thread();
+        /* Nothing to adopt. */
+        U();
+        DEBUG("impl_adopt(...) => 0 (no previous copy)");
+        return 0;
     }
-    else
+    if( adopt_started == TRUE )
     {
         U();
+        DEBUG("impl_adopt(...) => -1 (already started)");
+        errno = EBUSY;
+        return -1;
     }
 
-    sigprocmask(SIG_UNBLOCK, &set, NULL);
-    DEBUG("do_fork() => %d", res);
-    return res;
-}
-
-static int
-do_bind(int sockfd, const struct sockaddr *addr, socklen_t addrlen)
-{
-    fdinfo_t *info = NULL;
-    int rval = -1;
+    adopt_cb = cb;
+    adopt_data = data;
 
-    if( sockfd < 0 )
+    pthread_t thread;
+    pthread_attr_t thread_attr;
+    pthread_attr_init(&thread_attr);
+    pthread_attr_setdetachstate(&thread_attr, 1);
+    int rc = pthread_create(&thread, &thread_attr, impl_adopt_thread, NULL);
+    if( rc != 0 )
     {
-        errno = EINVAL;
+        U();
+        DEBUG("impl_adopt(...) => -1 (%s)", strerror(rc));
+        errno = rc;
         return -1;
     }
 
-    /* At this point, we can reasonably assume
-     * the program has started up and has installed
-     * whatever signal handlers it wants. We check
-     * that our own signal handler is installed.
-     * If the user doesn't want us to override the
-     * built-in signal handlers, they shouldn't use
-     * huptime. */
-    impl_install_sighandlers();
+    adopt_started = TRUE;
+    U();
+    DEBUG("impl_adopt(...) => 0");
+    return 0;
+}
 
-    DEBUG("do_bind(%d, ...) ...", sockfd);
+int
+impl_ready(void)
+{
+    DEBUG("impl_ready() ...");
     L();
+    impl_tell_ready();
+    impl_notify_ready();
+    U();
+    DEBUG("impl_ready() => 0");
+    return 0;
+}
 
-    /* See if this socket already exists. */
-    for( int fd = 0; fd < fd_limit(); fd += 1 )
+int
+impl_is_draining(void)
+{
+    return is_exiting == TRUE;
+}
+
+int
+impl_drain_fd(void)
+{
+    L();
+    if( drain_fd < 0 )
     {
-        fdinfo_t *info = fd_lookup(fd);
-        if( info != NULL && 
-            info->type == BOUND &&
-            info->bound.addrlen == addrlen &&
-            !memcmp(addr, (void*)info->bound.addr, addrlen) )
+        drain_fd = eventfd(is_exiting ? 1 : 0, EFD_CLOEXEC|EFD_NONBLOCK);
+        if( drain_fd >= 0 )
         {
-            DEBUG("Found ghost %d, cloning...", fd);
-
-            /* Give back a duplicate of this one. */
-            int rval = do_dup2(fd, sockfd);
-            if( rval < 0 )
-            {
-                /* Dup2 failed? */
-                DEBUG("Failed.");
-                continue;
-            }
-            if( info->bound.is_ghost )
-            {
-                /* Close the original (not needed). */
-                info->bound.is_ghost = 0;
-                do_close(fd);
-            }
-
-            /* Success. */
-            U();
-            DEBUG("do_bind(%d, ...) => 0 (ghosted)", sockfd);
-            return 0;
+            fd_save(drain_fd, alloc_info(CONTROL));
         }
     }
+    U();
+    DEBUG("impl_drain_fd() => %d", drain_fd);
+    return drain_fd;
+}
 
-#ifdef SO_REUSEPORT
-    /* Multi mode? Set socket options. */
-    if( multi_mode == TRUE )
+int
+impl_hook(int event, huptime_hook_t fn, void *data)
+{
+    L();
+    for( int i = 0; i < HOOK_MAX; i += 1 )
     {
-        int optval = 1;
-        if( setsockopt(sockfd,
-                       SOL_SOCKET,
-                       SO_REUSEPORT,
-                       &optval,
-                       sizeof(optval)) < 0 )
+        if( hooks[event - 1][i].fn == NULL )
         {
+            hooks[event - 1][i].fn = fn;
+            hooks[event - 1][i].data = data;
             U();
-            DEBUG("do_bind(%d, ...) => -1 (no multi?)", sockfd);
-            return -1;
+            DEBUG("impl_hook(%d, ...) => 0", event);
+            return 0;
         }
-
-        DEBUG("Multi mode enabled.");
     }
-#endif
+    U();
+    DEBUG("impl_hook(%d, ...) => -1 (full)", event);
+    errno = ENOSPC;
+    return -1;
+}
 
-    /* Try a real bind. */
-    info = alloc_info(BOUND);
-    if( info == NULL )
-    {
-        U();
-        DEBUG("do_bind(%d, ...) => -1 (alloc error?)", sockfd);
-        return -1;
-    }
-    rval = libc.bind(sockfd, addr, addrlen);
-    if( rval < 0 )
-    {
-        dec_ref(info);
-        U();
-        DEBUG("do_bind(%d, ...) => %d (error)", sockfd, rval);
-        return rval;
-    }
+int
+impl_generation(void)
+{
+    return generation;
+}
 
-    /* Ensure that this socket is non-blocking,
-     * this is because we override the behavior
-     * for accept() and we require non-blocking
-     * behavior. We deal with the consequences. */
-    rval = fcntl(sockfd, F_SETFL, O_NONBLOCK);
-    if( rval < 0 )
+int
+impl_generations(struct huptime_generation_info *gens, int max)
+{
+    if( gen_table == NULL )
     {
-        dec_ref(info);
-        U();
-        DEBUG("do_bind(%d, ...) => %d (fcntl error)", sockfd, rval);
+        errno = ENOSYS;
         return -1;
     }
 
-    /* Save a refresh bound socket info. */
-    info->bound.stub_listened = 0;
-    info->bound.real_listened = 0;
-    info->bound.addr = (struct sockaddr*)malloc(addrlen);
-    info->bound.addrlen = addrlen;
-    memcpy((void*)info->bound.addr, (void*)addr, addrlen);
-    fd_save(sockfd, info);
+    int count = 0;
+    for( int i = 0; i < GENERATIONS_MAX && count < max; i += 1 )
+    {
+        gen_slot_t* slot = &gen_table[i];
+        if( !impl_gen_alive(slot) || slot->started == 0 )
+        {
+            continue;
+        }
 
-    /* Success. */
-    U();
-    DEBUG("do_bind(%d, ...) => %d", sockfd, rval);
-    return rval;
+        struct huptime_generation_info* gen = &gens[count];
+        memset(gen, 0, sizeof(*gen));
+        gen->pid = slot->pid;
+        gen->generation = slot->generation;
+        gen->draining = slot->draining;
+        gen->tracked = slot->tracked;
+
+        /* The rest comes straight from the kernel. */
+        char path[64];
+        snprintf(path, sizeof(path), "/proc/%d/statm", gen->pid);
+        FILE* statm = fopen(path, "r");
+        if( statm != NULL )
+        {
+            unsigned long size = 0;
+            unsigned long resident = 0;
+            if( fscanf(statm, "%lu %lu", &size, &resident) == 2 )
+            {
+                gen->rss_kb = resident * (sysconf(_SC_PAGESIZE) / 1024);
+            }
+            fclose(statm);
+        }
+        snprintf(path, sizeof(path), "/proc/%d/fd", gen->pid);
+        DIR* fds = opendir(path);
+        if( fds != NULL )
+        {
+            struct dirent* entry;
+            while( (entry = readdir(fds)) != NULL )
+            {
+                if( entry->d_name[0] != '.' )
+                {
+                    gen->fds += 1;
+                }
+            }
+            closedir(fds);
+        }
+        count += 1;
+    }
+
+    DEBUG("impl_generations(...) => %d", count);
+    return count;
 }
 
-static int
-do_listen(int sockfd, int backlog)
+static fdinfo_t*
+impl_listener(int fd)
 {
-    int rval = -1;
-    fdinfo_t *info = NULL;
-
-    if( sockfd < 0 )
+    /* Find the listening socket for the given descriptor.
+     * After a restart, this is what the dummy stands in for. */
+    fdinfo_t* info = fd_lookup(fd);
+    if( info != NULL && info->type == DUMMY )
     {
-        errno = EINVAL;
-        return -1;
+        info = info->dummy.bound;
+    }
+    if( info == NULL || info->type != BOUND || info->bound.is_dgram )
+    {
+        return NULL;
     }
+    return info;
+}
 
-    DEBUG("do_listen(%d, ...) ...", sockfd);
+int
+impl_listener_stats(int fd, struct huptime_listener_stats *stats)
+{
     L();
-    info = fd_lookup(sockfd);
-    if( info == NULL || info->type != BOUND )
+    fdinfo_t* info = impl_listener(fd);
+    if( info == NULL )
     {
         U();
-        DEBUG("do_listen(%d, %d) => -1 (not BOUND)", sockfd, backlog);
+        DEBUG("impl_listener_stats(%d, ...) => -1 (not listening)", fd);
         errno = EINVAL;
         return -1;
     }
 
-    /* Check if we can short-circuit this. */
-    if( info->bound.real_listened )
+    time_t now = time(NULL);
+    stats->tracked = info->bound.listener->tracked;
+    stats->accepted = info->bound.listener->accepted;
+    if( now == info->bound.listener->accept_second )
     {
-        info->bound.stub_listened = 1;
-        U();
-        DEBUG("do_listen(%d, %d) => 0 (stub)", sockfd, backlog);
-        return 0;
+        stats->accept_rate = info->bound.listener->accept_last;
     }
-
-    /* Can we really call listen() ? */
-    if( is_exiting == TRUE )
+    else if( now == info->bound.listener->accept_second + 1 )
     {
-        info->bound.stub_listened = 1;
-        U();
-        DEBUG("do_listen(%d, %d) => 0 (is_exiting)", sockfd, backlog);
-        return 0;
+        stats->accept_rate = info->bound.listener->accept_count;
     }
-
-    /* We largely ignore the backlog parameter. People 
-     * don't really use sensible values here for the most
-     * part. Hopefully (as is default on some systems),
-     * tcp syn cookies are enabled, and there's no real
-     * limit for this queue and this parameter is silently
-     * ignored. If not, then we use the largest value we 
-     * can sensibly use. */
-    (void)backlog;
-    rval = libc.listen(sockfd, SOMAXCONN);
-    if( rval < 0 )
+    else
     {
-        U();
-        DEBUG("do_listen(%d, %d) => %d", sockfd, backlog, rval);
-        return rval;
+        stats->accept_rate = 0;
     }
-
-    /* We're done. */
-    info->bound.real_listened = 1;
-    info->bound.stub_listened = 1;
+    stats->draining = info->bound.listener->drain_until != 0;
     U();
-    DEBUG("do_listen(%d, %d) => %d", sockfd, backlog, rval);
-    return rval;
+    return 0;
 }
 
-static int
-do_accept4(int sockfd, struct sockaddr *addr, socklen_t *addrlen, int flags)
+int
+impl_listener_deadline(int fd, int seconds)
 {
-    int rval = -1;
-    fdinfo_t *info = NULL;
-
-    if( sockfd < 0 )
+    L();
+    fdinfo_t* info = impl_listener(fd);
+    if( info == NULL )
     {
+        U();
+        DEBUG("impl_listener_deadline(%d, %d) => -1 (not listening)", fd, seconds);
         errno = EINVAL;
         return -1;
     }
+    info->bound.has_deadline = seconds >= 0;
+    info->bound.listener->deadline = seconds;
+    U();
+    DEBUG("impl_listener_deadline(%d, %d) => 0", fd, seconds);
+    return 0;
+}
 
-    DEBUG("do_accept4(%d, ...) ...", sockfd);
+int
+impl_listener_drain(int fd, int seconds)
+{
     L();
-    info = fd_lookup(sockfd);
-    if( info == NULL || (info->type != BOUND && info->type != DUMMY) )
-    {
-        U();
-        /* Should return an error. */
-        rval = libc.accept4(sockfd, addr, addrlen, flags);
-        DEBUG("do_accept4(%d, ...) => %d (no info)", sockfd, rval);
-        return rval;
-    }
-
-    /* Check that they've called listen. */
-    if( info->type == BOUND && !info->bound.stub_listened )
+    fdinfo_t* info = impl_listener(fd);
+    if( info == NULL )
     {
         U();
-        DEBUG("do_accept4(%d, ...) => -1 (not listened)", sockfd);
+        DEBUG("impl_listener_drain(%d, %d) => -1 (not listening)", fd, seconds);
         errno = EINVAL;
         return -1;
     }
 
-    /* Check if this is a dummy.
-     * There's no way that they should be calling accept().
-     * The dummy FD will never trigger a poll, select, epoll,
-     * etc. So we just act as a socket with no clients does --
-     * either return immediately or block forever. NOTE: We
-     * still return in case of EINTR or other suitable errors. */
-    if( info->type == DUMMY && info->dummy.client >= 0 )
-    {
-        rval = info->dummy.client;
-        info->dummy.client = -1;
-        U();
-        DEBUG("do_accept4(%d, ...) => %d (dummy client)", sockfd, rval);
-        return rval;
-    }
-
+    /* Only the connections open right now. */
+    info->bound.listener->drain_until = time(NULL) + seconds;
+    info->bound.listener->drain_seq = info->bound.listener->accepted;
+    impl_drain_kick();
     U();
+    DEBUG("impl_listener_drain(%d, %d) => 0", fd, seconds);
+    return 0;
+}
 
-    if( !(flags & SOCK_NONBLOCK) )
+int
+impl_region_register(const char *name, int fd)
+{
+    DEBUG("impl_region_register('%s', %d) ...", name, fd);
+
+    /* We keep our own copy, so the program is
+     * free to do whatever it likes with the original. */
+    struct stat st;
+    if( fstat(fd, &st) < 0 )
     {
-        /* Wait for activity on the socket. */
-        struct pollfd poll_info;
-        poll_info.fd = sockfd;
-        poll_info.events = POLLIN;
-        poll_info.revents = 0;
-        if( poll(&poll_info, 1, -1) < 0 )
-        {
-            return -1;
-        }
+        return -1;
     }
-
-    L();
-
-    /* Check our status. */
-    if( is_exiting == TRUE )
+    if( !S_ISREG(st.st_mode) )
     {
-        /* We've transitioned from not exiting
-         * to exiting in this period. This will
-         * circle around a return a dummy descriptor. */
-        U();
-        DEBUG("do_accept4(%d, ...) => -1 (interrupted)", sockfd);
-        errno = flags & SOCK_NONBLOCK ? EAGAIN : EINTR;
+        errno = EINVAL;
         return -1;
     }
-
-    /* Do the accept for real. */
-    fdinfo_t *new_info = alloc_info(TRACKED);
-    if( new_info == NULL )
+    int newfd = libc.fcntl(fd, F_DUPFD_CLOEXEC, 0);
+    if( newfd < 0 )
     {
-        U();
-        DEBUG("do_accept4(%d, ...) => -1 (alloc error?)", sockfd);
         return -1;
     }
-    inc_ref(info);
-    new_info->tracked.bound = info;
-    rval = libc.accept4(sockfd, addr, addrlen, flags);
 
-    if( rval >= 0 )
+    L();
+
+    /* Replace any region with the same name. */
+    for( int i = 0; i < fd_limit(); i += 1 )
     {
-        /* Save the reference to the socket. */
-        fd_save(rval, new_info);
+        fdinfo_t *info = fd_lookup(i);
+        if( info != NULL && info->type == REGION &&
+            !info->region.inherited &&
+            !strncmp(info->region.name, name, REGION_NAME_MAX) )
+        {
+            fd_delete(i);
+            dec_ref(info);
+            libc.close(i);
+        }
     }
-    else
+
+    fdinfo_t *info = alloc_info(REGION);
+    info->region.name = strndup(name, REGION_NAME_MAX - 1);
+    if( info->region.name == NULL )
     {
-        /* An error occured, nothing to track. */
-        dec_ref(new_info);
+        U();
+        dec_ref(info);
+        libc.close(newfd);
+        errno = ENOMEM;
+        return -1;
     }
+    fd_save(newfd, info);
 
     U();
-    DEBUG("do_accept4(%d, ...) => %d (tracked %d) %s",
-        sockfd, rval, total_tracked,
-        rval == -1 ? strerror(errno) : "");
-    return rval;
+    DEBUG("impl_region_register('%s', %d) => 0 (fd %d)", name, fd, newfd);
+    return 0;
 }
 
-static int
-do_accept4_retry(int sockfd, struct sockaddr *addr, socklen_t *addrlen, int flags)
+void*
+impl_region_map(const char *name, size_t *size)
 {
-    while (1)
+    DEBUG("impl_region_map('%s', ...) ...", name);
+    L();
+
+    for( int fd = 0; fd < fd_limit(); fd += 1 )
     {
-        int rval = do_accept4(sockfd, addr, addrlen, flags);
-        if( rval < 0 && (errno == EAGAIN || errno == EINTR) )
+        fdinfo_t *info = fd_lookup(fd);
+        if( info == NULL || info->type != REGION ||
+            !info->region.inherited ||
+            strncmp(info->region.name, name, REGION_NAME_MAX) )
         {
-            /* Signal interrupted the system call.
-             * Many programs cannot handle this cleanly,
-             * (hence why they are using huptime). So we
-             * simply absorb this error and continue. */
-            if( (flags & SOCK_NONBLOCK) && errno == EAGAIN )
+            continue;
+        }
+
+        /* The mapping keeps the region alive, so we're
+         * done with the descriptor either way. */
+        void *addr = MAP_FAILED;
+        struct stat st;
+        if( fstat(fd, &st) == 0 )
+        {
+            if( st.st_size > 0 )
             {
-                return rval;
+                addr = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+            }
+            else
+            {
+                errno = ENODATA;
             }
-            continue;
         }
+        int saved_errno = errno;
+        fd_delete(fd);
+        dec_ref(info);
+        libc.close(fd);
+        errno = saved_errno;
+        U();
 
-        /* Otherwise, give the error back. */
-        return rval;
+        if( addr == MAP_FAILED )
+        {
+            DEBUG("impl_region_map('%s', ...) => NULL (%s)",
+                  name, strerror(errno));
+            return NULL;
+        }
+
+        *size = st.st_size;
+        DEBUG("impl_region_map('%s', ...) => %p (%lld bytes)",
+              name, addr, (long long)st.st_size);
+        return addr;
     }
-}
 
-static int
-do_accept_retry(int sockfd, struct sockaddr *addr, socklen_t *addrlen)
-{
-    return do_accept4_retry(sockfd, addr, addrlen, 0);
+    U();
+    DEBUG("impl_region_map('%s', ...) => NULL (not found)", name);
+    errno = ENOENT;
+    return NULL;
 }
 
 static void
 do_exit(int status)
 {
+    if( impl_borrowed() )
+    {
+        /* Not our exit to deal with (see do_clone()). */
+        libc.exit(status);
+    }
+
     if( revive_mode == TRUE )
     {
         DEBUG("Reviving...");
         impl_exec();
     }
 
+    if( master_pid == getpid() &&
+        (is_exiting == FALSE || exit_strategy != FORK) )
+    {
+        /* Only if we're the last copy. In fork mode, once
+         * we've started exiting there's a next copy running
+         * (or we would have rolled back), and it's in charge. */
+        impl_notify("STOPPING=1");
+    }
+
+    impl_gen_release();
     libc.exit(status);
 }
 
 static pid_t
-do_wait(void *status)
+do_wait(int *status)
 {
     pid_t rval = libc.wait(status);
     L();
@@ -1491,26 +6004,6 @@ do_waitpid(pid_t pid, int *status, int options)
     return rval;
 }
 
-static long
-do_syscall(long number, long a1, long a2, long a3, long a4, long a5, long a6)
-{
-    /* This is very annoying.
-     * Unfortunately, it looks like uv in nodejs uses
-     * the syscall() function to directly call accept4.
-     * Why? I don't know.
-     * Anyways, this function is used internally within
-     * libc, but we won't intercept any of those calls.
-     * So performance isn't a critical concern here, but
-     * we need to intercept syscall() for node.js. */
-
-    if( unlikely(number == SYS_accept4) )
-    {
-        return do_accept4((int)a1, (struct sockaddr*)a2, (socklen_t*)a3, (int)a4);
-    }
-
-    return libc.syscall(number, a1, a2, a3, a4, a5, a6);
-}
-
 static int
 do_epoll_create1(int flags)
 {
@@ -1529,17 +6022,180 @@ do_epoll_create(int size)
     return do_epoll_create1(0);
 }
 
+/* Raw system calls.
+ * Some runtimes (uv in nodejs, for example) use the syscall()
+ * function to directly call accept4() and friends. This function
+ * is also used internally within libc, but we won't intercept any
+ * of those calls. Each call we care about is mapped through to
+ * the same do_* implementation as the libc function, and numbers
+ * are taken from the system headers so this works for whatever
+ * architecture we are built for. Anything not in the table (or
+ * out of range) goes straight through with a single check. */
+typedef long (*syscall_fn_t)(long a1, long a2, long a3, long a4, long a5, long a6);
+
+#define SYSCALL_FN(name, call)                          \
+static long                                             \
+sys_##name(long a1, long a2, long a3, long a4, long a5, long a6) \
+{                                                       \
+    return (long)(call);                                \
+}
+
+SYSCALL_FN(bind, do_bind((int)a1, (const struct sockaddr*)a2, (socklen_t)a3))
+SYSCALL_FN(listen, do_listen((int)a1, (int)a2))
+SYSCALL_FN(accept, do_accept4((int)a1, (struct sockaddr*)a2, (socklen_t*)a3, 0))
+SYSCALL_FN(accept4, do_accept4((int)a1, (struct sockaddr*)a2, (socklen_t*)a3, (int)a4))
+SYSCALL_FN(close, do_close((int)a1))
+SYSCALL_FN(dup, do_dup((int)a1))
+SYSCALL_FN(dup2, do_dup2((int)a1, (int)a2))
+SYSCALL_FN(dup3, do_dup3((int)a1, (int)a2, (int)a3))
+SYSCALL_FN(fcntl, do_fcntl((int)a1, (int)a2, (void*)a3))
+SYSCALL_FN(unlink, do_unlink((const char*)a1))
+SYSCALL_FN(unlinkat, do_unlinkat((int)a1, (const char*)a2, (int)a3))
+SYSCALL_FN(close_range, do_close_range((unsigned int)a1, (unsigned int)a2, (int)a3))
+SYSCALL_FN(epoll_create, do_epoll_create((int)a1))
+SYSCALL_FN(epoll_create1, do_epoll_create1((int)a1))
+SYSCALL_FN(fork, do_fork())
+
+/* The raw clone() returns twice like fork(), so it can be
+ * handled the same way when it makes a copy (see do_clone()).
+ * For clone3() the flags are the first field of the struct. */
+static long
+sys_clone_common(long number, unsigned long flags,
+                 long a1, long a2, long a3, long a4, long a5, long a6)
+{
+    long res = -1;
+    sigset_t set;
+
+    if( flags & CLONE_VM )
+    {
+        return libc.syscall(number, a1, a2, a3, a4, a5, a6);
+    }
+
+    DEBUG("do_syscall(%ld, %lx) ...", number, flags);
+    impl_fork_enter(&set);
+    res = libc.syscall(number, a1, a2, a3, a4, a5, a6);
+    impl_fork_leave((pid_t)res, &set);
+    DEBUG("do_syscall(%ld, %lx) => %ld", number, flags, res);
+    return res;
+}
+
+#ifdef SYS_clone
+static long
+sys_clone(long a1, long a2, long a3, long a4, long a5, long a6)
+{
+    return sys_clone_common(SYS_clone, (unsigned long)a1, a1, a2, a3, a4, a5, a6);
+}
+#endif
+
+#ifdef SYS_clone3
+static long
+sys_clone3(long a1, long a2, long a3, long a4, long a5, long a6)
+{
+    unsigned long flags = 0;
+    if( a1 != 0 && (size_t)a2 >= sizeof(uint64_t) )
+    {
+        flags = (unsigned long)*(const uint64_t*)a1;
+    }
+    return sys_clone_common(SYS_clone3, flags, a1, a2, a3, a4, a5, a6);
+}
+#endif
+
+#define SYSCALL_MAX (512)
+
+static const syscall_fn_t syscall_table[SYSCALL_MAX] =
+{
+#ifdef SYS_bind
+    [SYS_bind] = sys_bind,
+#endif
+#ifdef SYS_listen
+    [SYS_listen] = sys_listen,
+#endif
+#ifdef SYS_accept
+    [SYS_accept] = sys_accept,
+#endif
+#ifdef SYS_accept4
+    [SYS_accept4] = sys_accept4,
+#endif
+#ifdef SYS_close
+    [SYS_close] = sys_close,
+#endif
+#ifdef SYS_dup
+    [SYS_dup] = sys_dup,
+#endif
+#ifdef SYS_dup2
+    [SYS_dup2] = sys_dup2,
+#endif
+#ifdef SYS_dup3
+    [SYS_dup3] = sys_dup3,
+#endif
+#ifdef SYS_fcntl
+    [SYS_fcntl] = sys_fcntl,
+#endif
+#ifdef SYS_fcntl64
+    [SYS_fcntl64] = sys_fcntl,
+#endif
+#ifdef SYS_unlink
+    [SYS_unlink] = sys_unlink,
+#endif
+#ifdef SYS_unlinkat
+    [SYS_unlinkat] = sys_unlinkat,
+#endif
+#ifdef SYS_close_range
+    [SYS_close_range] = sys_close_range,
+#endif
+#ifdef SYS_epoll_create
+    [SYS_epoll_create] = sys_epoll_create,
+#endif
+#ifdef SYS_epoll_create1
+    [SYS_epoll_create1] = sys_epoll_create1,
+#endif
+#ifdef SYS_fork
+    [SYS_fork] = sys_fork,
+#endif
+#ifdef SYS_clone
+    [SYS_clone] = sys_clone,
+#endif
+#ifdef SYS_clone3
+    [SYS_clone3] = sys_clone3,
+#endif
+};
+
+static long
+do_syscall(long number, long a1, long a2, long a3, long a4, long a5, long a6)
+{
+    syscall_fn_t fn = NULL;
+
+    if( (unsigned long)number < SYSCALL_MAX )
+    {
+        fn = syscall_table[number];
+    }
+    if( unlikely(fn != NULL) )
+    {
+        return fn(a1, a2, a3, a4, a5, a6);
+    }
+
+    return libc.syscall(number, a1, a2, a3, a4, a5, a6);
+}
+
 funcs_t impl =
 {
     .bind = do_bind,
     .listen = do_listen,
+    .setsockopt = do_setsockopt,
     .accept = do_accept_retry,
     .accept4 = do_accept4_retry,
     .close = do_close,
+    .close_range = do_close_range,
+    .closefrom = do_closefrom,
     .fork = do_fork,
+    .clone = (clone_t)do_clone,
     .dup = do_dup,
     .dup2 = do_dup2,
     .dup3 = do_dup3,
+    .fcntl = do_fcntl,
+    .fcntl64 = do_fcntl64,
+    .unlink = do_unlink,
+    .unlinkat = do_unlinkat,
     .exit = do_exit,
     .wait = do_wait,
     .waitpid = do_waitpid,
@@ -24,9 +24,28 @@
 
 #include "funcs.h"
 
+/* We provide the public API, so it's not weak here. */
+#define HUPTIME_WEAK
+#include "../include/libhuptime.h"
+
 /* Our initialization routine. */
 extern void impl_init();
 
+/* The public API (see libhuptime.h). */
+extern int impl_handoff(int fd, const void *state, size_t len);
+extern int impl_adopt(huptime_adopt_t cb, void *data);
+extern int impl_ready(void);
+extern int impl_is_draining(void);
+extern int impl_drain_fd(void);
+extern int impl_hook(int event, huptime_hook_t fn, void *data);
+extern int impl_generation(void);
+extern int impl_region_register(const char *name, int fd);
+extern void* impl_region_map(const char *name, size_t *size);
+extern int impl_listener_stats(int fd, struct huptime_listener_stats *stats);
+extern int impl_listener_deadline(int fd, int seconds);
+extern int impl_listener_drain(int fd, int seconds);
+extern int impl_generations(struct huptime_generation_info *gens, int max);
+
 /* The internal impementations. */
 extern funcs_t impl;
 extern funcs_t libc;
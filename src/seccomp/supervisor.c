@@ -0,0 +1,1542 @@
+/*
+ * supervisor.c
+ *
+ * Copyright 2013 Adin Scannell <adin@scannell.ca>, all rights reserved.
+ *
+ * This file is part of Huptime.
+ *
+ * Huptime is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Huptime is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Huptime.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * The seccomp engine.
+ *
+ * Statically linked programs (go, for example) make system calls
+ * directly, so the LD_PRELOAD stubs never see them. Instead, we run
+ * the program under a seccomp filter that hands the handful of calls
+ * we care about (bind, listen, accept, close, dup, fork & friends) to
+ * this supervisor via SECCOMP_RET_USER_NOTIF. Everything else runs
+ * without any interference at all.
+ *
+ * The supervisor keeps a copy of every BOUND socket, and keeps a
+ * table of BOUND and TRACKED descriptors for every process in every
+ * generation, much like impl.c does in-process. Accepts on BOUND
+ * sockets are done here and the result is injected into the target
+ * with SECCOMP_IOCTL_NOTIF_ADDFD, so we know exactly which descriptors
+ * have to be closed before a generation is finished.
+ *
+ * Requires Linux 5.14 or later (SECCOMP_ADDFD_FLAG_SEND).
+ */
+
+#include "../fdinfo.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <signal.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <poll.h>
+#include <sched.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/uio.h>
+#include <sys/ioctl.h>
+#include <sys/prctl.h>
+#include <sys/signalfd.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <linux/audit.h>
+#include <linux/filter.h>
+#include <linux/seccomp.h>
+
+#ifndef __x86_64__
+#error "The seccomp engine only supports x86_64."
+#endif
+
+#ifndef SECCOMP_FILTER_FLAG_WAIT_KILLABLE_RECV
+#define SECCOMP_FILTER_FLAG_WAIT_KILLABLE_RECV (1UL << 5)
+#endif
+
+#define CLONE_FLAGS_FILES 0x00000400 /* CLONE_FILES */
+
+typedef enum
+{
+    FORK = 1,
+    EXEC = 2,
+} exit_strategy_t;
+
+typedef enum
+{
+    FALSE = 0,
+    TRUE = 1,
+} bool_t;
+
+/* An entry in a per-process descriptor table.
+ * We remember the inode so that we can notice when
+ * the descriptor has gone away behind our back (i.e.
+ * close-on-exec, which we never see). */
+typedef struct fdentry
+{
+    fdinfo_t *info;
+    ino_t ino;
+} fdentry_t;
+
+struct generation;
+
+typedef struct process
+{
+    pid_t pid;
+    int pidfd;
+    struct generation *gen;
+    fdentry_t *fds;
+    int size;
+    struct process *next;
+} process_t;
+
+typedef struct generation
+{
+    int id;
+    int notify_fd;
+    pid_t leader;
+    bool_t leader_exited;
+    int leader_status;
+    bool_t draining;
+    bool_t finished;
+
+    /* Total TRACKED entries across all processes. */
+    int tracked;
+
+    /* Bumped for every fork() or clone(). See thread_t. */
+    unsigned long clones;
+
+    process_t *procs;
+    struct generation *next;
+} generation_t;
+
+/* The process that a thread belongs to. Reading this from /proc
+ * for every trapped call would be far too slow (close() is one
+ * of them), so we remember it. A thread id can only be reused
+ * once a new thread has been created, which we always hear about
+ * (see do_clone()), so entries are good until the next one. */
+typedef struct thread
+{
+    pid_t tid;
+    struct process *proc;
+    unsigned long clones;
+    struct thread *next;
+} thread_t;
+
+#define THREAD_BUCKETS (256)
+
+typedef struct listener
+{
+    fdinfo_t *info;
+    int fd;
+    ino_t ino;
+    struct listener *next;
+} listener_t;
+
+/* An accept() which is waiting for a connection. */
+typedef struct pending
+{
+    generation_t *gen;
+    process_t *proc;
+    listener_t *listener;
+    __u64 id;
+    int flags;
+    __u64 addr;
+    __u64 addrlen;
+    struct pending *next;
+} pending_t;
+
+/* A copy of a descriptor table at fork() time. */
+typedef struct snapshot
+{
+    pid_t parent;
+    fdentry_t *fds;
+    int size;
+    struct snapshot *next;
+} snapshot_t;
+
+static exit_strategy_t exit_strategy = FORK;
+static bool_t multi_mode = FALSE;
+static bool_t revive_mode = FALSE;
+static bool_t debug_enabled = FALSE;
+static char *to_unlink = NULL;
+static char **target_args = NULL;
+
+static generation_t *generations = NULL;
+static generation_t *active = NULL;
+static listener_t *listeners = NULL;
+static pending_t *pendings = NULL;
+static snapshot_t *snapshots = NULL;
+static thread_t *threads[THREAD_BUCKETS];
+static int next_generation = 1;
+static bool_t stopping = FALSE;
+static int exit_status = 0;
+
+static struct seccomp_notif_sizes sizes;
+static sigset_t orig_mask;
+
+#define DEBUG(fmt, args...)                                                  \
+    do {                                                                     \
+        if( debug_enabled == TRUE )                                          \
+        {                                                                    \
+            fprintf(stderr, "huptime-seccomp %d: " fmt "\n", getpid(), ## args); \
+            fflush(stderr);                                                  \
+        }                                                                    \
+    } while(0)
+
+/* The system calls we trap. */
+static const int trapped[] =
+{
+    SYS_bind,
+    SYS_listen,
+    SYS_accept,
+    SYS_accept4,
+    SYS_close,
+    SYS_dup,
+    SYS_dup2,
+    SYS_dup3,
+    SYS_fork,
+    SYS_vfork,
+    SYS_clone,
+    SYS_clone3,
+    SYS_exit_group,
+};
+#define NTRAPPED ((int)(sizeof(trapped) / sizeof(trapped[0])))
+
+static int
+install_filter(void)
+{
+    /* Foreign architectures and x32 calls are allowed
+     * through; go binaries only ever use the native ABI. */
+    struct sock_filter filter[4 + NTRAPPED + 2];
+    int n = 0;
+
+    filter[n++] = (struct sock_filter)BPF_STMT(BPF_LD|BPF_W|BPF_ABS,
+        offsetof(struct seccomp_data, arch));
+    filter[n++] = (struct sock_filter)BPF_JUMP(BPF_JMP|BPF_JEQ|BPF_K,
+        AUDIT_ARCH_X86_64, 0, NTRAPPED + 2);
+    filter[n++] = (struct sock_filter)BPF_STMT(BPF_LD|BPF_W|BPF_ABS,
+        offsetof(struct seccomp_data, nr));
+    filter[n++] = (struct sock_filter)BPF_JUMP(BPF_JMP|BPF_JGE|BPF_K,
+        0x40000000, NTRAPPED, 0);
+    for( int i = 0; i < NTRAPPED; i += 1 )
+    {
+        filter[n++] = (struct sock_filter)BPF_JUMP(BPF_JMP|BPF_JEQ|BPF_K,
+            trapped[i], NTRAPPED - i, 0);
+    }
+    filter[n++] = (struct sock_filter)BPF_STMT(BPF_RET|BPF_K,
+        SECCOMP_RET_ALLOW);
+    filter[n++] = (struct sock_filter)BPF_STMT(BPF_RET|BPF_K,
+        SECCOMP_RET_USER_NOTIF);
+
+    struct sock_fprog prog = {
+        .len = (unsigned short)n,
+        .filter = filter,
+    };
+
+    if( prctl(PR_SET_NO_NEW_PRIVS, 1, 0, 0, 0) < 0 )
+    {
+        return -1;
+    }
+
+    /* We'd rather non-fatal signals not interrupt a call that
+     * we have already received (i.e. a parked accept()), but
+     * this flag is only available from Linux 5.19. */
+    int fd = syscall(SYS_seccomp, SECCOMP_SET_MODE_FILTER,
+        SECCOMP_FILTER_FLAG_NEW_LISTENER |
+        SECCOMP_FILTER_FLAG_WAIT_KILLABLE_RECV, &prog);
+    if( fd < 0 && errno == EINVAL )
+    {
+        fd = syscall(SYS_seccomp, SECCOMP_SET_MODE_FILTER,
+            SECCOMP_FILTER_FLAG_NEW_LISTENER, &prog);
+    }
+    return fd;
+}
+
+static int
+send_fd(int sock, int fd)
+{
+    char dummy = 'F';
+    struct iovec iov = { .iov_base = &dummy, .iov_len = 1 };
+    char buf[CMSG_SPACE(sizeof(int))];
+    struct msghdr msg;
+
+    memset(&msg, 0, sizeof(msg));
+    memset(buf, 0, sizeof(buf));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = buf;
+    msg.msg_controllen = sizeof(buf);
+
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+
+    return sendmsg(sock, &msg, 0) == 1 ? 0 : -1;
+}
+
+static int
+recv_fd(int sock)
+{
+    char dummy;
+    struct iovec iov = { .iov_base = &dummy, .iov_len = 1 };
+    char buf[CMSG_SPACE(sizeof(int))];
+    struct msghdr msg;
+    int fd = -1;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = buf;
+    msg.msg_controllen = sizeof(buf);
+
+    if( recvmsg(sock, &msg, MSG_CMSG_CLOEXEC) != 1 )
+    {
+        return -1;
+    }
+
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    if( cmsg == NULL ||
+        cmsg->cmsg_level != SOL_SOCKET ||
+        cmsg->cmsg_type != SCM_RIGHTS )
+    {
+        return -1;
+    }
+    memcpy(&fd, CMSG_DATA(cmsg), sizeof(int));
+    return fd;
+}
+
+static void
+spawn_generation(void)
+{
+    int sv[2];
+
+    if( socketpair(AF_UNIX, SOCK_STREAM|SOCK_CLOEXEC, 0, sv) < 0 )
+    {
+        fprintf(stderr, "huptime-seccomp: socketpair: %s\n", strerror(errno));
+        exit(1);
+    }
+
+    pid_t child = fork();
+    if( child < 0 )
+    {
+        fprintf(stderr, "huptime-seccomp: fork: %s\n", strerror(errno));
+        exit(1);
+    }
+    if( child == 0 )
+    {
+        /* Install the filter and hand the listener back.
+         * Note that we can't close anything after this point
+         * without the supervisor having the listener, so we
+         * rely on close-on-exec for our socket. */
+        close(sv[0]);
+        sigprocmask(SIG_SETMASK, &orig_mask, NULL);
+        int notify_fd = install_filter();
+        if( notify_fd < 0 || send_fd(sv[1], notify_fd) < 0 )
+        {
+            fprintf(stderr, "huptime-seccomp: unable to install filter: %s\n",
+                strerror(errno));
+            _exit(1);
+        }
+        execvp(target_args[0], target_args);
+        fprintf(stderr, "huptime-seccomp: %s: %s\n",
+            target_args[0], strerror(errno));
+        _exit(1);
+    }
+
+    close(sv[1]);
+    int notify_fd = recv_fd(sv[0]);
+    close(sv[0]);
+    if( notify_fd < 0 )
+    {
+        fprintf(stderr, "huptime-seccomp: no listener from child?\n");
+        kill(child, SIGKILL);
+        waitpid(child, NULL, 0);
+        exit(1);
+    }
+
+    generation_t *gen = (generation_t*)calloc(1, sizeof(generation_t));
+    gen->id = next_generation++;
+    gen->notify_fd = notify_fd;
+    gen->leader = child;
+    gen->next = generations;
+    generations = gen;
+    active = gen;
+
+    DEBUG("Started generation %d (pid %d).", gen->id, child);
+}
+
+static int
+notif_valid(generation_t *gen, __u64 id)
+{
+    return ioctl(gen->notify_fd, SECCOMP_IOCTL_NOTIF_ID_VALID, &id) == 0;
+}
+
+static void
+notif_respond(generation_t *gen, __u64 id, long val, int error, int flags)
+{
+    struct seccomp_notif_resp *resp = alloca(sizes.seccomp_notif_resp);
+    memset(resp, 0, sizes.seccomp_notif_resp);
+    resp->id = id;
+    resp->val = val;
+    resp->error = error ? -error : 0;
+    resp->flags = flags;
+
+    /* This fails if the target was interrupted,
+     * which is fine -- it will simply try again. */
+    if( ioctl(gen->notify_fd, SECCOMP_IOCTL_NOTIF_SEND, resp) < 0 )
+    {
+        DEBUG("Response for %llu dropped: %s",
+            (unsigned long long)id, strerror(errno));
+    }
+}
+
+static void
+notif_continue(generation_t *gen, __u64 id)
+{
+    /* This is safe for everything we trap, since we never
+     * make any security decisions based on the arguments. */
+    notif_respond(gen, id, 0, 0, SECCOMP_USER_NOTIF_FLAG_CONTINUE);
+}
+
+static int
+notif_addfd(generation_t *gen, __u64 id, int srcfd, int newfd, int cloexec, bool_t send)
+{
+    struct seccomp_notif_addfd addfd;
+    memset(&addfd, 0, sizeof(addfd));
+    addfd.id = id;
+    addfd.srcfd = srcfd;
+    addfd.newfd = newfd >= 0 ? newfd : 0;
+    addfd.newfd_flags = cloexec ? O_CLOEXEC : 0;
+    addfd.flags = (newfd >= 0 ? SECCOMP_ADDFD_FLAG_SETFD : 0) |
+                  (send ? SECCOMP_ADDFD_FLAG_SEND : 0);
+    return ioctl(gen->notify_fd, SECCOMP_IOCTL_NOTIF_ADDFD, &addfd);
+}
+
+static int
+read_target(pid_t pid, __u64 addr, void *buf, size_t len)
+{
+    struct iovec local = { .iov_base = buf, .iov_len = len };
+    struct iovec remote = { .iov_base = (void*)(uintptr_t)addr, .iov_len = len };
+    return process_vm_readv(pid, &local, 1, &remote, 1, 0) == (ssize_t)len ? 0 : -1;
+}
+
+static int
+write_target(pid_t pid, __u64 addr, const void *buf, size_t len)
+{
+    struct iovec local = { .iov_base = (void*)buf, .iov_len = len };
+    struct iovec remote = { .iov_base = (void*)(uintptr_t)addr, .iov_len = len };
+    return process_vm_writev(pid, &local, 1, &remote, 1, 0) == (ssize_t)len ? 0 : -1;
+}
+
+static pid_t
+read_status_field(pid_t pid, const char *field)
+{
+    char path[64];
+    char line[256];
+    pid_t result = (pid_t)-1;
+    size_t len = strlen(field);
+
+    snprintf(path, sizeof(path), "/proc/%d/status", pid);
+    FILE *f = fopen(path, "r");
+    if( f == NULL )
+    {
+        return (pid_t)-1;
+    }
+    while( fgets(line, sizeof(line), f) != NULL )
+    {
+        if( !strncmp(line, field, len) && line[len] == ':' )
+        {
+            result = (pid_t)strtol(&line[len+1], NULL, 10);
+            break;
+        }
+    }
+    fclose(f);
+    return result;
+}
+
+static ino_t
+target_ino(pid_t pid, int fd)
+{
+    char path[64];
+    struct stat st;
+    snprintf(path, sizeof(path), "/proc/%d/fd/%d", pid, fd);
+    if( stat(path, &st) < 0 )
+    {
+        return (ino_t)0;
+    }
+    return st.st_ino;
+}
+
+static void
+entry_set(process_t *proc, int fd, fdinfo_t *info, ino_t ino)
+{
+    if( fd >= proc->size )
+    {
+        int size = proc->size ? proc->size : 16;
+        while( fd >= size )
+        {
+            size *= 2;
+        }
+        proc->fds = (fdentry_t*)realloc(proc->fds, sizeof(fdentry_t) * size);
+        memset(&proc->fds[proc->size], 0,
+            sizeof(fdentry_t) * (size - proc->size));
+        proc->size = size;
+    }
+
+    inc_ref(info);
+    proc->fds[fd].info = info;
+    proc->fds[fd].ino = ino;
+    if( info->type == TRACKED )
+    {
+        proc->gen->tracked += 1;
+    }
+}
+
+static void
+entry_clear(process_t *proc, int fd)
+{
+    if( fd < 0 || fd >= proc->size || proc->fds[fd].info == NULL )
+    {
+        return;
+    }
+    if( proc->fds[fd].info->type == TRACKED )
+    {
+        proc->gen->tracked -= 1;
+    }
+    dec_ref(proc->fds[fd].info);
+    proc->fds[fd].info = NULL;
+    proc->fds[fd].ino = 0;
+}
+
+static fdinfo_t*
+entry_lookup(process_t *proc, int fd)
+{
+    if( fd < 0 || fd >= proc->size )
+    {
+        return NULL;
+    }
+    return proc->fds[fd].info;
+}
+
+static fdinfo_t*
+entry_lookup_valid(process_t *proc, int fd)
+{
+    /* Check that the entry still refers to the same file.
+     * This will catch descriptors that went away across
+     * an exec() or via some call that we don't trap. */
+    fdinfo_t *info = entry_lookup(proc, fd);
+    if( info != NULL && target_ino(proc->pid, fd) != proc->fds[fd].ino )
+    {
+        DEBUG("Stale entry %d in %d.", fd, proc->pid);
+        entry_clear(proc, fd);
+        return NULL;
+    }
+    return info;
+}
+
+static listener_t*
+listener_for(fdinfo_t *info)
+{
+    for( listener_t *l = listeners; l != NULL; l = l->next )
+    {
+        if( l->info == info )
+        {
+            return l;
+        }
+    }
+    return NULL;
+}
+
+static void
+pending_drop(pending_t *p)
+{
+    pending_t **pp = &pendings;
+    while( *pp != NULL )
+    {
+        if( *pp == p )
+        {
+            *pp = p->next;
+            free(p);
+            return;
+        }
+        pp = &(*pp)->next;
+    }
+}
+
+static thread_t*
+thread_find(pid_t tid)
+{
+    for( thread_t *t = threads[tid % THREAD_BUCKETS]; t != NULL; t = t->next )
+    {
+        if( t->tid == tid )
+        {
+            return t;
+        }
+    }
+    return NULL;
+}
+
+static void
+thread_set(pid_t tid, process_t *proc)
+{
+    thread_t *t = thread_find(tid);
+    if( t == NULL )
+    {
+        t = (thread_t*)calloc(1, sizeof(thread_t));
+        t->tid = tid;
+        t->next = threads[tid % THREAD_BUCKETS];
+        threads[tid % THREAD_BUCKETS] = t;
+    }
+    t->proc = proc;
+    t->clones = proc->gen->clones;
+}
+
+static void
+thread_drop(process_t *proc)
+{
+    for( int i = 0; i < THREAD_BUCKETS; i += 1 )
+    {
+        thread_t **tp = &threads[i];
+        while( *tp != NULL )
+        {
+            thread_t *t = *tp;
+            if( t->proc == proc )
+            {
+                *tp = t->next;
+                free(t);
+                continue;
+            }
+            tp = &t->next;
+        }
+    }
+}
+
+static void
+process_free(process_t *proc)
+{
+    generation_t *gen = proc->gen;
+
+    DEBUG("Process %d (generation %d) has exited.", proc->pid, gen->id);
+
+    for( int fd = 0; fd < proc->size; fd += 1 )
+    {
+        entry_clear(proc, fd);
+    }
+    free(proc->fds);
+    if( proc->pidfd >= 0 )
+    {
+        close(proc->pidfd);
+    }
+    thread_drop(proc);
+
+    for( pending_t *p = pendings; p != NULL; )
+    {
+        pending_t *next = p->next;
+        if( p->proc == proc )
+        {
+            pending_drop(p);
+        }
+        p = next;
+    }
+
+    process_t **pp = &gen->procs;
+    while( *pp != NULL )
+    {
+        if( *pp == proc )
+        {
+            *pp = proc->next;
+            break;
+        }
+        pp = &(*pp)->next;
+    }
+    free(proc);
+}
+
+static process_t*
+process_get(generation_t *gen, pid_t tid)
+{
+    thread_t *t = thread_find(tid);
+    if( t != NULL && t->proc->gen == gen && t->clones == gen->clones )
+    {
+        return t->proc;
+    }
+
+    pid_t tgid = read_status_field(tid, "Tgid");
+    if( tgid <= 0 )
+    {
+        return NULL;
+    }
+
+    for( process_t *proc = gen->procs; proc != NULL; proc = proc->next )
+    {
+        if( proc->pid == tgid )
+        {
+            thread_set(tid, proc);
+            return proc;
+        }
+    }
+
+    /* This is a new process. Find the table that
+     * its parent had when it forked, if we have one. */
+    process_t *proc = (process_t*)calloc(1, sizeof(process_t));
+    proc->pid = tgid;
+    proc->gen = gen;
+    proc->pidfd = syscall(SYS_pidfd_open, tgid, 0);
+    proc->next = gen->procs;
+    gen->procs = proc;
+
+    pid_t parent = read_status_field(tgid, "PPid");
+    snapshot_t **sp = &snapshots;
+    snapshot_t *found = NULL;
+    snapshot_t **found_p = NULL;
+    while( *sp != NULL )
+    {
+        /* The oldest snapshot is the last in the list. */
+        if( (*sp)->parent == parent )
+        {
+            found = *sp;
+            found_p = sp;
+        }
+        sp = &(*sp)->next;
+    }
+    if( found != NULL )
+    {
+        *found_p = found->next;
+        for( int fd = 0; fd < found->size; fd += 1 )
+        {
+            if( found->fds[fd].info != NULL )
+            {
+                entry_set(proc, fd, found->fds[fd].info, found->fds[fd].ino);
+                dec_ref(found->fds[fd].info);
+            }
+        }
+        free(found->fds);
+        free(found);
+    }
+
+    DEBUG("New process %d (generation %d, parent %d).", tgid, gen->id, parent);
+    thread_set(tid, proc);
+    return proc;
+}
+
+static void
+process_snapshot(process_t *proc)
+{
+    snapshot_t *snap = (snapshot_t*)calloc(1, sizeof(snapshot_t));
+    snap->parent = proc->pid;
+    snap->size = proc->size;
+    snap->fds = (fdentry_t*)calloc(proc->size ? proc->size : 1, sizeof(fdentry_t));
+    for( int fd = 0; fd < proc->size; fd += 1 )
+    {
+        if( proc->fds[fd].info != NULL )
+        {
+            inc_ref(proc->fds[fd].info);
+            snap->fds[fd] = proc->fds[fd];
+        }
+    }
+    snap->next = snapshots;
+    snapshots = snap;
+}
+
+static void
+do_bind(generation_t *gen, process_t *proc, struct seccomp_notif *req)
+{
+    int sockfd = (int)req->data.args[0];
+    socklen_t addrlen = (socklen_t)req->data.args[2];
+    struct sockaddr_storage addr;
+
+    if( addrlen > sizeof(addr) ||
+        read_target(req->pid, req->data.args[1], &addr, addrlen) < 0 ||
+        !notif_valid(gen, req->id) )
+    {
+        notif_continue(gen, req->id);
+        return;
+    }
+
+    /* Grab a copy of their socket. It's the same open file,
+     * so if we bind it here, it's exactly as if they had done
+     * it themselves. */
+    int fd = syscall(SYS_pidfd_getfd, proc->pidfd, sockfd, 0);
+    if( fd < 0 )
+    {
+        notif_respond(gen, req->id, 0, errno, 0);
+        return;
+    }
+
+    /* Internet datagram sockets are matched separately. */
+    int type = 0;
+    socklen_t typelen = sizeof(type);
+    if( getsockopt(fd, SOL_SOCKET, SO_TYPE, &type, &typelen) < 0 )
+    {
+        type = 0;
+    }
+    int is_dgram = (type == SOCK_DGRAM &&
+                    (addr.ss_family == AF_INET ||
+                     addr.ss_family == AF_INET6));
+
+    /* See if this socket already exists (as per impl.c). */
+    for( listener_t *l = listeners; l != NULL; l = l->next )
+    {
+        if( info_match(l->info, (struct sockaddr*)&addr, addrlen, is_dgram) )
+        {
+            DEBUG("Found ghost for %d in %d, cloning...", sockfd, proc->pid);
+            close(fd);
+            if( notif_addfd(gen, req->id, l->fd, sockfd, 0, FALSE) < 0 )
+            {
+                notif_respond(gen, req->id, 0, errno, 0);
+                return;
+            }
+            entry_clear(proc, sockfd);
+            entry_set(proc, sockfd, l->info, l->ino);
+            notif_respond(gen, req->id, 0, 0, 0);
+            return;
+        }
+    }
+
+    if( multi_mode == TRUE )
+    {
+        int optval = 1;
+        setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &optval, sizeof(optval));
+    }
+
+    /* Relative unix socket paths are relative to the target. */
+    int cwd = -1;
+    if( addr.ss_family == AF_UNIX )
+    {
+        char path[64];
+        snprintf(path, sizeof(path), "/proc/%d/cwd", proc->pid);
+        cwd = open(".", O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+        if( chdir(path) < 0 )
+        {
+            DEBUG("Unable to follow cwd of %d.", proc->pid);
+        }
+    }
+    int rval = bind(fd, (struct sockaddr*)&addr, addrlen);
+    int err = errno;
+    if( cwd >= 0 )
+    {
+        fchdir(cwd);
+        close(cwd);
+    }
+    if( rval < 0 )
+    {
+        close(fd);
+        notif_respond(gen, req->id, 0, err, 0);
+        DEBUG("do_bind(%d) in %d => %s", sockfd, proc->pid, strerror(err));
+        return;
+    }
+
+    struct stat st;
+    fstat(fd, &st);
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+
+    listener_t *l = (listener_t*)calloc(1, sizeof(listener_t));
+    l->info = alloc_info(BOUND);
+    l->info->bound.addr = (struct sockaddr*)malloc(addrlen);
+    l->info->bound.addrlen = addrlen;
+    l->info->bound.is_dgram = is_dgram;
+    memcpy(l->info->bound.addr, &addr, addrlen);
+    l->fd = fd;
+    l->ino = st.st_ino;
+    l->next = listeners;
+    listeners = l;
+
+    entry_clear(proc, sockfd);
+    entry_set(proc, sockfd, l->info, l->ino);
+    notif_respond(gen, req->id, 0, 0, 0);
+    DEBUG("do_bind(%d) in %d => 0", sockfd, proc->pid);
+}
+
+static void
+do_listen(generation_t *gen, process_t *proc, struct seccomp_notif *req)
+{
+    int sockfd = (int)req->data.args[0];
+    fdinfo_t *info = entry_lookup_valid(proc, sockfd);
+    listener_t *l = NULL;
+
+    if( info == NULL || info->type != BOUND ||
+        (l = listener_for(info)) == NULL )
+    {
+        notif_continue(gen, req->id);
+        return;
+    }
+
+    if( !info->bound.real_listened )
+    {
+        /* See the note in impl.c on the backlog. */
+        if( listen(l->fd, SOMAXCONN) < 0 )
+        {
+            notif_respond(gen, req->id, 0, errno, 0);
+            return;
+        }
+        info->bound.real_listened = 1;
+    }
+    info->bound.stub_listened = 1;
+    notif_respond(gen, req->id, 0, 0, 0);
+}
+
+static bool_t
+try_accept(pending_t *p)
+{
+    generation_t *gen = p->gen;
+    listener_t *l = p->listener;
+
+    if( gen->draining == TRUE )
+    {
+        /* As per impl.c, we never give back new clients
+         * once we've started exiting. Non-blocking callers
+         * get EAGAIN and blocking callers wait forever. */
+        if( fcntl(l->fd, F_GETFL) & O_NONBLOCK )
+        {
+            notif_respond(gen, p->id, 0, EAGAIN, 0);
+            return TRUE;
+        }
+        return FALSE;
+    }
+
+    struct pollfd pfd = { .fd = l->fd, .events = POLLIN, .revents = 0 };
+    if( poll(&pfd, 1, 0) <= 0 )
+    {
+        if( fcntl(l->fd, F_GETFL) & O_NONBLOCK )
+        {
+            notif_respond(gen, p->id, 0, EAGAIN, 0);
+            return TRUE;
+        }
+        return FALSE;
+    }
+
+    struct sockaddr_storage addr;
+    socklen_t addrlen = sizeof(addr);
+    int fd = accept4(l->fd, (struct sockaddr*)&addr, &addrlen,
+        SOCK_CLOEXEC | (p->flags & SOCK_NONBLOCK));
+    if( fd < 0 )
+    {
+        if( errno == EAGAIN || errno == EINTR )
+        {
+            /* Someone else got there first. */
+            return try_accept(p);
+        }
+        notif_respond(gen, p->id, 0, errno, 0);
+        return TRUE;
+    }
+
+    /* Copy out the address, as accept() would have. */
+    if( p->addr != 0 && p->addrlen != 0 )
+    {
+        socklen_t len = 0;
+        if( read_target(p->proc->pid, p->addrlen, &len, sizeof(len)) == 0 )
+        {
+            write_target(p->proc->pid, p->addr, &addr,
+                len < addrlen ? len : addrlen);
+            write_target(p->proc->pid, p->addrlen, &addrlen, sizeof(addrlen));
+        }
+    }
+
+    struct stat st;
+    fstat(fd, &st);
+    int newfd = notif_addfd(gen, p->id, fd,
+        -1, p->flags & SOCK_CLOEXEC, TRUE);
+    close(fd);
+    if( newfd < 0 )
+    {
+        /* The caller went away. The connection is lost
+         * (as it would have been had they been killed). */
+        DEBUG("Unable to inject client into %d: %s",
+            p->proc->pid, strerror(errno));
+        return TRUE;
+    }
+
+    fdinfo_t *info = alloc_info(TRACKED);
+    inc_ref(l->info);
+    info->tracked.bound = l->info;
+    entry_clear(p->proc, newfd);
+    entry_set(p->proc, newfd, info, st.st_ino);
+    dec_ref(info);
+
+    DEBUG("do_accept4() in %d => %d (tracked %d)",
+        p->proc->pid, newfd, gen->tracked);
+    return TRUE;
+}
+
+static void
+do_accept4(generation_t *gen, process_t *proc, struct seccomp_notif *req, int flags)
+{
+    int sockfd = (int)req->data.args[0];
+    fdinfo_t *info = entry_lookup_valid(proc, sockfd);
+    listener_t *l = NULL;
+
+    if( info == NULL || info->type != BOUND ||
+        (l = listener_for(info)) == NULL )
+    {
+        notif_continue(gen, req->id);
+        return;
+    }
+    if( !info->bound.stub_listened )
+    {
+        notif_respond(gen, req->id, 0, EINVAL, 0);
+        return;
+    }
+
+    pending_t *p = (pending_t*)calloc(1, sizeof(pending_t));
+    p->gen = gen;
+    p->proc = proc;
+    p->listener = l;
+    p->id = req->id;
+    p->flags = flags;
+    p->addr = req->data.args[1];
+    p->addrlen = req->data.args[2];
+
+    if( try_accept(p) )
+    {
+        free(p);
+        return;
+    }
+
+    /* Park it until the listener is ready. */
+    p->next = pendings;
+    pendings = p;
+}
+
+static void
+do_dup3(generation_t *gen, process_t *proc, struct seccomp_notif *req, int nr)
+{
+    int fd = (int)req->data.args[0];
+    int fd2 = nr == SYS_dup ? -1 : (int)req->data.args[1];
+    int flags = nr == SYS_dup3 ? (int)req->data.args[2] : 0;
+    fdinfo_t *info = entry_lookup(proc, fd);
+
+    if( fd2 >= 0 && fd2 != fd )
+    {
+        /* Whatever was there is being closed. */
+        entry_clear(proc, fd2);
+    }
+    if( info == NULL || fd == fd2 )
+    {
+        notif_continue(gen, req->id);
+        return;
+    }
+
+    /* We need to know where the new descriptor ends up,
+     * so we do the dup ourselves and inject the result. */
+    int copy = syscall(SYS_pidfd_getfd, proc->pidfd, fd, 0);
+    if( copy < 0 )
+    {
+        notif_continue(gen, req->id);
+        return;
+    }
+    int newfd = notif_addfd(gen, req->id, copy, fd2, flags & O_CLOEXEC, TRUE);
+    close(copy);
+    if( newfd >= 0 )
+    {
+        /* For a plain dup(), this is the first we hear of the new
+         * descriptor. Anything we had for it is stale (see above). */
+        entry_clear(proc, newfd);
+        entry_set(proc, newfd, info, proc->fds[fd].ino);
+    }
+}
+
+static void
+do_clone(generation_t *gen, process_t *proc, struct seccomp_notif *req, int nr)
+{
+    __u64 flags = 0;
+
+    if( nr == SYS_clone )
+    {
+        flags = req->data.args[0];
+    }
+    else if( nr == SYS_clone3 )
+    {
+        /* The flags are the first member of clone_args. */
+        if( read_target(req->pid, req->data.args[0], &flags, sizeof(flags)) < 0 )
+        {
+            flags = 0;
+        }
+    }
+
+    /* Whatever thread id the child gets may be one
+     * that we have cached (see thread_t). */
+    gen->clones += 1;
+
+    if( !(flags & CLONE_FLAGS_FILES) )
+    {
+        /* The child gets a copy of the table. We pick it up
+         * the first time we hear from the child. */
+        process_snapshot(proc);
+    }
+    notif_continue(gen, req->id);
+}
+
+static void
+handle_notification(generation_t *gen)
+{
+    struct seccomp_notif *req = alloca(sizes.seccomp_notif);
+    memset(req, 0, sizes.seccomp_notif);
+
+    if( ioctl(gen->notify_fd, SECCOMP_IOCTL_NOTIF_RECV, req) < 0 )
+    {
+        return;
+    }
+
+    process_t *proc = process_get(gen, req->pid);
+    if( proc == NULL )
+    {
+        notif_continue(gen, req->id);
+        return;
+    }
+
+    switch( req->data.nr )
+    {
+        case SYS_bind:
+            do_bind(gen, proc, req);
+            break;
+        case SYS_listen:
+            do_listen(gen, proc, req);
+            break;
+        case SYS_accept:
+            do_accept4(gen, proc, req, 0);
+            break;
+        case SYS_accept4:
+            do_accept4(gen, proc, req, (int)req->data.args[3]);
+            break;
+        case SYS_close:
+            entry_clear(proc, (int)req->data.args[0]);
+            notif_continue(gen, req->id);
+            break;
+        case SYS_dup:
+        case SYS_dup2:
+        case SYS_dup3:
+            do_dup3(gen, proc, req, req->data.nr);
+            break;
+        case SYS_fork:
+        case SYS_vfork:
+        case SYS_clone:
+        case SYS_clone3:
+            do_clone(gen, proc, req, req->data.nr);
+            break;
+        case SYS_exit_group:
+            /* We'll clean up when the pidfd fires. */
+            notif_continue(gen, req->id);
+            break;
+        default:
+            notif_continue(gen, req->id);
+            break;
+    }
+}
+
+static void
+generation_reconcile(generation_t *gen)
+{
+    /* Drop anything that has disappeared without us seeing
+     * a close() (close-on-exec, or calls we don't trap). */
+    for( process_t *proc = gen->procs; proc != NULL; proc = proc->next )
+    {
+        for( int fd = 0; fd < proc->size; fd += 1 )
+        {
+            if( proc->fds[fd].info != NULL &&
+                proc->fds[fd].info->type == TRACKED )
+            {
+                entry_lookup_valid(proc, fd);
+            }
+        }
+    }
+}
+
+static void
+generation_free(generation_t *gen)
+{
+    DEBUG("Generation %d is finished.", gen->id);
+
+    while( gen->procs != NULL )
+    {
+        process_free(gen->procs);
+    }
+    close(gen->notify_fd);
+
+    generation_t **gp = &generations;
+    while( *gp != NULL )
+    {
+        if( *gp == gen )
+        {
+            *gp = gen->next;
+            break;
+        }
+        gp = &(*gp)->next;
+    }
+    if( active == gen )
+    {
+        active = NULL;
+    }
+    free(gen);
+}
+
+static void
+generation_check(generation_t *gen)
+{
+    if( gen->draining == TRUE && gen->tracked > 0 )
+    {
+        generation_reconcile(gen);
+    }
+    if( gen->draining == TRUE && gen->tracked == 0 && !gen->finished )
+    {
+        /* We're done. This is the equivalent of the exit(0)
+         * that impl.c does when the tracked count hits zero,
+         * which happens in every process (i.e. pool workers). */
+        DEBUG("No active connections in generation %d, finishing exit.", gen->id);
+        gen->finished = TRUE;
+        if( !gen->leader_exited )
+        {
+            kill(gen->leader, SIGTERM);
+        }
+        for( process_t *proc = gen->procs; proc != NULL; proc = proc->next )
+        {
+            if( proc->pid != gen->leader && proc->pidfd >= 0 )
+            {
+                syscall(SYS_pidfd_send_signal, proc->pidfd, SIGTERM, NULL, 0);
+            }
+        }
+    }
+}
+
+static void
+restart(void)
+{
+    if( active == NULL || active->draining == TRUE )
+    {
+        return;
+    }
+
+    DEBUG("Restarting generation %d...", active->id);
+
+    /* Unlink files (e.g. pidfile). */
+    if( to_unlink != NULL && strlen(to_unlink) > 0 )
+    {
+        DEBUG("Unlinking '%s'...", to_unlink);
+        unlink(to_unlink);
+    }
+
+    active->draining = TRUE;
+    for( pending_t *p = pendings; p != NULL; )
+    {
+        pending_t *next = p->next;
+        if( p->gen == active && try_accept(p) )
+        {
+            pending_drop(p);
+        }
+        p = next;
+    }
+
+    generation_t *old = active;
+    switch( exit_strategy )
+    {
+        case FORK:
+            /* The new generation starts now, and picks
+             * up the listeners as soon as it binds. */
+            spawn_generation();
+            break;
+
+        case EXEC:
+            /* The new generation starts once the old
+             * one has finished (see reap()). */
+            break;
+    }
+    generation_check(old);
+}
+
+static void
+reap(void)
+{
+    int status = 0;
+    pid_t pid;
+
+    while( (pid = waitpid((pid_t)-1, &status, WNOHANG)) > 0 )
+    {
+        for( generation_t *gen = generations; gen != NULL; gen = gen->next )
+        {
+            if( gen->leader != pid )
+            {
+                continue;
+            }
+
+            DEBUG("Leader %d of generation %d has exited.", pid, gen->id);
+            gen->leader_exited = TRUE;
+            gen->leader_status = status;
+
+            if( gen == active && gen->draining == FALSE )
+            {
+                if( revive_mode == TRUE && stopping == FALSE )
+                {
+                    /* The program exited, but we want it back. */
+                    DEBUG("Reviving...");
+                    gen->draining = TRUE;
+                    spawn_generation();
+                }
+                else
+                {
+                    exit_status = WIFEXITED(status) ?
+                        WEXITSTATUS(status) : 128 + WTERMSIG(status);
+                    active = NULL;
+                }
+            }
+            else if( gen == active && exit_strategy == EXEC && stopping == FALSE )
+            {
+                /* Drained. Bring up the next image. */
+                spawn_generation();
+            }
+            break;
+        }
+    }
+}
+
+static void
+forward(int signo)
+{
+    for( generation_t *gen = generations; gen != NULL; gen = gen->next )
+    {
+        if( !gen->leader_exited )
+        {
+            kill(gen->leader, signo);
+        }
+    }
+}
+
+static void
+handle_signals(int sfd)
+{
+    struct signalfd_siginfo si;
+
+    while( read(sfd, &si, sizeof(si)) == sizeof(si) )
+    {
+        switch( si.ssi_signo )
+        {
+            case SIGHUP:
+                restart();
+                break;
+            case SIGCHLD:
+                reap();
+                break;
+            default:
+                stopping = TRUE;
+                forward(si.ssi_signo);
+                break;
+        }
+    }
+}
+
+static void
+loop(int sfd)
+{
+    while( generations != NULL )
+    {
+        int count = 1;
+        bool_t any_draining = FALSE;
+
+        for( generation_t *gen = generations; gen != NULL; gen = gen->next )
+        {
+            count += 1;
+            for( process_t *proc = gen->procs; proc != NULL; proc = proc->next )
+            {
+                count += 1;
+            }
+            if( gen->draining == TRUE && gen->tracked > 0 )
+            {
+                any_draining = TRUE;
+            }
+        }
+        for( pending_t *p = pendings; p != NULL; p = p->next )
+        {
+            count += 1;
+        }
+
+        struct pollfd *fds = (struct pollfd*)calloc(count, sizeof(struct pollfd));
+        void **owners = (void**)calloc(count, sizeof(void*));
+        int n = 0;
+
+        fds[n].fd = sfd;
+        fds[n++].events = POLLIN;
+        for( generation_t *gen = generations; gen != NULL; gen = gen->next )
+        {
+            owners[n] = gen;
+            fds[n].fd = gen->notify_fd;
+            fds[n++].events = POLLIN;
+        }
+        int first_proc = n;
+        for( generation_t *gen = generations; gen != NULL; gen = gen->next )
+        {
+            for( process_t *proc = gen->procs; proc != NULL; proc = proc->next )
+            {
+                owners[n] = proc;
+                fds[n].fd = proc->pidfd;
+                fds[n++].events = POLLIN;
+            }
+        }
+        int first_pending = n;
+        for( pending_t *p = pendings; p != NULL; p = p->next )
+        {
+            owners[n] = p;
+            fds[n].fd = p->gen->draining ? -1 : p->listener->fd;
+            fds[n++].events = POLLIN;
+        }
+
+        int rc = poll(fds, n, any_draining ? 1000 : -1);
+        if( rc < 0 && errno != EINTR )
+        {
+            fprintf(stderr, "huptime-seccomp: poll: %s\n", strerror(errno));
+            exit(1);
+        }
+
+        if( rc > 0 && fds[0].revents )
+        {
+            handle_signals(sfd);
+        }
+
+        for( int i = first_pending; rc > 0 && i < n; i += 1 )
+        {
+            pending_t *p = (pending_t*)owners[i];
+            if( !fds[i].revents )
+            {
+                continue;
+            }
+            if( !notif_valid(p->gen, p->id) || try_accept(p) )
+            {
+                pending_drop(p);
+            }
+        }
+
+        for( int i = 1; rc > 0 && i < first_proc; i += 1 )
+        {
+            generation_t *gen = (generation_t*)owners[i];
+            if( fds[i].revents & POLLIN )
+            {
+                handle_notification(gen);
+            }
+        }
+
+        for( int i = first_proc; rc > 0 && i < first_pending; i += 1 )
+        {
+            if( fds[i].revents )
+            {
+                process_free((process_t*)owners[i]);
+            }
+        }
+
+        free(fds);
+        free(owners);
+
+        /* Drop invalid parked accepts (interrupted callers). */
+        for( pending_t *p = pendings; p != NULL; )
+        {
+            pending_t *next = p->next;
+            if( !notif_valid(p->gen, p->id) )
+            {
+                pending_drop(p);
+            }
+            p = next;
+        }
+
+        for( generation_t *gen = generations; gen != NULL; )
+        {
+            generation_t *next = gen->next;
+            generation_check(gen);
+            if( gen->leader_exited && gen->procs == NULL )
+            {
+                /* The notify fd has no users left once
+                 * all of the processes have exited. */
+                struct pollfd pfd = { .fd = gen->notify_fd, .events = POLLIN };
+                if( poll(&pfd, 1, 0) > 0 && (pfd.revents & POLLHUP) )
+                {
+                    generation_free(gen);
+                }
+            }
+            gen = next;
+        }
+    }
+}
+
+int
+main(int argc, char **argv)
+{
+    const char* mode_env = getenv("HUPTIME_MODE");
+    const char* multi_env = getenv("HUPTIME_MULTI");
+    const char* revive_env = getenv("HUPTIME_REVIVE");
+    const char* debug_env = getenv("HUPTIME_DEBUG");
+
+    if( argc < 2 )
+    {
+        fprintf(stderr, "usage: huptime-seccomp <command...>\n");
+        return 1;
+    }
+    target_args = &argv[1];
+
+    if( debug_env != NULL && strlen(debug_env) > 0 )
+    {
+        debug_enabled = !strcasecmp(debug_env, "true") ? TRUE: FALSE;
+    }
+    if( mode_env != NULL && !strcasecmp(mode_env, "exec") )
+    {
+        exit_strategy = EXEC;
+    }
+    if( multi_env != NULL && strlen(multi_env) > 0 )
+    {
+        multi_mode = !strcasecmp(multi_env, "true") ? TRUE: FALSE;
+    }
+    if( revive_env != NULL && strlen(revive_env) > 0 )
+    {
+        revive_mode = !strcasecmp(revive_env, "true") ? TRUE : FALSE;
+    }
+    to_unlink = getenv("HUPTIME_UNLINK");
+
+    if( syscall(SYS_seccomp, SECCOMP_GET_NOTIF_SIZES, 0, &sizes) < 0 )
+    {
+        fprintf(stderr, "huptime-seccomp: seccomp user notification "
+                        "not supported (requires Linux 5.14+).\n");
+        return 1;
+    }
+
+    /* All of our signals are handled synchronously. */
+    sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, SIGHUP);
+    sigaddset(&set, SIGCHLD);
+    sigaddset(&set, SIGTERM);
+    sigaddset(&set, SIGINT);
+    sigaddset(&set, SIGQUIT);
+    sigprocmask(SIG_BLOCK, &set, &orig_mask);
+    int sfd = signalfd(-1, &set, SFD_NONBLOCK|SFD_CLOEXEC);
+    if( sfd < 0 )
+    {
+        fprintf(stderr, "huptime-seccomp: signalfd: %s\n", strerror(errno));
+        return 1;
+    }
+
+    /* Workers left behind by a leader that has exited are
+     * handed to us (rather than init), so that we reap them. */
+    prctl(PR_SET_CHILD_SUBREAPER, 1, 0, 0, 0);
+
+    spawn_generation();
+    loop(sfd);
+
+    DEBUG("Goodbye!");
+    return exit_status;
+}
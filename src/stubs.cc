@@ -26,6 +26,8 @@ extern "C" {
 #include <dlfcn.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdarg.h>
+#include <fcntl.h>
 }
 
 template <typename FUNC_T>
@@ -66,13 +68,17 @@ setup(void)
 
     GET_LIBC_FUNCTION(bind);
     GET_LIBC_FUNCTION(listen);
+    GET_LIBC_FUNCTION(setsockopt);
     GET_LIBC_FUNCTION(accept);
     GET_LIBC_FUNCTION(accept4);
     GET_LIBC_FUNCTION(close);
     GET_LIBC_FUNCTION(fork);
+    GET_LIBC_FUNCTION(clone);
     GET_LIBC_FUNCTION(dup);
     GET_LIBC_FUNCTION(dup2);
     GET_LIBC_FUNCTION(dup3);
+    GET_LIBC_FUNCTION(unlink);
+    GET_LIBC_FUNCTION(unlinkat);
     GET_LIBC_FUNCTION(exit);
     GET_LIBC_FUNCTION(wait);
     GET_LIBC_FUNCTION(waitpid);
@@ -81,6 +87,24 @@ setup(void)
     GET_LIBC_FUNCTION(epoll_create1);
     #undef GET_LIBC_FUNCTION
 
+    /* These are only in glibc 2.34+, so we can't name them
+     * here. They are left NULL if libc doesn't have them. */
+    #define GET_LIBC_OPTIONAL(_name) \
+    libc._name = (_name ## _t)dlsym(RTLD_NEXT, # _name)
+
+    GET_LIBC_OPTIONAL(close_range);
+    GET_LIBC_OPTIONAL(closefrom);
+
+    /* Likewise fcntl64() is only in glibc 2.28+, and from
+     * then on the headers give us it for fcntl(), too. */
+    GET_LIBC_OPTIONAL(fcntl);
+    GET_LIBC_OPTIONAL(fcntl64);
+    if( libc.fcntl64 == NULL )
+    {
+        libc.fcntl64 = libc.fcntl;
+    }
+    #undef GET_LIBC_OPTIONAL
+
     impl_init();
 }
 
@@ -99,6 +123,12 @@ stub_listen(int sockfd, int backlog)
     return impl.listen(sockfd, backlog);
 }
 
+static int
+stub_setsockopt(int sockfd, int level, int optname, const void *optval, socklen_t optlen)
+{
+    return impl.setsockopt(sockfd, level, optname, optval, optlen);
+}
+
 static int
 stub_accept(int sockfd, struct sockaddr *addr, socklen_t *addrlen)
 {
@@ -117,12 +147,39 @@ stub_close(int fd)
     return impl.close(fd);
 }
 
+static int
+stub_close_range(unsigned int first, unsigned int last, int flags)
+{
+    return impl.close_range(first, last, flags);
+}
+
+static void
+stub_closefrom(int lowfd)
+{
+    impl.closefrom(lowfd);
+}
+
 static pid_t
 stub_fork()
 {
     return impl.fork();
 }
 
+static int
+stub_clone(int (*fn)(void *), void *stack, int flags, void *arg, ...)
+{
+    /* The trailing arguments are only read by the kernel
+     * when the matching flags are set, so (as in libc) we
+     * just pass on whatever is there. */
+    va_list ap;
+    va_start(ap, arg);
+    pid_t *ptid = va_arg(ap, pid_t*);
+    void *tls = va_arg(ap, void*);
+    pid_t *ctid = va_arg(ap, pid_t*);
+    va_end(ap);
+    return impl.clone(fn, stack, flags, arg, ptid, tls, ctid);
+}
+
 static int
 stub_dup(int fd)
 {
@@ -141,6 +198,41 @@ stub_dup3(int fd, int fd2, int flags)
     return impl.dup3(fd, fd2, flags);
 }
 
+static int
+stub_fcntl(int fd, int cmd, ...)
+{
+    /* Every command takes at most one argument,
+     * either an int or a pointer. We pass it on
+     * as whatever was in the register. */
+    va_list ap;
+    va_start(ap, cmd);
+    void *arg = va_arg(ap, void*);
+    va_end(ap);
+    return impl.fcntl(fd, cmd, arg);
+}
+
+static int
+stub_fcntl64(int fd, int cmd, ...)
+{
+    va_list ap;
+    va_start(ap, cmd);
+    void *arg = va_arg(ap, void*);
+    va_end(ap);
+    return impl.fcntl64(fd, cmd, arg);
+}
+
+static int
+stub_unlink(const char *pathname)
+{
+    return impl.unlink(pathname);
+}
+
+static int
+stub_unlinkat(int dirfd, const char *pathname, int flags)
+{
+    return impl.unlinkat(dirfd, pathname, flags);
+}
+
 static void
 stub_exit(int status)
 {
@@ -148,7 +240,7 @@ stub_exit(int status)
 }
 
 static pid_t
-stub_wait(void *status)
+stub_wait(int *status)
 {
     return impl.wait(status);
 }
@@ -159,8 +251,8 @@ stub_waitpid(pid_t pid, int *status, int options)
     return impl.waitpid(pid, status, options);
 }
 
-static int
-stub_syscall(int number, long a1, long a2, long a3, long a4, long a5, long a6)
+static long
+stub_syscall(long number, long a1, long a2, long a3, long a4, long a5, long a6)
 {
     return impl.syscall(number, a1, a2, a3, a4, a5, a6);
 }
@@ -203,22 +295,39 @@ GLIBC_DEFAULT(bind)
 GLIBC_VERSION2(bind, 2, 2, 5)
 GLIBC_DEFAULT(listen)
 GLIBC_VERSION2(listen, 2, 2, 5)
+GLIBC_DEFAULT(setsockopt)
+GLIBC_VERSION2(setsockopt, 2, 2, 5)
 GLIBC_DEFAULT(accept)
 GLIBC_VERSION2(accept, 2, 2, 5)
 GLIBC_DEFAULT(accept4)
-GLIBC_VERSION2(accept4, 2, 2, 5)
+GLIBC_VERSION(accept4, 2, 10)
 GLIBC_DEFAULT(close)
 GLIBC_VERSION2(close, 2, 2, 5)
+GLIBC_DEFAULT(close_range)
+GLIBC_VERSION(close_range, 2, 34)
+GLIBC_DEFAULT(closefrom)
+GLIBC_VERSION(closefrom, 2, 34)
 GLIBC_DEFAULT(fork)
 GLIBC_VERSION2(fork, 2, 2, 5)
+GLIBC_DEFAULT(clone)
+GLIBC_VERSION2(clone, 2, 2, 5)
 GLIBC_DEFAULT(dup)
 GLIBC_VERSION2(dup, 2, 2, 5)
 GLIBC_DEFAULT(dup2)
 GLIBC_VERSION2(dup2, 2, 2, 5)
 GLIBC_DEFAULT(dup3)
-GLIBC_VERSION2(dup3, 2, 2, 5)
+GLIBC_VERSION(dup3, 2, 9)
+GLIBC_DEFAULT(fcntl)
+GLIBC_VERSION2(fcntl, 2, 2, 5)
+GLIBC_DEFAULT(fcntl64)
+GLIBC_VERSION(fcntl64, 2, 28)
+GLIBC_DEFAULT(unlink)
+GLIBC_VERSION2(unlink, 2, 2, 5)
+GLIBC_DEFAULT(unlinkat)
+GLIBC_VERSION(unlinkat, 2, 4)
 GLIBC_DEFAULT(exit)
 GLIBC_VERSION(exit, 2, 0)
+GLIBC_VERSION2(exit, 2, 2, 5)
 GLIBC_DEFAULT(wait)
 GLIBC_VERSION2(wait, 2, 2, 5)
 GLIBC_DEFAULT(waitpid)
@@ -53,6 +53,16 @@ class Client(object):
         self._sock.send("ping")
         assert self._sock.recv(1024) == "pong"
 
+    def closed(self, timeout=None):
+        # Wait for the server to hang up on us.
+        self._sock.settimeout(timeout)
+        try:
+            return self._sock.recv(1024) == ""
+        except socket.timeout:
+            return False
+        finally:
+            self._sock.settimeout(None)
+
     def drop(self):
         self._sock.send("drop")
         assert self._sock.recv(1024) == "okay"
@@ -39,6 +39,8 @@ import client
 def proxy_starter(proxy, host=None, port=None, backlog=None):
     def fn():
         proxy._wait()
+        if proxy._mode.autostart:
+            return
         proxy.bind(host=host, port=port)
         proxy.listen(backlog=backlog)
         proxy._call("run")
@@ -92,6 +94,13 @@ class Harness(object):
             return self._proxy.getpid()
         orig_pid = getpid()
 
+        # Note the copies that are around now (see below).
+        def copies():
+            return sorted(
+                (g["pid"], g["generation"], g["draining"])
+                for g in self._proxy.generations())
+        orig_copies = copies()
+
         # Grab the current pid, and hit
         # the server with a restart signal.
         sys.stderr.write("harness: restart\n")
@@ -106,6 +115,15 @@ class Harness(object):
         # Call into the mode to validate.
         self._mode.check_restart(orig_pid, getpid, start_thread)
 
+        # The signal is handled asynchronously, so clients
+        # that connect right away may still be accepted by
+        # the old copy. Wait until it has started draining
+        # (or been replaced) before connecting new ones.
+        if orig_copies:
+            deadline = time.time() + 5.0
+            while copies() == orig_copies and time.time() < deadline:
+                time.sleep(0.05)
+
         # Connect new clients.
         new_clients = self.clients()
 
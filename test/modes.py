@@ -27,9 +27,19 @@ import os
 import time
 import subprocess
 import threading
+import socket
+import shutil
+import tempfile
+import json
+
+import servers
 
 class Mode(object):
 
+    # Does the server start itself? Normally
+    # the harness does this through the proxy.
+    autostart = False
+
     # Before each RPC call, we check
     # for something in the mode.
     # This is expected to do something,
@@ -89,6 +99,13 @@ class Mode(object):
                 lambda x: x.strip(),
                 proc.stdout.readlines())
 
+    def generations(self, cmdline):
+        proc = self._run(
+            ["--generations"] + cmdline,
+            stdout=subprocess.PIPE)
+        output = proc.communicate()[0]
+        return [json.loads(line) for line in output.splitlines()]
+
     def check_clients(self,
             start_thread,
             old_clients, new_clients,
@@ -154,7 +171,158 @@ class Exec(Mode):
         sys.stderr.write("%s: checking new clients...\n" % self)
         new_clients.verify([new_cookie])
 
+class Hybrid(Exec):
+
+    # The proxy has threads of its own, so this is
+    # really exec mode (see impl_hybrid_split()).
+    def _args(self):
+        return ["--hybrid"]
+
+class Park(Exec):
+
+    # New connections are accepted for the program
+    # while it drains, and handed out after the exec().
+    def _args(self):
+        return ["--exec", "--park=64"]
+
+class Seccomp(Fork):
+
+    # The seccomp engine, instead of LD_PRELOAD.
+    def _args(self):
+        return ["--fork", "--seccomp"]
+
+class Drain(Fork):
+
+    # Connections to our port are given a second
+    # to finish after a restart, then shut down.
+    def _args(self):
+        return ["--fork", "--drain=%d:1" % servers.DEFAULT_PORT]
+
+class DrainOther(Fork):
+
+    # The deadline is for some other port, so
+    # our connections are left alone.
+    def _args(self):
+        return ["--fork", "--drain=%d:1" % (servers.DEFAULT_PORT + 1)]
+
+class MaxDraining(Fork):
+
+    # Only one older copy may be draining. We wait on it
+    # (for as long as the longest deadline), then force it.
+    def _args(self):
+        return ["--fork", "--coalesce=100", "--max-draining=1",
+                "--drain=%d:1" % (servers.DEFAULT_PORT + 1)]
+
+class Rollback(Fork):
+
+    # Give up on a new copy that isn't up in time.
+    def _args(self):
+        return ["--fork", "--rollback=5"]
+
+class Standby(Fork):
+
+    # The next copy is started ahead of time, and held
+    # at its first accept(). So it has to start itself,
+    # and it has the cookie from when it started (which
+    # is before the restart, unless it was still coming up).
+    autostart = True
+    previous = None
+
+    def _args(self):
+        return ["--fork", "--standby"]
+
+    def check_clients(self,
+            pid, getpid, start_thread,
+            old_clients, new_clients,
+            old_cookie, new_cookie):
+        sys.stderr.write("%s: checking new clients...\n" % self)
+        new_clients.verify([old_cookie, new_cookie])
+        old_clients.verify(
+            [self.previous or old_cookie, old_cookie, new_cookie])
+        self.previous = old_cookie
+
+class Multi(Fork):
+
+    # A pool of one worker, which may grow to two. Each
+    # worker has to start itself, and we look at the pool
+    # often so that it doesn't take long to shrink again.
+    autostart = True
+
+    def _args(self):
+        return ["--multi=1:2", "--scale-interval=0.25"]
+
+class Pin(Fork):
+
+    # A single worker, pinned to the first CPU (which
+    # every machine has), steering connections to it.
+    def _args(self):
+        return ["--fork", "--multi=1", "--pin=0"]
+
+class StatsFork(Fork):
+
+    # Timings for each phase of the restart (see bench/scale.c).
+    def _args(self):
+        return ["--fork", "--stats=%s" % servers.DEFAULT_STATS]
+
+class StatsExec(Exec):
+
+    def _args(self):
+        return ["--exec", "--stats=%s" % servers.DEFAULT_STATS]
+
+class Notify(Mode):
+
+    # We stand in for systemd here: huptime opens the
+    # listening socket (--listen), and we collect what
+    # comes back over NOTIFY_SOCKET.
+    def start(self, cmdline, **kwargs):
+        self._dir = tempfile.mkdtemp()
+        path = os.path.join(self._dir, "notify")
+        self._notify = socket.socket(socket.AF_UNIX, socket.SOCK_DGRAM)
+        self._notify.bind(path)
+        env = dict(os.environ)
+        env["NOTIFY_SOCKET"] = path
+        super(Notify, self).start(cmdline, env=env, **kwargs)
+
+    def stop(self, cmdline):
+        super(Notify, self).stop(cmdline)
+        self._notify.close()
+        shutil.rmtree(self._dir)
+
+    def notified(self, timeout=10.0):
+        self._notify.settimeout(timeout)
+        try:
+            data = self._notify.recv(4096)
+        except socket.timeout:
+            return None
+        sys.stderr.write("%s: notified %r\n" % (self, data))
+        return dict(line.split("=", 1) for line in data.split("\n"))
+
+class NotifyFork(Notify, Fork):
+
+    def _args(self):
+        return ["--fork", "--listen=:%d" % servers.DEFAULT_PORT]
+
+class NotifyExec(Notify, Exec):
+
+    def _args(self):
+        return ["--exec", "--listen=:%d" % servers.DEFAULT_PORT]
+
 MODES = [
     Fork,
     Exec,
 ]
+
+# These are modes with some feature turned on.
+# They get a basic restart test (see test_meta.py),
+# and more specific tests live alongside.
+FEATURES = [
+    Seccomp,
+    Drain,
+    NotifyFork,
+    MaxDraining,
+    Rollback,
+    Hybrid,
+    Park,
+    Standby,
+    Pin,
+]
@@ -31,10 +31,25 @@ import subprocess
 import threading
 import traceback
 import pickle
+import select
+import ctypes
+import time
+import errno
 
 import modes
 import servers
 
+# See huptime_generations() in libhuptime.h.
+class GenerationInfo(ctypes.Structure):
+    _fields_ = [
+        ("pid", ctypes.c_int),
+        ("generation", ctypes.c_int),
+        ("draining", ctypes.c_int),
+        ("tracked", ctypes.c_ulong),
+        ("rss_kb", ctypes.c_ulong),
+        ("fds", ctypes.c_ulong),
+    ]
+
 class ProxyServer(object):
 
     def __init__(self, mode_name, server_name, cookie_file):
@@ -45,13 +60,21 @@ class ProxyServer(object):
 
     def run(self):
         # Open our pipes.
-        in_pipe = os.fdopen(os.dup(0), 'r')
+        in_pipe = os.fdopen(os.dup(0), 'r', 0)
         out_pipe = os.fdopen(os.dup(1), 'w')
         devnull = open("/dev/null", 'r')
         os.dup2(devnull.fileno(), 0)
         devnull.close()
         os.dup2(2, 1)
 
+        # Some modes start the next copy ahead of time, so
+        # it has to get itself going (see modes.Standby).
+        # We're only started once we're listening.
+        if self._mode.autostart:
+            self._server.bind()
+            self._server.listen()
+            threading.Thread(target=self._server.run).start()
+
         # Dump our startup message.
         robj = {
             "id": None,
@@ -62,8 +85,31 @@ class ProxyServer(object):
         sys.stderr.write("proxy %d: started.\n" % os.getpid())
 
         # Get the call from the other side.
+        drain_fd = self._drain_fd()
         while True:
             try:
+                # Once we're draining, the calls are for the
+                # next copy (which reads from the same pipe).
+                # The same goes as soon as the next copy is
+                # around, as we may not be draining until it
+                # is up (and it may not come up at all). A
+                # standby isn't around until it's let go.
+                fds = [in_pipe]
+                if drain_fd >= 0:
+                    fds.append(drain_fd)
+                try:
+                    rfds, _, _ = select.select(fds, [], [])
+                except select.error as e:
+                    # The restart signal. We may yet carry
+                    # on (if the next copy doesn't make it).
+                    if e.args[0] == errno.EINTR:
+                        continue
+                    raise
+                if drain_fd in rfds:
+                    break
+                if not self._current():
+                    time.sleep(0.1)
+                    continue
                 obj = pickle.load(in_pipe)
                 sys.stderr.write("proxy %d: <- %s\n" % (os.getpid(), obj))
             except:
@@ -78,6 +124,31 @@ class ProxyServer(object):
             t = threading.Thread(target=closure(obj, out_pipe))
             t.start()
 
+    def _drain_fd(self):
+        try:
+            return ctypes.CDLL(None).huptime_drain_fd()
+        except AttributeError:
+            return -1
+
+    def _current(self):
+        # Are we the latest copy that's running?
+        libc = ctypes.CDLL(None)
+        try:
+            gens = (GenerationInfo * 64)()
+            count = libc.huptime_generations(gens, 64)
+            ours = libc.huptime_generation()
+        except AttributeError:
+            return True
+        if count < 0:
+            return True
+        listed = False
+        for gen in gens[:count]:
+            if gen.generation > ours:
+                return False
+            if gen.pid == os.getpid():
+                listed = True
+        return listed
+
     def _process(self, obj, out):
         uniq = obj.get("id")
         try:
@@ -214,6 +285,9 @@ class ProxyClient(object):
     def restart(self):
         self._mode.restart(self._cmdline)
 
+    def generations(self):
+        return self._mode.generations(self._cmdline)
+
     def __getattr__(self, method_name):
         def _fn(*args, **kwargs):
             uniq = self._call(method_name, args, kwargs)
@@ -31,11 +31,27 @@ import threading
 import traceback
 import select
 import errno
+import struct
+import ctypes
+import fcntl
+import tempfile
+import platform
+import time
 
 DEFAULT_HOST = ""
 DEFAULT_PORT = 7869
 DEFAULT_BACKLOG = 1
 DEFAULT_N = 8
+DEFAULT_PATH = "/tmp/huptime-test.sock"
+DEFAULT_HOOKS = "/tmp/huptime-test.hooks"
+DEFAULT_REGIONS = "/tmp/huptime-test.regions"
+DEFAULT_BROKEN = "/tmp/huptime-test.broken"
+DEFAULT_SOCKOPT = "/tmp/huptime-test.sockopt"
+DEFAULT_STATS = "/tmp/huptime-test.stats"
+DEFAULT_HOLD = "/tmp/huptime-test.hold"
+
+# Not in the socket module (for python 2).
+SO_INCOMING_CPU = 49
 
 class Server(object):
 
@@ -83,6 +99,13 @@ class Server(object):
         sys.stderr.write("%s: getpid()\n" % self)
         return os.getpid()
 
+    def incoming_cpu(self):
+        sys.stderr.write("%s: incoming_cpu()\n" % self)
+        return self._sock.getsockopt(socket.SOL_SOCKET, SO_INCOMING_CPU)
+
+    def pong(self, client):
+        client.send("pong")
+
     def handle(self, client):
         # This implements a very simple protocol that
         # allows us to test for a code "version" (by the
@@ -109,7 +132,7 @@ class Server(object):
             client.send(self._cookie)
             rval = True
         elif command == "ping":
-            client.send("pong")
+            self.pong(client)
             rval = True
         elif command == "drop":
             client.send("okay")
@@ -175,6 +198,232 @@ class ThreadServer(Server):
             t.daemon = True
             t.start()
 
+class DatagramServer(ThreadServer):
+
+    """
+    A server which also answers for the cookie
+    over UDP, on the same port.
+    """
+
+    def bind(self, host=None, port=None):
+        super(DatagramServer, self).bind(host=host, port=port)
+        if host is None:
+            host = DEFAULT_HOST
+        if port is None:
+            port = DEFAULT_PORT
+        self._dgram = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+        self._dgram.bind((host, port))
+
+    def run(self):
+        t = threading.Thread(target=self._serve_dgram)
+        t.daemon = True
+        t.start()
+        super(DatagramServer, self).run()
+
+    def _serve_dgram(self):
+        while True:
+            data, addr = self._dgram.recvfrom(1024)
+            sys.stderr.write("%s: recvfrom() => %s\n" % (self, data))
+            if data == "cookie":
+                self._dgram.sendto(self._cookie, addr)
+            elif data == "late":
+                # Answer once we've been restarted.
+                libc = ctypes.CDLL(None, use_errno=True)
+                select.select([libc.huptime_drain_fd()], [], [])
+                time.sleep(0.1)
+                self._dgram.sendto(self._cookie, addr)
+
+class UnixServer(ThreadServer):
+
+    """
+    A server which also listens on a unix socket,
+    removing whatever was there first (as most do).
+    """
+
+    def bind(self, host=None, port=None):
+        super(UnixServer, self).bind(host=host, port=port)
+        if os.path.exists(DEFAULT_PATH):
+            os.unlink(DEFAULT_PATH)
+        self._unix = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+        self._unix.bind(DEFAULT_PATH)
+
+    def listen(self, backlog=None):
+        super(UnixServer, self).listen(backlog=backlog)
+        self._unix.listen(DEFAULT_N)
+
+    def run(self):
+        t = threading.Thread(target=self._serve_unix)
+        t.daemon = True
+        t.start()
+        super(UnixServer, self).run()
+
+    def _serve_unix(self):
+        while True:
+            client, _ = self._unix.accept()
+            try:
+                while self.handle(client):
+                    pass
+            except:
+                traceback.print_exc()
+
+# See huptime_adopt() in libhuptime.h.
+ADOPT_FN = ctypes.CFUNCTYPE(None,
+    ctypes.c_int, ctypes.c_void_p, ctypes.c_size_t, ctypes.c_void_p)
+
+class HandoffServer(ThreadServer):
+
+    """
+    A server which hands its clients off to the next
+    copy when it is restarted (see libhuptime.h), rather
+    than waiting for them to finish.
+    """
+
+    def run(self):
+        sys.stderr.write("%s: run()\n" % self)
+        libc = ctypes.CDLL(None, use_errno=True)
+        self._handoff = libc.huptime_handoff
+        self._drain_fd = libc.huptime_drain_fd()
+        self._adopt = ADOPT_FN(self._adopted)
+        libc.huptime_adopt(self._adopt, None)
+        while True:
+            self._start(self.accept())
+
+    def _adopted(self, fd, state, length, data):
+        sys.stderr.write("%s: adopted(%d)\n" % (self, fd))
+        client = socket.fromfd(fd, socket.AF_INET, socket.SOCK_STREAM)
+        os.close(fd)
+        self._start(client)
+
+    def _start(self, client):
+        t = threading.Thread(target=self._serve, args=(client,))
+        t.daemon = True
+        t.start()
+
+    def _serve(self, client):
+        while True:
+            rfds, _, _ = select.select([client, self._drain_fd], [], [])
+            if client in rfds:
+                if not self.handle(client):
+                    break
+            elif self._handoff(os.dup(client.fileno()), None, 0) == 0:
+                sys.stderr.write("%s: handoff()\n" % self)
+                client.close()
+                break
+
+# See huptime_hook() in libhuptime.h.
+HOOK_FN = ctypes.CFUNCTYPE(None, ctypes.c_void_p)
+HUPTIME_POST_HANDOFF = 1
+HUPTIME_PRE_EXEC = 2
+
+class HookServer(ThreadServer):
+
+    """
+    A server which registers hooks (see libhuptime.h), and
+    notes down every time one is run. Noting it down
+    calls back into huptime (for the close()).
+    """
+
+    def run(self):
+        sys.stderr.write("%s: run()\n" % self)
+        libc = ctypes.CDLL(None, use_errno=True)
+        self._hooks = []
+        for event in (HUPTIME_POST_HANDOFF, HUPTIME_PRE_EXEC):
+            fn = HOOK_FN(self._hooked)
+            self._hooks.append(fn)
+            assert libc.huptime_hook(event, fn, event) == 0
+        super(HookServer, self).run()
+
+    def _hooked(self, event):
+        sys.stderr.write("%s: hook(%d)\n" % (self, event))
+        fd = os.open(DEFAULT_HOOKS, os.O_WRONLY|os.O_APPEND|os.O_CREAT, 0644)
+        os.write(fd, "%d %d\n" % (os.getpid(), event))
+        os.close(fd)
+
+class RegionServer(ThreadServer):
+
+    """
+    A server which passes its cookie on to the next copy
+    in a region (see libhuptime.h), registered through the
+    environment. It notes down whatever it was passed.
+    """
+
+    def run(self):
+        sys.stderr.write("%s: run()\n" % self)
+        for entry in os.environ.get("HUPTIME_REGIONS", "").split(":"):
+            if entry.startswith("cookie="):
+                fd = int(entry[len("cookie="):])
+                os.lseek(fd, 0, os.SEEK_SET)
+                passed = os.read(fd, 1024)
+                sys.stderr.write("%s: region() => %s\n" % (self, passed))
+                with open(DEFAULT_REGIONS, "a") as f:
+                    f.write("%s\n" % passed)
+        self._region = tempfile.TemporaryFile()
+        self._region.write(self._cookie)
+        self._region.flush()
+        os.environ["HUPTIME_REGISTER"] = "cookie=%d" % self._region.fileno()
+        super(RegionServer, self).run()
+
+class QuitServer(ThreadServer):
+
+    """
+    A server which exits on its own as soon as it
+    starts draining, rather than waiting for huptime.
+    """
+
+    def run(self):
+        t = threading.Thread(target=self._quit)
+        t.daemon = True
+        t.start()
+        super(QuitServer, self).run()
+
+    def _quit(self):
+        libc = ctypes.CDLL(None, use_errno=True)
+        select.select([libc.huptime_drain_fd()], [], [])
+        sys.stderr.write("%s: exit()\n" % self)
+        libc_function("exit", restype=None)(0)
+
+class BrokenServer(ThreadServer):
+
+    """
+    A server which can't start up at all
+    while there is a DEFAULT_BROKEN file.
+    """
+
+    def __init__(self, *args, **kwargs):
+        if os.path.exists(DEFAULT_BROKEN):
+            sys.stderr.write("BrokenServer %d: exit()\n" % os.getpid())
+            os._exit(1)
+        super(BrokenServer, self).__init__(*args, **kwargs)
+
+class HoldServer(ThreadServer):
+
+    """
+    A server which doesn't accept connections
+    while there is a DEFAULT_HOLD file.
+    """
+
+    def accept(self):
+        while os.path.exists(DEFAULT_HOLD):
+            time.sleep(0.1)
+        return super(HoldServer, self).accept()
+
+class SockoptServer(ThreadServer):
+
+    """
+    A server which sets TCP_DEFER_ACCEPT before bind()
+    while there is a DEFAULT_SOCKOPT file.
+    """
+
+    def bind(self, host=None, port=None):
+        if os.path.exists(DEFAULT_SOCKOPT):
+            self._sock.setsockopt(
+                socket.IPPROTO_TCP, socket.TCP_DEFER_ACCEPT, 5)
+        super(SockoptServer, self).bind(host=host, port=port)
+
+    def sockopt(self):
+        return self._sock.getsockopt(
+            socket.IPPROTO_TCP, socket.TCP_DEFER_ACCEPT)
+
 class ProcessServer(Server):
 
     def __init__(self, *args, **kwargs):
@@ -196,6 +445,50 @@ class ProcessServer(Server):
                 t.daemon = True
                 t.start()
 
+# Not in the fcntl module (for python 2).
+F_DUPFD_CLOEXEC = 1030
+
+class FcntlServer(SimpleServer):
+
+    """
+    A server that moves its listener up out of
+    the way with fcntl(), before accepting on it.
+    """
+
+    def listen(self, backlog=None):
+        super(FcntlServer, self).listen(backlog=backlog)
+        fd = fcntl.fcntl(self._sock.fileno(), F_DUPFD_CLOEXEC, 64)
+        self._sock.close()
+        self._sock = socket.fromfd(fd, socket.AF_INET, socket.SOCK_STREAM)
+        os.close(fd)
+
+class CloseRangeServer(ProcessServer):
+
+    """
+    A process-per-client server where each child
+    closes everything but its client (close_range()).
+    """
+
+    def run(self):
+        sys.stderr.write("%s: run()\n" % self)
+        close_range = libc_function("close_range", "GLIBC_2.34")
+        while True:
+            client = self.accept()
+            pid = os.fork()
+            if pid == 0:
+                fd = client.fileno()
+                close_range(3, fd - 1, 0)
+                close_range(fd + 1, 0xffffffff, 0)
+                while self.handle(client):
+                    # Continue until finished.
+                    pass
+                os._exit(0)
+            else:
+                client.close()
+                t = threading.Thread(target=lambda: os.waitpid(pid, 0))
+                t.daemon = True
+                t.start()
+
 class PoolServer(SimpleServer):
 
     def _create(self, target):
@@ -228,6 +521,138 @@ class ProcessPoolServer(PoolServer):
             t.daemon = True
             t.start()
 
+def libc_version():
+    # The first version libc has (i.e. GLIBC_2.2.5 on x86_64),
+    # which is the one for calls as old as it is. We get it
+    # from the version definitions in the library itself.
+    path = None
+    for line in open("/proc/self/maps"):
+        fields = line.split()
+        if len(fields) >= 6 and \
+           os.path.basename(fields[5]).startswith(("libc.so", "libc-")):
+            path = fields[5]
+            break
+    data = open(path, "rb").read()
+    order = data[5] == "\x02" and ">" or "<"
+    if data[4] == "\x02":
+        shoff, = struct.unpack_from(order + "Q", data, 0x28)
+        shentsize, shnum = struct.unpack_from(order + "HH", data, 0x3a)
+        shdr = order + "IIQQQQIIQQ"
+    else:
+        shoff, = struct.unpack_from(order + "I", data, 0x20)
+        shentsize, shnum = struct.unpack_from(order + "HH", data, 0x2e)
+        shdr = order + "IIIIIIIIII"
+    sections = [struct.unpack_from(shdr, data, shoff + i * shentsize)
+                for i in range(shnum)]
+    SHT_GNU_VERDEF = 0x6ffffffd
+    VER_FLG_BASE = 0x1
+    for section in sections:
+        if section[1] != SHT_GNU_VERDEF:
+            continue
+        strtab = sections[section[6]][4]
+        offset = section[4]
+        best = None
+        for _ in range(section[7]):
+            _, flags, ndx, _, _, aux, next = \
+                struct.unpack_from(order + "HHHHIII", data, offset)
+            name, = struct.unpack_from(order + "I", data, offset + aux)
+            if not (flags & VER_FLG_BASE) and (best is None or ndx < best[0]):
+                start = strtab + name
+                best = (ndx, data[start:data.index("\0", start)])
+            offset += next
+        return best[1]
+    return None
+
+def libc_function(name, version=None, restype=ctypes.c_int):
+    # Look it up the way the program would be linked
+    # against it (huptime's copies are versioned, so
+    # a plain dlsym() would find the libc ones).
+    if version is None:
+        version = libc_version()
+    libc = ctypes.CDLL(None, use_errno=True)
+    libc.dlvsym.restype = ctypes.c_void_p
+    fn = libc.dlvsym(None, name, version)
+    return ctypes.CFUNCTYPE(restype, use_errno=True)(fn)
+
+class SpawnServer(ThreadServer):
+
+    """
+    A server which has a child answer pings, made with
+    posix_spawn() (which glibc does with a vfork()-like
+    clone, sharing our memory until it calls exec()).
+    """
+
+    def pong(self, client):
+        libc = ctypes.CDLL(None, use_errno=True)
+        actions = ctypes.create_string_buffer(256)
+        libc.posix_spawn_file_actions_init(actions)
+        libc.posix_spawn_file_actions_adddup2(actions, client.fileno(), 1)
+        libc.posix_spawn_file_actions_addclose(actions, self._sock.fileno())
+        argv = (ctypes.c_char_p * 3)("printf", "pong", None)
+        env = ["%s=%s" % item for item in os.environ.items()]
+        envp = (ctypes.c_char_p * (len(env) + 1))(*(env + [None]))
+        pid = ctypes.c_int()
+        rval = libc.posix_spawnp(
+            ctypes.byref(pid), "printf", actions, None, argv, envp)
+        libc.posix_spawn_file_actions_destroy(actions)
+        assert rval == 0
+        sys.stderr.write("%s: spawned %d\n" % (self, pid.value))
+        os.waitpid(pid.value, 0)
+
+# System call numbers for SyscallServer, for
+# every architecture that huptime builds on.
+SYSCALLS = {
+    "x86_64": {"bind": 49, "listen": 50, "accept4": 288, "close": 3},
+    "i386": {"bind": 361, "listen": 363, "accept4": 364, "close": 6},
+    "i686": {"bind": 361, "listen": 363, "accept4": 364, "close": 6},
+}
+
+class SyscallServer(SimpleServer):
+
+    """
+    A server that makes the calls huptime cares about
+    with syscall(), as statically linked runtimes do.
+    """
+
+    def __init__(self, *args, **kwargs):
+        super(SyscallServer, self).__init__(*args, **kwargs)
+        self._fn = libc_function("syscall", restype=ctypes.c_long)
+        self._numbers = SYSCALLS[platform.machine()]
+
+    def _syscall(self, name, *args):
+        rval = self._fn(self._numbers[name], *args)
+        if rval < 0:
+            err = ctypes.get_errno()
+            raise socket.error(err, os.strerror(err))
+        return rval
+
+    def bind(self, host=None, port=None):
+        if host is None:
+            host = DEFAULT_HOST
+        if port is None:
+            port = DEFAULT_PORT
+        sys.stderr.write("%s: bind()\n" % self)
+        self._sock.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
+        addr = struct.pack("=HH4s8x",
+            socket.AF_INET,
+            socket.htons(port),
+            socket.inet_aton(host or "0.0.0.0"))
+        self._syscall("bind", self._sock.fileno(), addr, len(addr))
+
+    def listen(self, backlog=None):
+        if backlog is None:
+            backlog = DEFAULT_BACKLOG
+        sys.stderr.write("%s: listen()\n" % self)
+        self._syscall("listen", self._sock.fileno(), backlog)
+
+    def accept(self):
+        sys.stderr.write("%s: accept()\n" % self)
+        fd = self._syscall("accept4", self._sock.fileno(), None, None, 0)
+        try:
+            return socket.fromfd(fd, socket.AF_INET, socket.SOCK_STREAM)
+        finally:
+            self._syscall("close", fd)
+
 SERVERS = [
     SimpleServer,
     EventServer,
@@ -235,4 +660,10 @@ SERVERS = [
     ProcessServer,
     ThreadPoolServer,
     ProcessPoolServer,
+    FcntlServer,
+    CloseRangeServer,
+    SpawnServer,
 ]
+
+if platform.machine() in SYSCALLS:
+    SERVERS.append(SyscallServer)
@@ -0,0 +1,100 @@
+#
+# Copyright 2013 Adin Scannell <adin@scannell.ca>, all rights reserved.
+#
+# This file is part of Huptime.
+#
+# Huptime is free software: you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation, either version 3 of the License, or
+# (at your option) any later version.
+#
+# Huptime is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with Huptime.  If not, see <http://www.gnu.org/licenses/>.
+#
+"""
+Test datagram sockets.
+
+The server answers for its cookie over UDP as
+well, and we check that the new copy picks up
+the socket across a restart.
+"""
+
+import socket
+import threading
+import pytest
+
+import harness
+import servers
+import modes
+
+# The seccomp engine has to tell the UDP socket apart
+# from the TCP listener on the same port, too.
+@pytest.fixture(params=map(lambda x: x.__name__, modes.MODES + [modes.Seccomp]))
+def mode(request):
+    """ A mode object. """
+    return getattr(modes, request.param)
+
+@pytest.fixture(params=map(lambda x: x.__name__, modes.MODES))
+def preload_mode(request):
+    """ A mode object, without the seccomp engine. """
+    return getattr(modes, request.param)
+
+def cookie():
+    s = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+    s.settimeout(10.0)
+    try:
+        s.sendto("cookie", ("127.0.0.1", servers.DEFAULT_PORT))
+        return s.recv(1024)
+    finally:
+        s.close()
+
+def check(old_cookie, new_cookie):
+    # An old copy that was already waiting in recvfrom()
+    # when it was restarted may still answer once.
+    for _ in range(3):
+        answer = cookie()
+        assert answer in [old_cookie, new_cookie]
+        if answer == new_cookie:
+            return
+    assert False
+
+def test_restart(mode):
+    h = harness.Harness(mode, servers.DatagramServer)
+    try:
+        check(None, h._cookie)
+        for _ in range(2):
+            old_cookie = h._cookie
+            h.restart()
+            check(old_cookie, h._cookie)
+    finally:
+        h.stop()
+
+def test_late_reply(preload_mode):
+    # A reply sent by the old copy after the restart should
+    # still come from the port that the request was sent to.
+    # We hold a connection open so that the old copy is still
+    # around to send it (and let it go once it has).
+    h = harness.Harness(preload_mode, servers.DatagramServer)
+    held = socket.create_connection(("127.0.0.1", servers.DEFAULT_PORT))
+    s = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+    s.settimeout(10.0)
+    try:
+        old_cookie = h._cookie
+        s.sendto("late", ("127.0.0.1", servers.DEFAULT_PORT))
+        t = threading.Thread(target=h.restart)
+        t.daemon = True
+        t.start()
+        answer, addr = s.recvfrom(1024)
+        assert answer == old_cookie
+        assert addr[1] == servers.DEFAULT_PORT
+        held.close()
+        t.join()
+    finally:
+        held.close()
+        s.close()
+        h.stop()
@@ -0,0 +1,63 @@
+#
+# Copyright 2013 Adin Scannell <adin@scannell.ca>, all rights reserved.
+#
+# This file is part of Huptime.
+#
+# Huptime is free software: you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation, either version 3 of the License, or
+# (at your option) any later version.
+#
+# Huptime is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with Huptime.  If not, see <http://www.gnu.org/licenses/>.
+#
+"""
+Test per-listener drain deadlines.
+
+We hold a connection open across a restart. It
+should be cut only if the deadline (--drain) is
+for the port it came in on.
+"""
+
+import time
+
+import harness
+import servers
+import modes
+import client
+
+def test_deadline():
+    h = harness.Harness(modes.Drain, servers.ThreadServer)
+    try:
+        held = client.Client()
+        held.ping()
+        h.restart()
+
+        # The old copy hangs up once the deadline passes.
+        start = time.time()
+        assert held.closed(timeout=10.0)
+        assert time.time() - start < 5.0
+
+        # And the port is still served.
+        h.restart()
+    finally:
+        h.stop()
+
+def test_other_port():
+    h = harness.Harness(modes.DrainOther, servers.ThreadServer)
+    try:
+        held = client.Client()
+        held.ping()
+        h.restart()
+
+        # Well past the deadline, it's still being served.
+        assert not held.closed(timeout=2.0)
+        held.ping()
+        held.drop()
+    finally:
+        h.stop()
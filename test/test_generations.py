@@ -0,0 +1,53 @@
+#
+# Copyright 2013 Adin Scannell <adin@scannell.ca>, all rights reserved.
+#
+# This file is part of Huptime.
+#
+# Huptime is free software: you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation, either version 3 of the License, or
+# (at your option) any later version.
+#
+# Huptime is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with Huptime.  If not, see <http://www.gnu.org/licenses/>.
+#
+"""
+Test limits on draining copies.
+
+We hold a connection open to each copy. With only
+one older copy allowed to drain (see modes.MaxDraining),
+the second restart waits on the first copy, then has
+it finish up, and goes ahead.
+"""
+
+import time
+
+import harness
+import servers
+import modes
+import client
+
+def test_max_draining():
+    h = harness.Harness(modes.MaxDraining, servers.ThreadServer)
+    try:
+        first = client.Client()
+        first.ping()
+        h.restart()
+        second = client.Client()
+        second.ping()
+
+        start = time.time()
+        h.restart()
+        assert first.closed(timeout=10.0)
+        assert time.time() - start < 10.0
+
+        # The copy before is left alone.
+        second.ping()
+        second.drop()
+    finally:
+        h.stop()
@@ -0,0 +1,50 @@
+#
+# Copyright 2013 Adin Scannell <adin@scannell.ca>, all rights reserved.
+#
+# This file is part of Huptime.
+#
+# Huptime is free software: you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation, either version 3 of the License, or
+# (at your option) any later version.
+#
+# Huptime is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with Huptime.  If not, see <http://www.gnu.org/licenses/>.
+#
+"""
+Test connection handoff.
+
+We hold a connection open across a restart. The
+server hands it off (see servers.HandoffServer),
+so it should be served by the new copy after.
+"""
+
+import pytest
+
+import harness
+import servers
+import modes
+import client
+
+@pytest.fixture(params=map(lambda x: x.__name__, modes.MODES))
+def mode(request):
+    """ A mode object. """
+    return getattr(modes, request.param)
+
+def test_handoff(mode):
+    h = harness.Harness(mode, servers.HandoffServer)
+    try:
+        held = client.Client()
+        assert held.cookie() == h._cookie
+        h.restart()
+        assert held.cookie() == h._cookie
+        h.restart()
+        assert held.cookie() == h._cookie
+        held.drop()
+    finally:
+        h.stop()
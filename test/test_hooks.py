@@ -0,0 +1,53 @@
+#
+# Copyright 2013 Adin Scannell <adin@scannell.ca>, all rights reserved.
+#
+# This file is part of Huptime.
+#
+# Huptime is free software: you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation, either version 3 of the License, or
+# (at your option) any later version.
+#
+# Huptime is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with Huptime.  If not, see <http://www.gnu.org/licenses/>.
+#
+"""
+Test restart hooks.
+
+The server registers hooks (see servers.HookServer)
+and we check that each one runs on every restart. This
+is exec mode only: in fork mode, HUPTIME_PRE_EXEC runs
+in a forked copy with only one thread, where Python
+can't be called back safely.
+"""
+
+import os
+
+import harness
+import servers
+import modes
+import client
+
+def hooked():
+    with open(servers.DEFAULT_HOOKS) as f:
+        return map(lambda x: int(x.split()[1]), f.readlines())
+
+def test_exec():
+    if os.path.exists(servers.DEFAULT_HOOKS):
+        os.unlink(servers.DEFAULT_HOOKS)
+    h = harness.Harness(modes.Exec, servers.HookServer)
+    try:
+        h.restart()
+        h.restart()
+        events = hooked()
+        assert events.count(servers.HUPTIME_POST_HANDOFF) == 2
+        assert events.count(servers.HUPTIME_PRE_EXEC) == 2
+    finally:
+        h.stop()
+        if os.path.exists(servers.DEFAULT_HOOKS):
+            os.unlink(servers.DEFAULT_HOOKS)
@@ -0,0 +1,69 @@
+#
+# Copyright 2013 Adin Scannell <adin@scannell.ca>, all rights reserved.
+#
+# This file is part of Huptime.
+#
+# Huptime is free software: you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation, either version 3 of the License, or
+# (at your option) any later version.
+#
+# Huptime is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with Huptime.  If not, see <http://www.gnu.org/licenses/>.
+#
+"""
+Test hybrid mode.
+
+An event loop comes back to accept() on a restart, which
+is where hybrid mode splits. The proxy has threads of its
+own though, so this should carry on just like exec mode.
+"""
+
+import time
+import threading
+
+import harness
+import servers
+import modes
+import client
+
+def test_event():
+    h = harness.Harness(modes.Hybrid, servers.EventServer)
+    try:
+        h.restart()
+        h.restart()
+    finally:
+        h.stop()
+
+def test_threads():
+    h = harness.Harness(modes.Hybrid, servers.EventServer)
+    try:
+        # Hold a connection, so there's something to split off.
+        old_cookie = h._cookie
+        c = client.Client()
+        c.ping()
+        errors = []
+        def restart():
+            try:
+                h.restart()
+            except Exception as e:
+                errors.append(e)
+        t = threading.Thread(target=restart)
+        t.daemon = True
+        t.start()
+        time.sleep(1.0)
+
+        # Nothing was split off, so we're still here
+        # (and the restart waits on us, as in exec mode).
+        assert t.isAlive()
+        assert c.cookie() == old_cookie
+        c.drop()
+        t.join()
+        assert not errors
+    finally:
+        h.stop()
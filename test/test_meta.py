@@ -46,6 +46,11 @@ def mode(request):
     """ A mode object. """
     return getattr(modes, request.param)
 
+@pytest.fixture(params=map(lambda x: x.__name__, modes.FEATURES))
+def feature(request):
+    """ A mode object, with some feature on. """
+    return getattr(modes, request.param)
+
 def test_thrice(mode, server):
     h = harness.Harness(mode, server)
     try:
@@ -54,3 +59,11 @@ def test_thrice(mode, server):
         h.restart()
     finally:
         h.stop()
+
+def test_feature(feature):
+    h = harness.Harness(feature, servers.ThreadServer)
+    try:
+        h.restart()
+        h.restart()
+    finally:
+        h.stop()
@@ -0,0 +1,87 @@
+#
+# Copyright 2013 Adin Scannell <adin@scannell.ca>, all rights reserved.
+#
+# This file is part of Huptime.
+#
+# Huptime is free software: you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation, either version 3 of the License, or
+# (at your option) any later version.
+#
+# Huptime is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with Huptime.  If not, see <http://www.gnu.org/licenses/>.
+#
+"""
+Test sizing the pool in multi mode.
+
+With a range (--multi=<min>:<max>), bin/huptime adds a worker
+while connections are waiting to be accepted, and retires it
+again once things are quiet. The retired worker should stop
+listening and let its connections finish, then exit without
+starting a new copy.
+"""
+
+import os
+import time
+
+import harness
+import servers
+import modes
+import client
+
+def wait_for(fn, timeout=15.0):
+    until = time.time() + timeout
+    while time.time() < until:
+        if fn():
+            return True
+        time.sleep(0.1)
+    return False
+
+def test_scale():
+    open(servers.DEFAULT_HOLD, 'w').close()
+    h = harness.Harness(modes.Multi, servers.HoldServer)
+    try:
+        # Nothing is waiting, so there's just the one.
+        time.sleep(1.0)
+        gens = h.generations()
+        assert len(gens) == 1
+        first = gens[0]["pid"]
+
+        # Now there is, so there's another.
+        waiting = [client.Client() for _ in range(2)]
+        assert wait_for(lambda: len(h.generations()) == 2)
+        second = [gen["pid"] for gen in h.generations()
+                  if gen["pid"] != first][0]
+
+        # Once they're through, the pool is quiet.
+        os.unlink(servers.DEFAULT_HOLD)
+        for c in waiting:
+            c.ping()
+        clients = [client.Client() for _ in range(servers.DEFAULT_N)]
+        for c in clients:
+            c.ping()
+
+        # So the new one is retired. It's still around
+        # for its connections (which are all still good).
+        def retiring():
+            return dict((gen["pid"], gen["draining"])
+                        for gen in h.generations()) == \
+                {first: False, second: True}
+        assert wait_for(retiring)
+        for c in clients + waiting:
+            c.ping()
+
+        # Once it's done, it's gone (with nobody after it).
+        for c in clients + waiting:
+            c.drop()
+        assert wait_for(lambda: not os.path.exists("/proc/%d" % second))
+        assert [gen["pid"] for gen in h.generations()] == [first]
+    finally:
+        if os.path.exists(servers.DEFAULT_HOLD):
+            os.unlink(servers.DEFAULT_HOLD)
+        h.stop()
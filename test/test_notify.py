@@ -0,0 +1,83 @@
+#
+# Copyright 2013 Adin Scannell <adin@scannell.ca>, all rights reserved.
+#
+# This file is part of Huptime.
+#
+# Huptime is free software: you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation, either version 3 of the License, or
+# (at your option) any later version.
+#
+# Huptime is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with Huptime.  If not, see <http://www.gnu.org/licenses/>.
+#
+"""
+Test supervisor interop.
+
+The modes stand in for systemd (see modes.Notify),
+and we check what comes back over NOTIFY_SOCKET
+as the server is restarted.
+"""
+
+import pytest
+
+import harness
+import servers
+import modes
+import client
+
+@pytest.fixture(params=["NotifyFork", "NotifyExec"])
+def mode(request):
+    """ A mode object. """
+    return getattr(modes, request.param)
+
+def test_restart(mode):
+    h = harness.Harness(mode, servers.SimpleServer)
+    try:
+        notify = h._mode
+        msg = notify.notified()
+        assert msg.get("READY") == "1"
+        pid = h.getpid()
+        assert int(msg["MAINPID"]) == pid
+
+        h.restart()
+        msg = notify.notified()
+        assert msg.get("RELOADING") == "1"
+        assert int(msg["MONOTONIC_USEC"]) > 0
+
+        # The new copy is ready once it accepts.
+        msg = notify.notified()
+        assert msg.get("READY") == "1"
+        assert int(msg["MAINPID"]) == h.getpid()
+    finally:
+        h.stop()
+
+def test_quit():
+    # The old copy exits by itself once it starts draining
+    # (rather than waiting for the connection we hold), but
+    # the new copy is still running, so no STOPPING.
+    h = harness.Harness(modes.NotifyFork, servers.QuitServer)
+    try:
+        notify = h._mode
+        msg = notify.notified()
+        assert msg.get("READY") == "1"
+
+        held = client.Client()
+        assert held.cookie() == h._cookie
+        h.restart()
+        assert held.closed(timeout=10.0)
+        states = []
+        msg = notify.notified()
+        while msg is not None:
+            states.append(msg)
+            msg = notify.notified(timeout=2.0)
+        assert any(map(lambda x: x.get("READY") == "1", states))
+        assert not any(map(lambda x: "STOPPING" in x, states))
+        assert int(states[-1]["MAINPID"]) == h.getpid()
+    finally:
+        h.stop()
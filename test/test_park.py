@@ -0,0 +1,72 @@
+#
+# Copyright 2013 Adin Scannell <adin@scannell.ca>, all rights reserved.
+#
+# This file is part of Huptime.
+#
+# Huptime is free software: you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation, either version 3 of the License, or
+# (at your option) any later version.
+#
+# Huptime is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with Huptime.  If not, see <http://www.gnu.org/licenses/>.
+#
+"""
+Test parking connections in exec mode.
+
+While the old copy drains, nobody accepts new connections.
+With a backlog of one, most of these would be left waiting
+on the kernel. Instead they're parked, and handed out to the
+next copy. Its event loop only calls accept() once select()
+says so, which has to keep working until they're all gone.
+"""
+
+import time
+import socket
+import threading
+
+import harness
+import servers
+import modes
+import client
+
+def test_park():
+    h = harness.Harness(modes.Park, servers.EventServer, backlog=1)
+    try:
+        # Hold a connection, so the old copy drains.
+        c = client.Client()
+        c.ping()
+        errors = []
+        def restart():
+            try:
+                h.restart()
+            except Exception as e:
+                errors.append(e)
+        t = threading.Thread(target=restart)
+        t.daemon = True
+        t.start()
+        time.sleep(1.0)
+        assert t.isAlive()
+
+        # Well past the backlog.
+        parked = []
+        for i in range(16):
+            parked.append(socket.create_connection(
+                ("localhost", servers.DEFAULT_PORT), 0.5))
+
+        # They all go to the next copy.
+        c.drop()
+        t.join()
+        assert not errors
+        for s in parked:
+            s.settimeout(5.0)
+            s.send("cookie")
+            assert s.recv(1024) == h._cookie
+            s.close()
+    finally:
+        h.stop()
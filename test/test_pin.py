@@ -0,0 +1,71 @@
+#
+# Copyright 2013 Adin Scannell <adin@scannell.ca>, all rights reserved.
+#
+# This file is part of Huptime.
+#
+# Huptime is free software: you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation, either version 3 of the License, or
+# (at your option) any later version.
+#
+# Huptime is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with Huptime.  If not, see <http://www.gnu.org/licenses/>.
+#
+"""
+Test pinning workers in multi mode.
+
+The worker should run only on its CPU, and have connections
+that CPU receives steered to its socket. It should keep both
+across a restart.
+"""
+
+import os
+import subprocess
+
+import harness
+import servers
+import modes
+
+HUPTIME = os.path.join(os.path.dirname(__file__), "..", "bin", "huptime")
+
+def huptime(*args):
+    proc = subprocess.Popen(
+        [HUPTIME] + list(args),
+        stdout=subprocess.PIPE,
+        stderr=subprocess.PIPE)
+    (out, err) = proc.communicate()
+    return (proc.returncode, out + err)
+
+def cpus(pid):
+    for line in open("/proc/%d/status" % pid):
+        if line.startswith("Cpus_allowed_list:"):
+            return line.split()[1]
+    return None
+
+def test_pin():
+    h = harness.Harness(modes.Pin, servers.ThreadServer)
+    try:
+        for i in range(2):
+            assert cpus(h.getpid()) == "0"
+            assert h.incoming_cpu() == 0
+            h.restart()
+    finally:
+        h.stop()
+
+def test_pin_without_multi():
+    # Everything would be on the one CPU.
+    (rc, output) = huptime("--pin=0", "true")
+    assert rc == 1
+    assert "without --multi" in output
+
+def test_pin_high_cpu():
+    # There's no such CPU, but we can still ask for it.
+    (rc, output) = huptime("--multi=1", "--pin=2000", "true")
+    assert rc == 0
+    assert "unable to pin to CPU 2000" in output
+    assert "Traceback" not in output
@@ -0,0 +1,54 @@
+#
+# Copyright 2013 Adin Scannell <adin@scannell.ca>, all rights reserved.
+#
+# This file is part of Huptime.
+#
+# Huptime is free software: you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation, either version 3 of the License, or
+# (at your option) any later version.
+#
+# Huptime is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with Huptime.  If not, see <http://www.gnu.org/licenses/>.
+#
+"""
+Test warm state regions.
+
+Each copy of the server passes its cookie on to the
+next (see servers.RegionServer), which notes it down.
+"""
+
+import os
+import pytest
+
+import harness
+import servers
+import modes
+import client
+
+@pytest.fixture(params=map(lambda x: x.__name__, modes.MODES))
+def mode(request):
+    """ A mode object. """
+    return getattr(modes, request.param)
+
+def test_restart(mode):
+    if os.path.exists(servers.DEFAULT_REGIONS):
+        os.unlink(servers.DEFAULT_REGIONS)
+    h = harness.Harness(mode, servers.RegionServer)
+    try:
+        cookies = [h._cookie]
+        h.restart()
+        cookies.append(h._cookie)
+        h.restart()
+        with open(servers.DEFAULT_REGIONS) as f:
+            passed = map(lambda x: x.strip(), f.readlines())
+        assert passed == cookies
+    finally:
+        h.stop()
+        if os.path.exists(servers.DEFAULT_REGIONS):
+            os.unlink(servers.DEFAULT_REGIONS)
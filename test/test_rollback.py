@@ -0,0 +1,56 @@
+#
+# Copyright 2013 Adin Scannell <adin@scannell.ca>, all rights reserved.
+#
+# This file is part of Huptime.
+#
+# Huptime is free software: you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation, either version 3 of the License, or
+# (at your option) any later version.
+#
+# Huptime is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with Huptime.  If not, see <http://www.gnu.org/licenses/>.
+#
+"""
+Test rolling back a restart.
+
+The new copy fails to start (see servers.BrokenServer),
+so the old one should carry on as if nothing happened,
+and a later restart should still work.
+"""
+
+import os
+import time
+
+import harness
+import servers
+import modes
+import client
+
+def test_rollback():
+    if os.path.exists(servers.DEFAULT_BROKEN):
+        os.unlink(servers.DEFAULT_BROKEN)
+    h = harness.Harness(modes.Rollback, servers.BrokenServer)
+    try:
+        pid = h.getpid()
+        open(servers.DEFAULT_BROKEN, "w").close()
+        h._proxy.restart()
+        time.sleep(1.0)
+        os.unlink(servers.DEFAULT_BROKEN)
+
+        # Still the same copy.
+        assert client.Client().cookie() == h._cookie
+        assert h.getpid() == pid
+
+        # And it can be restarted for real.
+        h.restart()
+        assert h.getpid() != pid
+    finally:
+        h.stop()
+        if os.path.exists(servers.DEFAULT_BROKEN):
+            os.unlink(servers.DEFAULT_BROKEN)
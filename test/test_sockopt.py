@@ -0,0 +1,67 @@
+#
+# Copyright 2013 Adin Scannell <adin@scannell.ca>, all rights reserved.
+#
+# This file is part of Huptime.
+#
+# Huptime is free software: you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation, either version 3 of the License, or
+# (at your option) any later version.
+#
+# Huptime is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with Huptime.  If not, see <http://www.gnu.org/licenses/>.
+#
+"""
+Test carrying socket options across restarts.
+
+The new copy gets the old copy's socket back from bind(),
+so an option it sets beforehand has to be set again on
+that one. And once it stops setting it, it's put back.
+"""
+
+import os
+
+import harness
+import servers
+import modes
+
+def test_sockopt():
+    if os.path.exists(servers.DEFAULT_SOCKOPT):
+        os.unlink(servers.DEFAULT_SOCKOPT)
+    h = harness.Harness(modes.Fork, servers.SockoptServer)
+    try:
+        assert h.sockopt() == 0
+
+        # Set it in the next copy.
+        open(servers.DEFAULT_SOCKOPT, 'w').close()
+        h.restart()
+        assert h.sockopt() != 0
+
+        # And not in the one after that.
+        os.unlink(servers.DEFAULT_SOCKOPT)
+        h.restart()
+        assert h.sockopt() == 0
+    finally:
+        h.stop()
+        if os.path.exists(servers.DEFAULT_SOCKOPT):
+            os.unlink(servers.DEFAULT_SOCKOPT)
+
+def test_sockopt_first():
+    # The same, where it's the copy started first that sets it.
+    open(servers.DEFAULT_SOCKOPT, 'w').close()
+    h = harness.Harness(modes.Fork, servers.SockoptServer)
+    try:
+        assert h.sockopt() != 0
+
+        os.unlink(servers.DEFAULT_SOCKOPT)
+        h.restart()
+        assert h.sockopt() == 0
+    finally:
+        h.stop()
+        if os.path.exists(servers.DEFAULT_SOCKOPT):
+            os.unlink(servers.DEFAULT_SOCKOPT)
@@ -0,0 +1,60 @@
+#
+# Copyright 2013 Adin Scannell <adin@scannell.ca>, all rights reserved.
+#
+# This file is part of Huptime.
+#
+# Huptime is free software: you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation, either version 3 of the License, or
+# (at your option) any later version.
+#
+# Huptime is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with Huptime.  If not, see <http://www.gnu.org/licenses/>.
+#
+"""
+Test keeping a standby.
+
+The next copy should already be running (held at its
+first accept) before we restart, and be the one that
+takes over. Then another standby takes its place.
+"""
+
+import os
+import time
+
+import harness
+import servers
+import modes
+
+def standby(pid, timeout=10.0):
+    # The standby is started by the running copy.
+    until = time.time() + timeout
+    while time.time() < until:
+        for entry in os.listdir("/proc"):
+            if not entry.isdigit():
+                continue
+            try:
+                stat = open("/proc/%s/stat" % entry).read()
+            except IOError:
+                continue
+            if int(stat.rsplit(")", 1)[1].split()[1]) == pid:
+                return int(entry)
+        time.sleep(0.1)
+    return None
+
+def test_standby():
+    h = harness.Harness(modes.Standby, servers.ThreadServer)
+    try:
+        for i in range(2):
+            pid = h.getpid()
+            next_pid = standby(pid)
+            assert next_pid is not None
+            h.restart()
+            assert h.getpid() == next_pid
+    finally:
+        h.stop()
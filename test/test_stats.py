@@ -0,0 +1,67 @@
+#
+# Copyright 2013 Adin Scannell <adin@scannell.ca>, all rights reserved.
+#
+# This file is part of Huptime.
+#
+# Huptime is free software: you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation, either version 3 of the License, or
+# (at your option) any later version.
+#
+# Huptime is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with Huptime.  If not, see <http://www.gnu.org/licenses/>.
+#
+"""
+Test the timings written with --stats.
+
+Each restart should account for the exec() of the
+next copy, whether it's done in place or by a child.
+"""
+
+import os
+import json
+import time
+import pytest
+
+import harness
+import servers
+import modes
+
+@pytest.fixture(params=["StatsFork", "StatsExec"])
+def mode(request):
+    """ A mode object. """
+    return getattr(modes, request.param)
+
+def phases(name):
+    if not os.path.exists(servers.DEFAULT_STATS):
+        return []
+    lines = [json.loads(line) for line in open(servers.DEFAULT_STATS)]
+    return [line for line in lines if line["phase"] == name]
+
+def test_exec(mode):
+    if os.path.exists(servers.DEFAULT_STATS):
+        os.unlink(servers.DEFAULT_STATS)
+    h = harness.Harness(mode, servers.ThreadServer)
+    try:
+        for i in range(2):
+            h.restart()
+
+        # The parent may still be writing its own, in fork mode.
+        for _ in range(50):
+            if len(phases("exec")) >= 2:
+                break
+            time.sleep(0.1)
+        execs = phases("exec")
+        assert len(execs) == 2
+        assert execs[0]["generation"] != execs[1]["generation"]
+        for line in execs:
+            assert line["us"] >= 0
+    finally:
+        h.stop()
+        if os.path.exists(servers.DEFAULT_STATS):
+            os.unlink(servers.DEFAULT_STATS)
@@ -0,0 +1,57 @@
+#
+# Copyright 2013 Adin Scannell <adin@scannell.ca>, all rights reserved.
+#
+# This file is part of Huptime.
+#
+# Huptime is free software: you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation, either version 3 of the License, or
+# (at your option) any later version.
+#
+# Huptime is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with Huptime.  If not, see <http://www.gnu.org/licenses/>.
+#
+"""
+Test unix domain listeners.
+
+The server listens on a unix socket as well (and
+removes the path before binding), and we check that
+the path keeps working across restarts.
+"""
+
+import socket
+import pytest
+
+import harness
+import servers
+import modes
+
+@pytest.fixture(params=map(lambda x: x.__name__, modes.MODES))
+def mode(request):
+    """ A mode object. """
+    return getattr(modes, request.param)
+
+def cookie():
+    s = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+    s.settimeout(10.0)
+    try:
+        s.connect(servers.DEFAULT_PATH)
+        s.send("cookie")
+        return s.recv(1024)
+    finally:
+        s.close()
+
+def test_restart(mode):
+    h = harness.Harness(mode, servers.UnixServer)
+    try:
+        assert cookie() == h._cookie
+        for _ in range(2):
+            h.restart()
+            assert cookie() == h._cookie
+    finally:
+        h.stop()